@@ -38,6 +38,8 @@ typedef struct {
 
 #define BIT_CHECK(x, n) ((x) & (1 << (n)))
 
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
 #define eprintf(...) fprintf(stderr, __VA_ARGS__)
 
 #endif /* common_h */
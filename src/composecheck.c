@@ -0,0 +1,204 @@
+#include "common.h"
+#include <unistd.h>
+
+#include "f/compose.h"
+
+// Feeds background and sprite lines through both scanline compositors, and
+// checks that the vectorized one gives the same palette addresses and sprite 0
+// hit as the scalar one. Edge cases come first, on every length up to a bit
+// more than a scanline, then random lines at random alignments.
+
+#define DEFAULT_LINES 100000
+#define DEFAULT_SEED 1
+#define MAX_LENGTH (WIDTH + 40)
+#define MAX_OFFSET 15
+// Written past the end of the outputs, to catch the kernels overrunning them
+#define CANARY 0xA5
+
+typedef enum {
+    EDGE_TRANSPARENT = 0,
+    EDGE_UNDER_BG,
+    EDGE_ZERO_OVER_OPAQUE,
+    EDGE_ZERO_OVER_CLEAR,
+    EDGE_ZERO_LAST_PIXEL,
+    EDGES_LEN
+} EdgeCase;
+
+static const char *const edge_names[] = {
+    "all transparent",
+    "sprites under an opaque background",
+    "sprite 0 over an opaque background",
+    "sprite 0 over a clear background",
+    "sprite 0 on the last pixel only"
+};
+
+static uint32_t seed;
+
+// xorshift32, to get the same lines everywhere for a given seed
+static uint32_t next_random(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+// Palette 0-3 above a color index 1-3
+static uint8_t opaque_bg(void) {
+    uint32_t r = next_random();
+    return ((r >> 8) & 0b1100) | (1 + r % 3);
+}
+
+// Palette and priority of a sprite, with a color index 1-3
+static uint8_t opaque_spr(void) {
+    uint32_t r = next_random();
+    return ((r >> 8) & (0b11 | OAM_ATTR_UNDER_BG)) | ((1 + r % 3) << 2);
+}
+
+static void fill_edge_case(EdgeCase edge, uint8_t *bg, uint8_t *spr, int len) {
+    for (int i = 0; i < len; i++) {
+        switch (edge) {
+            case EDGE_TRANSPARENT:
+                bg[i] = 0;
+                spr[i] = 0;
+                break;
+            case EDGE_UNDER_BG:
+                bg[i] = opaque_bg();
+                spr[i] = opaque_spr() | OAM_ATTR_UNDER_BG;
+                break;
+            case EDGE_ZERO_OVER_OPAQUE:
+                bg[i] = opaque_bg();
+                spr[i] = opaque_spr() | SPR_PIXEL_ZERO;
+                break;
+            case EDGE_ZERO_OVER_CLEAR:
+                bg[i] = opaque_bg() & 0b1100;
+                spr[i] = opaque_spr() | SPR_PIXEL_ZERO;
+                break;
+            case EDGE_ZERO_LAST_PIXEL:
+                bg[i] = opaque_bg();
+                spr[i] = opaque_spr();
+                if (i == len - 1) {
+                    spr[i] |= SPR_PIXEL_ZERO;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static bool expected_hit(EdgeCase edge, int len) {
+    return len > 0 && (edge == EDGE_ZERO_OVER_OPAQUE ||
+                       edge == EDGE_ZERO_LAST_PIXEL);
+}
+
+// Mostly the pixels the PPU draws, with a few transparent sprite pixels (or
+// background ones) in between, and sometimes any byte at all
+static void fill_random(uint8_t *bg, uint8_t *spr, int len) {
+    bool any_byte = !(next_random() % 4);
+    for (int i = 0; i < len; i++) {
+        uint32_t r = next_random();
+        if (any_byte) {
+            bg[i] = r;
+            spr[i] = r >> 8;
+            continue;
+        }
+        bg[i] = (r & 0b11) ? opaque_bg() : 0;
+        spr[i] = (r & 0b1100) ? 0 : opaque_spr();
+        if (spr[i] && !(r & 0b110000)) {
+            spr[i] |= SPR_PIXEL_ZERO;
+        }
+    }
+}
+
+// Returns whether both compositors agree on the line (and on the hit expected,
+// if not negative)
+static bool check_line(const char *name, const uint8_t *bg, const uint8_t *spr,
+                       int len, int expected) {
+    uint8_t outs[2][MAX_LENGTH + 1];
+    memset(outs, CANARY, sizeof(outs));
+    bool hits[2] = {
+        compose_span(bg, spr, outs[0], len),
+        compose_line(bg, spr, outs[1], len)
+    };
+    
+    int pixel = -1;
+    for (int i = 0; i <= len && pixel < 0; i++) {
+        if (outs[0][i] != outs[1][i]) {
+            pixel = i;
+        }
+    }
+    if (pixel < 0 && hits[0] == hits[1] &&
+        (expected < 0 || hits[0] == expected)) {
+        return true;
+    }
+    printf("Mismatch on %s, %d pixels long:\n", name, len);
+    if (pixel == len) {
+        printf("Output overrun: %02x (scalar), %02x (vector)\n", outs[0][len],
+               outs[1][len]);
+    } else if (pixel >= 0) {
+        printf("Pixel %d of bg %02x, spr %02x: %02x (scalar), %02x (vector)\n",
+               pixel, bg[pixel], spr[pixel], outs[0][pixel], outs[1][pixel]);
+    }
+    if (hits[0] != hits[1] || (expected >= 0 && hits[0] != expected)) {
+        printf("Sprite 0 hit: %d (scalar), %d (vector)", hits[0], hits[1]);
+        if (expected >= 0) {
+            printf(", %d expected", expected);
+        }
+        printf("\n");
+    }
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    int lines = DEFAULT_LINES;
+    uint32_t first_seed = DEFAULT_SEED;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        if (opt == 'n' && atoi(optarg) >= 0) {
+            lines = atoi(optarg);
+        } else if (opt == 's' && strtoul(optarg, NULL, 0)) {
+            first_seed = strtoul(optarg, NULL, 0);
+        } else {
+            argc = 0;
+        }
+    }
+    if (argc != optind) {
+        eprintf("Usage: %s [-n lines] [-s seed]\n", argv[0]);
+        eprintf("  -n  How many random lines to compare (default: %d)\n",
+                DEFAULT_LINES);
+        eprintf("  -s  Seed of the random lines, not 0 (default: %d)\n",
+                DEFAULT_SEED);
+        return 1;
+    }
+    
+    seed = first_seed;
+    // Room to start the lines anywhere within 16 bytes
+    uint8_t bg[MAX_OFFSET + MAX_LENGTH];
+    uint8_t spr[MAX_OFFSET + MAX_LENGTH];
+    int edge_lines = 0;
+    for (int edge = 0; edge < EDGES_LEN; edge++) {
+        for (int len = 0; len <= MAX_LENGTH; len++) {
+            fill_edge_case(edge, bg, spr, len);
+            if (!check_line(edge_names[edge], bg, spr, len,
+                            expected_hit(edge, len))) {
+                return 2;
+            }
+            edge_lines++;
+        }
+    }
+    
+    for (int i = 0; i < lines; i++) {
+        int len = next_random() % (MAX_LENGTH + 1);
+        int bg_offset = next_random() % (MAX_OFFSET + 1);
+        int spr_offset = next_random() % (MAX_OFFSET + 1);
+        fill_random(bg + bg_offset, spr + spr_offset, len);
+        if (!check_line("a random line", bg + bg_offset, spr + spr_offset, len,
+                        -1)) {
+            printf("(random line %d with seed %u)\n", i, first_seed);
+            return 2;
+        }
+    }
+    printf("No mismatch in %d edge case and %d random lines\n", edge_lines,
+           lines);
+    return 0;
+}
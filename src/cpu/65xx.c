@@ -1,5 +1,13 @@
 #include "65xx.h"
 
+#ifdef JIT
+#if !defined(__x86_64__) || defined(_WIN32)
+#error "The JIT only supports x86-64 with the System V ABI"
+#endif
+#include <stdarg.h>
+#include <sys/mman.h>
+#endif
+
 // MISC. //
 
 static int apply_page_boundary_penalty(uint16_t a, uint16_t b) {
@@ -17,24 +25,56 @@ static inline void mem_write(CPU65xx *cpu, uint16_t addr, uint8_t value) {
 }
 
 static inline uint16_t mem_read_word(CPU65xx *cpu, uint16_t addr) {
-    return mem_read(cpu, addr) + (mem_read(cpu, addr + 1) << 8);
+    uint16_t lower = mem_read(cpu, addr);
+    return lower + (mem_read(cpu, addr + 1) << 8);
 }
 
 // P.STATUS REGISTER //
 
+// N and Z are evaluated lazily from the last result they apply to, while
+// all other flags live in p
+
 static bool get_p_flag(CPU65xx *cpu, PFlag flag) {
-    return cpu->p & flag;
+    switch (flag) {
+        case P_N:
+            return cpu->n_result & (1 << 7);
+        case P_Z:
+            return !cpu->z_result;
+        default:
+            return cpu->p & flag;
+    }
 }
 
 static void set_p_flag(CPU65xx *cpu, PFlag flag, bool value) {
-    const uint8_t pos_mask = -value & flag;     // All 0 if val == 0
-    const uint8_t neg_mask = ~(-!value & flag); // All 1 if val == 1
-    cpu->p = (cpu->p | pos_mask) & neg_mask;
+    switch (flag) {
+        case P_N:
+            cpu->n_result = value << 7;
+            break;
+        case P_Z:
+            cpu->z_result = !value;
+            break;
+        default: {
+            const uint8_t pos_mask = -value & flag;     // All 0 if val == 0
+            const uint8_t neg_mask = ~(-!value & flag); // All 1 if val == 1
+            cpu->p = (cpu->p | pos_mask) & neg_mask;
+            break;
+        }
+    }
 }
 
 static void apply_p_nz(CPU65xx *cpu, uint8_t value) {
-    set_p_flag(cpu, P_Z, !value);
-    set_p_flag(cpu, P_N, value & (1 << 7));
+    cpu->n_result = cpu->z_result = value;
+}
+
+static uint8_t get_p(CPU65xx *cpu) {
+    return cpu->p | (get_p_flag(cpu, P_N) ? P_N : 0) |
+                    (get_p_flag(cpu, P_Z) ? P_Z : 0);
+}
+
+static void set_p(CPU65xx *cpu, uint8_t value) {
+    cpu->p = value & ~(P_N | P_Z);
+    set_p_flag(cpu, P_N, value & P_N);
+    set_p_flag(cpu, P_Z, value & P_Z);
 }
 
 // STACK REGISTER //
@@ -69,13 +109,28 @@ static int interrupt(CPU65xx *cpu, bool b_flag, uint16_t ivt_addr) {
         cpu->s -= 3;
     } else {
         stack_push_word(cpu, cpu->pc);
-        stack_push(cpu, cpu->p);
+        stack_push(cpu, get_p(cpu));
     }
     set_p_flag(cpu, P_I, true);
     cpu->pc = mem_read_word(cpu, ivt_addr);
     return 7;
 }
 
+// REGISTER SELECTORS //
+
+static const size_t reg_offsets[] = {
+    [REG_A] = offsetof(CPU65xx, a),
+    [REG_X] = offsetof(CPU65xx, x),
+    [REG_Y] = offsetof(CPU65xx, y),
+    [REG_S] = offsetof(CPU65xx, s),
+    [REG_P] = offsetof(CPU65xx, p),
+};
+
+// Folds down to the register itself when reg is known at compile time
+static inline uint8_t *get_reg(CPU65xx *cpu, Register reg) {
+    return (uint8_t *)cpu + reg_offsets[reg];
+}
+
 // OPCODES //
 
 static uint8_t get_param_value(CPU65xx *cpu, const Opcode *op, OpParam param) {
@@ -86,39 +141,42 @@ static uint8_t get_param_value(CPU65xx *cpu, const Opcode *op, OpParam param) {
 }
 
 static int op_T(CPU65xx *cpu, const Opcode *op, OpParam param) {
-    *op->reg2 = *op->reg1;
-    if (op->reg2 != &cpu->s) {
-        apply_p_nz(cpu, *op->reg2);
+    uint8_t *reg2 = get_reg(cpu, op->reg2);
+    *reg2 = *get_reg(cpu, op->reg1);
+    if (op->reg2 != REG_S) {
+        apply_p_nz(cpu, *reg2);
     }
     return 0;
 }
 
 static int op_LD(CPU65xx *cpu, const Opcode *op, OpParam param) {
-    *op->reg1 = get_param_value(cpu, op, param);
-    apply_p_nz(cpu, *op->reg1);
+    uint8_t *reg1 = get_reg(cpu, op->reg1);
+    *reg1 = get_param_value(cpu, op, param);
+    apply_p_nz(cpu, *reg1);
     return 0;
 }
 
 static int op_ST(CPU65xx *cpu, const Opcode *op, OpParam param) {
-    mem_write(cpu, param.addr, *op->reg1);
+    mem_write(cpu, param.addr, *get_reg(cpu, op->reg1));
     return 0;
 }
 
 static int op_PH(CPU65xx *cpu, const Opcode *op, OpParam param) {
-    uint8_t value = *op->reg1;
-    if (op->reg1 == &cpu->p) {
-        value |= P_B | P__;
+    uint8_t value = *get_reg(cpu, op->reg1);
+    if (op->reg1 == REG_P) {
+        value = get_p(cpu) | P_B | P__;
     }
     stack_push(cpu, value);
     return 0;
 }
 
 static int op_PL(CPU65xx *cpu, const Opcode *op, OpParam param) {
-    *op->reg1 = stack_pull(cpu);
-    if (op->reg1 == &cpu->p) {
-        *op->reg1 &= ~(P_B | P__);
+    uint8_t value = stack_pull(cpu);
+    if (op->reg1 == REG_P) {
+        set_p(cpu, value & ~(P_B | P__));
     } else {
-        apply_p_nz(cpu, *op->reg1);
+        *get_reg(cpu, op->reg1) = value;
+        apply_p_nz(cpu, value);
     }
     return 0;
 }
@@ -165,8 +223,9 @@ static int op_ORA(CPU65xx *cpu, const Opcode *op, OpParam param) {
 
 static int op_CMP(CPU65xx *cpu, const Opcode *op, OpParam param) {
     uint8_t value = get_param_value(cpu, op, param);
-    set_p_flag(cpu, P_C, ((int)(*op->reg1) - (int)value) >= 0);
-    apply_p_nz(cpu, *op->reg1 - value);
+    uint8_t reg1 = *get_reg(cpu, op->reg1);
+    set_p_flag(cpu, P_C, ((int)reg1 - (int)value) >= 0);
+    apply_p_nz(cpu, reg1 - value);
     return 0;
 }
 
@@ -186,7 +245,7 @@ static int op_INC(CPU65xx *cpu, const Opcode *op, OpParam param) {
 }
 
 static int op_IN(CPU65xx *cpu, const Opcode *op, OpParam param) {
-    apply_p_nz(cpu, ++(*op->reg1));
+    apply_p_nz(cpu, ++(*get_reg(cpu, op->reg1)));
     return 0;
 }
 
@@ -198,17 +257,18 @@ static int op_DEC(CPU65xx *cpu, const Opcode *op, OpParam param) {
 }
 
 static int op_DE(CPU65xx *cpu, const Opcode *op, OpParam param) {
-    apply_p_nz(cpu, --(*op->reg1));
+    apply_p_nz(cpu, --(*get_reg(cpu, op->reg1)));
     return 0;
 }
 
 static void shift_left(CPU65xx *cpu, const Opcode *op, OpParam param,
                        uint8_t carry) {
     if (op->reg1) {
-        set_p_flag(cpu, P_C, *op->reg1 & (1 << 7));
-        *op->reg1 <<= 1;
-        *op->reg1 |= carry;
-        apply_p_nz(cpu, *op->reg1);
+        uint8_t *reg1 = get_reg(cpu, op->reg1);
+        set_p_flag(cpu, P_C, *reg1 & (1 << 7));
+        *reg1 <<= 1;
+        *reg1 |= carry;
+        apply_p_nz(cpu, *reg1);
     } else {
         uint8_t value = get_param_value(cpu, op, param);
         set_p_flag(cpu, P_C, value & (1 << 7));
@@ -230,10 +290,11 @@ static int op_ROL(CPU65xx *cpu, const Opcode *op, OpParam param) {
 static void shift_right(CPU65xx *cpu, const Opcode *op, OpParam param,
                         uint8_t carry) {
     if (op->reg1) {
-        set_p_flag(cpu, P_C, *op->reg1 & 1);
-        *op->reg1 >>= 1;
-        *op->reg1 |= carry;
-        apply_p_nz(cpu, *op->reg1);
+        uint8_t *reg1 = get_reg(cpu, op->reg1);
+        set_p_flag(cpu, P_C, *reg1 & 1);
+        *reg1 >>= 1;
+        *reg1 |= carry;
+        apply_p_nz(cpu, *reg1);
     } else {
         uint8_t value = get_param_value(cpu, op, param);
         set_p_flag(cpu, P_C, value & 1);
@@ -264,7 +325,7 @@ static int op_JSR(CPU65xx *cpu, const Opcode *op, OpParam param) {
 }
 
 static int op_RTI(CPU65xx *cpu, const Opcode *op, OpParam param) {
-    cpu->p = stack_pull(cpu) & ~(P_B | P__);
+    set_p(cpu, stack_pull(cpu) & ~(P_B | P__));
     cpu->pc = stack_pull_word(cpu);
     return 0;
 }
@@ -346,334 +407,2572 @@ static int op_NOP(CPU65xx *cpu, const Opcode *op, OpParam param) {
     return 0;
 }
 
-// PUBLIC FUNCTIONS //
+// OPCODE LIST //
 
-void cpu_65xx_init(CPU65xx *cpu, void *mm, CPU65xxReadFuncPtr read_func,
-                                           CPU65xxWriteFuncPtr write_func) {
-    cpu->a = cpu->x = cpu->y = cpu->s = 0;
-    cpu->p = P__;
-    cpu->pc = 0;
+// X(opcode, name, reg1, reg2, cycles, func, addressing mode)
+// A negative cycle count means a page boundary penalty may apply.
+#define OPCODES(X) \
+    X(0xA8, "TAY", REG_A, REG_Y, 2, op_T, AM_IMPLIED)               \
+    X(0xAA, "TAX", REG_A, REG_X, 2, op_T, AM_IMPLIED)               \
+    X(0xBA, "TSX", REG_S, REG_X, 2, op_T, AM_IMPLIED)               \
+    X(0x98, "TYA", REG_Y, REG_A, 2, op_T, AM_IMPLIED)               \
+    X(0x8A, "TXA", REG_X, REG_A, 2, op_T, AM_IMPLIED)               \
+    X(0x9A, "TXS", REG_X, REG_S, 2, op_T, AM_IMPLIED)               \
+    X(0xA9, "LDA", REG_A, REG_NONE, 2, op_LD, AM_IMMEDIATE)         \
+    X(0xA2, "LDX", REG_X, REG_NONE, 2, op_LD, AM_IMMEDIATE)         \
+    X(0xA0, "LDY", REG_Y, REG_NONE, 2, op_LD, AM_IMMEDIATE)         \
+                                                                    \
+    X(0xA5, "LDA", REG_A, REG_NONE, 3, op_LD, AM_ZP)                \
+    X(0xB5, "LDA", REG_A, REG_X, 4, op_LD, AM_ZP)                   \
+    X(0xAD, "LDA", REG_A, REG_NONE, 4, op_LD, AM_ABSOLUTE)          \
+    X(0xBD, "LDA", REG_A, REG_X, -4, op_LD, AM_ABSOLUTE)            \
+    X(0xB9, "LDA", REG_A, REG_Y, -4, op_LD, AM_ABSOLUTE)            \
+    X(0xA1, "LDA", REG_A, REG_NONE, 6, op_LD, AM_INDIRECT_X)        \
+    X(0xB1, "LDA", REG_A, REG_NONE, -5, op_LD, AM_INDIRECT_Y)       \
+    X(0xA6, "LDX", REG_X, REG_NONE, 3, op_LD, AM_ZP)                \
+    X(0xB6, "LDX", REG_X, REG_Y, 4, op_LD, AM_ZP)                   \
+    X(0xAE, "LDX", REG_X, REG_NONE, 4, op_LD, AM_ABSOLUTE)          \
+    X(0xBE, "LDX", REG_X, REG_Y, -4, op_LD, AM_ABSOLUTE)            \
+    X(0xA4, "LDY", REG_Y, REG_NONE, 3, op_LD, AM_ZP)                \
+    X(0xB4, "LDY", REG_Y, REG_X, 4, op_LD, AM_ZP)                   \
+    X(0xAC, "LDY", REG_Y, REG_NONE, 4, op_LD, AM_ABSOLUTE)          \
+    X(0xBC, "LDY", REG_Y, REG_X, -4, op_LD, AM_ABSOLUTE)            \
+                                                                    \
+    X(0x85, "STA", REG_A, REG_NONE, 3, op_ST, AM_ZP)                \
+    X(0x95, "STA", REG_A, REG_X, 4, op_ST, AM_ZP)                   \
+    X(0x8D, "STA", REG_A, REG_NONE, 4, op_ST, AM_ABSOLUTE)          \
+    X(0x9D, "STA", REG_A, REG_X, 5, op_ST, AM_ABSOLUTE)             \
+    X(0x99, "STA", REG_A, REG_Y, 5, op_ST, AM_ABSOLUTE)             \
+    X(0x81, "STA", REG_A, REG_NONE, 6, op_ST, AM_INDIRECT_X)        \
+    X(0x91, "STA", REG_A, REG_NONE, 6, op_ST, AM_INDIRECT_Y)        \
+    X(0x86, "STX", REG_X, REG_NONE, 3, op_ST, AM_ZP)                \
+    X(0x96, "STX", REG_X, REG_Y, 4, op_ST, AM_ZP)                   \
+    X(0x8E, "STX", REG_X, REG_NONE, 4, op_ST, AM_ABSOLUTE)          \
+    X(0x84, "STY", REG_Y, REG_NONE, 3, op_ST, AM_ZP)                \
+    X(0x94, "STY", REG_Y, REG_X, 4, op_ST, AM_ZP)                   \
+    X(0x8C, "STY", REG_Y, REG_NONE, 4, op_ST, AM_ABSOLUTE)          \
+                                                                    \
+    X(0x48, "PHA", REG_A, REG_NONE, 3, op_PH, AM_IMPLIED)           \
+    X(0x08, "PHP", REG_P, REG_NONE, 3, op_PH, AM_IMPLIED)           \
+    X(0x68, "PLA", REG_A, REG_NONE, 4, op_PL, AM_IMPLIED)           \
+    X(0x28, "PLP", REG_P, REG_NONE, 4, op_PL, AM_IMPLIED)           \
+                                                                    \
+    X(0x69, "ADC", REG_NONE, REG_NONE, 2, op_ADC, AM_IMMEDIATE)     \
+    X(0x65, "ADC", REG_NONE, REG_NONE, 3, op_ADC, AM_ZP)            \
+    X(0x75, "ADC", REG_NONE, REG_X, 4, op_ADC, AM_ZP)               \
+    X(0x6D, "ADC", REG_NONE, REG_NONE, 4, op_ADC, AM_ABSOLUTE)      \
+    X(0x7D, "ADC", REG_NONE, REG_X, -4, op_ADC, AM_ABSOLUTE)        \
+    X(0x79, "ADC", REG_NONE, REG_Y, -4, op_ADC, AM_ABSOLUTE)        \
+    X(0x61, "ADC", REG_NONE, REG_NONE, 6, op_ADC, AM_INDIRECT_X)    \
+    X(0x71, "ADC", REG_NONE, REG_NONE, -5, op_ADC, AM_INDIRECT_Y)   \
+                                                                    \
+    X(0xE9, "SBC", REG_NONE, REG_NONE, 2, op_SBC, AM_IMMEDIATE)     \
+    X(0xE5, "SBC", REG_NONE, REG_NONE, 3, op_SBC, AM_ZP)            \
+    X(0xF5, "SBC", REG_NONE, REG_X, 4, op_SBC, AM_ZP)               \
+    X(0xED, "SBC", REG_NONE, REG_NONE, 4, op_SBC, AM_ABSOLUTE)      \
+    X(0xFD, "SBC", REG_NONE, REG_X, -4, op_SBC, AM_ABSOLUTE)        \
+    X(0xF9, "SBC", REG_NONE, REG_Y, -4, op_SBC, AM_ABSOLUTE)        \
+    X(0xE1, "SBC", REG_NONE, REG_NONE, 6, op_SBC, AM_INDIRECT_X)    \
+    X(0xF1, "SBC", REG_NONE, REG_NONE, -5, op_SBC, AM_INDIRECT_Y)   \
+                                                                    \
+    X(0x29, "AND", REG_NONE, REG_NONE, 2, op_AND, AM_IMMEDIATE)     \
+    X(0x25, "AND", REG_NONE, REG_NONE, 3, op_AND, AM_ZP)            \
+    X(0x35, "AND", REG_NONE, REG_X, 4, op_AND, AM_ZP)               \
+    X(0x2D, "AND", REG_NONE, REG_NONE, 4, op_AND, AM_ABSOLUTE)      \
+    X(0x3D, "AND", REG_NONE, REG_X, -4, op_AND, AM_ABSOLUTE)        \
+    X(0x39, "AND", REG_NONE, REG_Y, -4, op_AND, AM_ABSOLUTE)        \
+    X(0x21, "AND", REG_NONE, REG_NONE, 6, op_AND, AM_INDIRECT_X)    \
+    X(0x31, "AND", REG_NONE, REG_NONE, -5, op_AND, AM_INDIRECT_Y)   \
+                                                                    \
+    X(0x49, "EOR", REG_NONE, REG_NONE, 2, op_EOR, AM_IMMEDIATE)     \
+    X(0x45, "EOR", REG_NONE, REG_NONE, 3, op_EOR, AM_ZP)            \
+    X(0x55, "EOR", REG_NONE, REG_X, 4, op_EOR, AM_ZP)               \
+    X(0x4D, "EOR", REG_NONE, REG_NONE, 4, op_EOR, AM_ABSOLUTE)      \
+    X(0x5D, "EOR", REG_NONE, REG_X, -4, op_EOR, AM_ABSOLUTE)        \
+    X(0x59, "EOR", REG_NONE, REG_Y, -4, op_EOR, AM_ABSOLUTE)        \
+    X(0x41, "EOR", REG_NONE, REG_NONE, 6, op_EOR, AM_INDIRECT_X)    \
+    X(0x51, "EOR", REG_NONE, REG_NONE, -5, op_EOR, AM_INDIRECT_Y)   \
+                                                                    \
+    X(0x09, "ORA", REG_NONE, REG_NONE, 2, op_ORA, AM_IMMEDIATE)     \
+    X(0x05, "ORA", REG_NONE, REG_NONE, 3, op_ORA, AM_ZP)            \
+    X(0x15, "ORA", REG_NONE, REG_X, 4, op_ORA, AM_ZP)               \
+    X(0x0D, "ORA", REG_NONE, REG_NONE, 4, op_ORA, AM_ABSOLUTE)      \
+    X(0x1D, "ORA", REG_NONE, REG_X, -4, op_ORA, AM_ABSOLUTE)        \
+    X(0x19, "ORA", REG_NONE, REG_Y, -4, op_ORA, AM_ABSOLUTE)        \
+    X(0x01, "ORA", REG_NONE, REG_NONE, 6, op_ORA, AM_INDIRECT_X)    \
+    X(0x11, "ORA", REG_NONE, REG_NONE, -5, op_ORA, AM_INDIRECT_Y)   \
+                                                                    \
+    X(0xC9, "CMP", REG_A, REG_NONE, 2, op_CMP, AM_IMMEDIATE)        \
+    X(0xC5, "CMP", REG_A, REG_NONE, 3, op_CMP, AM_ZP)               \
+    X(0xD5, "CMP", REG_A, REG_X, 4, op_CMP, AM_ZP)                  \
+    X(0xCD, "CMP", REG_A, REG_NONE, 4, op_CMP, AM_ABSOLUTE)         \
+    X(0xDD, "CMP", REG_A, REG_X, -4, op_CMP, AM_ABSOLUTE)           \
+    X(0xD9, "CMP", REG_A, REG_Y, -4, op_CMP, AM_ABSOLUTE)           \
+    X(0xC1, "CMP", REG_A, REG_NONE, 6, op_CMP, AM_INDIRECT_X)       \
+    X(0xD1, "CMP", REG_A, REG_NONE, -5, op_CMP, AM_INDIRECT_Y)      \
+    X(0xE0, "CPX", REG_X, REG_NONE, 2, op_CMP, AM_IMMEDIATE)        \
+    X(0xE4, "CPX", REG_X, REG_NONE, 3, op_CMP, AM_ZP)               \
+    X(0xEC, "CPX", REG_X, REG_NONE, 4, op_CMP, AM_ABSOLUTE)         \
+    X(0xC0, "CPY", REG_Y, REG_NONE, 2, op_CMP, AM_IMMEDIATE)        \
+    X(0xC4, "CPY", REG_Y, REG_NONE, 3, op_CMP, AM_ZP)               \
+    X(0xCC, "CPY", REG_Y, REG_NONE, 4, op_CMP, AM_ABSOLUTE)         \
+                                                                    \
+    X(0x24, "BIT", REG_NONE, REG_NONE, 3, op_BIT, AM_ZP)            \
+    X(0x2C, "BIT", REG_NONE, REG_NONE, 4, op_BIT, AM_ABSOLUTE)      \
+                                                                    \
+    X(0xE6, "INC", REG_NONE, REG_NONE, 5, op_INC, AM_ZP)            \
+    X(0xF6, "INC", REG_NONE, REG_X, 6, op_INC, AM_ZP)               \
+    X(0xEE, "INC", REG_NONE, REG_NONE, 6, op_INC, AM_ABSOLUTE)      \
+    X(0xFE, "INC", REG_NONE, REG_X, 7, op_INC, AM_ABSOLUTE)         \
+    X(0xE8, "INX", REG_X, REG_NONE, 2, op_IN, AM_IMPLIED)           \
+    X(0xC8, "INY", REG_Y, REG_NONE, 2, op_IN, AM_IMPLIED)           \
+                                                                    \
+    X(0xC6, "DEC", REG_NONE, REG_NONE, 5, op_DEC, AM_ZP)            \
+    X(0xD6, "DEC", REG_NONE, REG_X, 6, op_DEC, AM_ZP)               \
+    X(0xCE, "DEC", REG_NONE, REG_NONE, 6, op_DEC, AM_ABSOLUTE)      \
+    X(0xDE, "DEC", REG_NONE, REG_X, 7, op_DEC, AM_ABSOLUTE)         \
+    X(0xCA, "DEX", REG_X, REG_NONE, 2, op_DE, AM_IMPLIED)           \
+    X(0x88, "DEY", REG_Y, REG_NONE, 2, op_DE, AM_IMPLIED)           \
+                                                                    \
+    X(0x0A, "ASL", REG_A, REG_NONE, 2, op_ASL, AM_IMPLIED)          \
+    X(0x06, "ASL", REG_NONE, REG_NONE, 5, op_ASL, AM_ZP)            \
+    X(0x16, "ASL", REG_NONE, REG_X, 6, op_ASL, AM_ZP)               \
+    X(0x0E, "ASL", REG_NONE, REG_NONE, 6, op_ASL, AM_ABSOLUTE)      \
+    X(0x1E, "ASL", REG_NONE, REG_X, 7, op_ASL, AM_ABSOLUTE)         \
+                                                                    \
+    X(0x4A, "LSR", REG_A, REG_NONE, 2, op_LSR, AM_IMPLIED)          \
+    X(0x46, "LSR", REG_NONE, REG_NONE, 5, op_LSR, AM_ZP)            \
+    X(0x56, "LSR", REG_NONE, REG_X, 6, op_LSR, AM_ZP)               \
+    X(0x4E, "LSR", REG_NONE, REG_NONE, 6, op_LSR, AM_ABSOLUTE)      \
+    X(0x5E, "LSR", REG_NONE, REG_X, 7, op_LSR, AM_ABSOLUTE)         \
+                                                                    \
+    X(0x2A, "ROL", REG_A, REG_NONE, 2, op_ROL, AM_IMPLIED)          \
+    X(0x26, "ROL", REG_NONE, REG_NONE, 5, op_ROL, AM_ZP)            \
+    X(0x36, "ROL", REG_NONE, REG_X, 6, op_ROL, AM_ZP)               \
+    X(0x2E, "ROL", REG_NONE, REG_NONE, 6, op_ROL, AM_ABSOLUTE)      \
+    X(0x3E, "ROL", REG_NONE, REG_X, 7, op_ROL, AM_ABSOLUTE)         \
+                                                                    \
+    X(0x6A, "ROR", REG_A, REG_NONE, 2, op_ROR, AM_IMPLIED)          \
+    X(0x66, "ROR", REG_NONE, REG_NONE, 5, op_ROR, AM_ZP)            \
+    X(0x76, "ROR", REG_NONE, REG_X, 6, op_ROR, AM_ZP)               \
+    X(0x6E, "ROR", REG_NONE, REG_NONE, 6, op_ROR, AM_ABSOLUTE)      \
+    X(0x7E, "ROR", REG_NONE, REG_X, 7, op_ROR, AM_ABSOLUTE)         \
+                                                                    \
+    X(0x4C, "JMP", REG_NONE, REG_NONE, 3, op_JMP, AM_ABSOLUTE)      \
+    X(0x6C, "JMP", REG_NONE, REG_NONE, 5, op_JMP, AM_INDIRECT_WORD) \
+    X(0x20, "JSR", REG_NONE, REG_NONE, 6, op_JSR, AM_ABSOLUTE)      \
+    X(0x40, "RTI", REG_NONE, REG_NONE, 6, op_RTI, AM_IMPLIED)       \
+    X(0x60, "RTS", REG_NONE, REG_NONE, 6, op_RTS, AM_IMPLIED)       \
+                                                                    \
+    X(0x10, "BPL", REG_NONE, REG_NONE, 2, op_BPL, AM_RELATIVE)      \
+    X(0x30, "BMI", REG_NONE, REG_NONE, 2, op_BMI, AM_RELATIVE)      \
+    X(0x50, "BVC", REG_NONE, REG_NONE, 2, op_BVC, AM_RELATIVE)      \
+    X(0x70, "BVS", REG_NONE, REG_NONE, 2, op_BVS, AM_RELATIVE)      \
+    X(0x90, "BCC", REG_NONE, REG_NONE, 2, op_BCC, AM_RELATIVE)      \
+    X(0xB0, "BCS", REG_NONE, REG_NONE, 2, op_BCS, AM_RELATIVE)      \
+    X(0xD0, "BNE", REG_NONE, REG_NONE, 2, op_BNE, AM_RELATIVE)      \
+    X(0xF0, "BEQ", REG_NONE, REG_NONE, 2, op_BEQ, AM_RELATIVE)      \
+                                                                    \
+    X(0x00, "BRK", REG_NONE, REG_NONE, 0, op_BRK, AM_IMPLIED)       \
+                                                                    \
+    X(0x18, "CLC", REG_NONE, REG_NONE, 2, op_CLC, AM_IMPLIED)       \
+    X(0x58, "CLI", REG_NONE, REG_NONE, 2, op_CLI, AM_IMPLIED)       \
+    X(0xD8, "CLD", REG_NONE, REG_NONE, 2, op_CLD, AM_IMPLIED)       \
+    X(0xB8, "CLV", REG_NONE, REG_NONE, 2, op_CLV, AM_IMPLIED)       \
+    X(0x38, "SEC", REG_NONE, REG_NONE, 2, op_SEC, AM_IMPLIED)       \
+    X(0x78, "SEI", REG_NONE, REG_NONE, 2, op_SEI, AM_IMPLIED)       \
+    X(0xF8, "SED", REG_NONE, REG_NONE, 2, op_SED, AM_IMPLIED)       \
+                                                                    \
+    X(0xEA, "NOP", REG_NONE, REG_NONE, 2, op_NOP, AM_IMPLIED)
+
+// TODO: Add more illegal opcodes
+#define OPCODE_KIL "KIL", REG_NONE, REG_NONE, -1, op_NOP, AM_IMPLIED
+
+// Shared by all CPUs, the entries left empty are illegal opcodes
+static const Opcode opcode_table[0x100] = {
+#define X(code, ...) [code] = {__VA_ARGS__},
+    OPCODES(X)
+#undef X
+};
+
+static const Opcode opcode_kil = {OPCODE_KIL};
+
+static inline const Opcode *get_opcode(uint8_t code) {
+    const Opcode *op = &opcode_table[code];
+    return op->func ? op : &opcode_kil;
+}
+
+// BLOCK CACHE //
+
+#define BLOCK_MAX_LENGTH 16
+#define BLOCK_CACHE_BUCKETS 1024
+#define BLOCK_CACHE_POOL 2048
+
+typedef struct DecodedInst {
+    OpParam param;  // Raw parameter, as fetched from the instruction stream
+    uint8_t opcode;
+    uint8_t size;   // Instruction size in bytes, ie. the fall-through offset
+    uint8_t bus;    // Last byte the fetch leaves on the data bus
+    uint8_t fusion; // Pair it starts with the next instruction, if any
+} DecodedInst;
+
+#ifdef JIT
+typedef int (*NativeBlockFunc)(CPU65xx *, uint8_t *ram, uint8_t *bus_latch);
+#endif
+
+typedef struct CodeBlock {
+    const uint8_t *host;
+    struct CodeBlock *next;
+    uint16_t pc;    // Where it was first decoded
+    bool is_idle;   // Loops back to pc without side effects
+    const CPU65xxRecompiledBank *recompiled; // Bank of ROM the block is in
+    int length;
+    DecodedInst insts[BLOCK_MAX_LENGTH];
+#ifdef JIT
+    int heat; // Executions so far, or -1 if it can't be translated
+    NativeBlockFunc native;
+    uint16_t native_pc;
+    int native_size;
+    int native_cycles; // Worst case
+#endif
+} CodeBlock;
+
+typedef struct IdleState {
+    uint8_t a, x, y, s, p;
+} IdleState;
+
+struct CPU65xxBlockCache {
+    CodeBlock *buckets[BLOCK_CACHE_BUCKETS];
+    CodeBlock pool[BLOCK_CACHE_POOL];
+    int pool_used;
     
-    cpu->mm = mm;
-    cpu->read_func = read_func;
-    cpu->write_func = write_func;
+    // Replay position
+    const CodeBlock *block;
+    int index;
+    uint16_t next_pc;
+    unsigned gen;
     
-    // Initialize opcode lookup to KIL instruction
-    // TODO: Add more illegal opcodes
-    Opcode kill = {"KIL", 0, 0, -1, op_NOP, AM_IMPLIED};
-    for (int i = 0; i < 0x100; i++) {
-        cpu->opcodes[i] = kill;
-    }
-    
-    uint8_t *a = &cpu->a;
-    uint8_t *x = &cpu->x;
-    uint8_t *y = &cpu->y;
-    uint8_t *s = &cpu->s;
-    uint8_t *p = &cpu->p;
-    
-    // Define all legal opcodes
-    cpu->opcodes[0xA8] = (Opcode) {"TAY", a, y, 2, op_T, AM_IMPLIED};
-    cpu->opcodes[0xAA] = (Opcode) {"TAX", a, x, 2, op_T, AM_IMPLIED};
-    cpu->opcodes[0xBA] = (Opcode) {"TSX", s, x, 2, op_T, AM_IMPLIED};
-    cpu->opcodes[0x98] = (Opcode) {"TYA", y, a, 2, op_T, AM_IMPLIED};
-    cpu->opcodes[0x8A] = (Opcode) {"TXA", x, a, 2, op_T, AM_IMPLIED};
-    cpu->opcodes[0x9A] = (Opcode) {"TXS", x, s, 2, op_T, AM_IMPLIED};
-    cpu->opcodes[0xA9] = (Opcode) {"LDA", a, 0, 2, op_LD, AM_IMMEDIATE};
-    cpu->opcodes[0xA2] = (Opcode) {"LDX", x, 0, 2, op_LD, AM_IMMEDIATE};
-    cpu->opcodes[0xA0] = (Opcode) {"LDY", y, 0, 2, op_LD, AM_IMMEDIATE};
-    
-    cpu->opcodes[0xA5] = (Opcode) {"LDA", a, 0, 3, op_LD, AM_ZP};
-    cpu->opcodes[0xB5] = (Opcode) {"LDA", a, x, 4, op_LD, AM_ZP};
-    cpu->opcodes[0xAD] = (Opcode) {"LDA", a, 0, 4, op_LD, AM_ABSOLUTE};
-    cpu->opcodes[0xBD] = (Opcode) {"LDA", a, x, -4, op_LD, AM_ABSOLUTE};
-    cpu->opcodes[0xB9] = (Opcode) {"LDA", a, y, -4, op_LD, AM_ABSOLUTE};
-    cpu->opcodes[0xA1] = (Opcode) {"LDA", a, 0, 6, op_LD, AM_INDIRECT_X};
-    cpu->opcodes[0xB1] = (Opcode) {"LDA", a, 0, -5, op_LD, AM_INDIRECT_Y};
-    cpu->opcodes[0xA6] = (Opcode) {"LDX", x, 0, 3, op_LD, AM_ZP};
-    cpu->opcodes[0xB6] = (Opcode) {"LDX", x, y, 4, op_LD, AM_ZP};
-    cpu->opcodes[0xAE] = (Opcode) {"LDX", x, 0, 4, op_LD, AM_ABSOLUTE};
-    cpu->opcodes[0xBE] = (Opcode) {"LDX", x, y, -4, op_LD, AM_ABSOLUTE};
-    cpu->opcodes[0xA4] = (Opcode) {"LDY", y, 0, 3, op_LD, AM_ZP};
-    cpu->opcodes[0xB4] = (Opcode) {"LDY", y, x, 4, op_LD, AM_ZP};
-    cpu->opcodes[0xAC] = (Opcode) {"LDY", y, 0, 4, op_LD, AM_ABSOLUTE};
-    cpu->opcodes[0xBC] = (Opcode) {"LDY", y, x, -4, op_LD, AM_ABSOLUTE};
-    
-    cpu->opcodes[0x85] = (Opcode) {"STA", a, 0, 3, op_ST, AM_ZP};
-    cpu->opcodes[0x95] = (Opcode) {"STA", a, x, 4, op_ST, AM_ZP};
-    cpu->opcodes[0x8D] = (Opcode) {"STA", a, 0, 4, op_ST, AM_ABSOLUTE};
-    cpu->opcodes[0x9D] = (Opcode) {"STA", a, x, 5, op_ST, AM_ABSOLUTE};
-    cpu->opcodes[0x99] = (Opcode) {"STA", a, y, 5, op_ST, AM_ABSOLUTE};
-    cpu->opcodes[0x81] = (Opcode) {"STA", a, 0, 6, op_ST, AM_INDIRECT_X};
-    cpu->opcodes[0x91] = (Opcode) {"STA", a, 0, 6, op_ST, AM_INDIRECT_Y};
-    cpu->opcodes[0x86] = (Opcode) {"STX", x, 0, 3, op_ST, AM_ZP};
-    cpu->opcodes[0x96] = (Opcode) {"STX", x, y, 4, op_ST, AM_ZP};
-    cpu->opcodes[0x8E] = (Opcode) {"STX", x, 0, 4, op_ST, AM_ABSOLUTE};
-    cpu->opcodes[0x84] = (Opcode) {"STY", y, 0, 3, op_ST, AM_ZP};
-    cpu->opcodes[0x94] = (Opcode) {"STY", y, x, 4, op_ST, AM_ZP};
-    cpu->opcodes[0x8C] = (Opcode) {"STY", y, 0, 4, op_ST, AM_ABSOLUTE};
-    
-    cpu->opcodes[0x48] = (Opcode) {"PHA", a, 0, 3, op_PH, AM_IMPLIED};
-    cpu->opcodes[0x08] = (Opcode) {"PHP", p, 0, 3, op_PH, AM_IMPLIED};
-    cpu->opcodes[0x68] = (Opcode) {"PLA", a, 0, 4, op_PL, AM_IMPLIED};
-    cpu->opcodes[0x28] = (Opcode) {"PLP", p, 0, 4, op_PL, AM_IMPLIED};
-    
-    cpu->opcodes[0x69] = (Opcode) {"ADC", 0, 0, 2, op_ADC, AM_IMMEDIATE};
-    cpu->opcodes[0x65] = (Opcode) {"ADC", 0, 0, 3, op_ADC, AM_ZP};
-    cpu->opcodes[0x75] = (Opcode) {"ADC", 0, x, 4, op_ADC, AM_ZP};
-    cpu->opcodes[0x6D] = (Opcode) {"ADC", 0, 0, 4, op_ADC, AM_ABSOLUTE};
-    cpu->opcodes[0x7D] = (Opcode) {"ADC", 0, x, -4, op_ADC, AM_ABSOLUTE};
-    cpu->opcodes[0x79] = (Opcode) {"ADC", 0, y, -4, op_ADC, AM_ABSOLUTE};
-    cpu->opcodes[0x61] = (Opcode) {"ADC", 0, 0, 6, op_ADC, AM_INDIRECT_X};
-    cpu->opcodes[0x71] = (Opcode) {"ADC", 0, 0, -5, op_ADC, AM_INDIRECT_Y};
-    
-    cpu->opcodes[0xE9] = (Opcode) {"SBC", 0, 0, 2, op_SBC, AM_IMMEDIATE};
-    cpu->opcodes[0xE5] = (Opcode) {"SBC", 0, 0, 3, op_SBC, AM_ZP};
-    cpu->opcodes[0xF5] = (Opcode) {"SBC", 0, x, 4, op_SBC, AM_ZP};
-    cpu->opcodes[0xED] = (Opcode) {"SBC", 0, 0, 4, op_SBC, AM_ABSOLUTE};
-    cpu->opcodes[0xFD] = (Opcode) {"SBC", 0, x, -4, op_SBC, AM_ABSOLUTE};
-    cpu->opcodes[0xF9] = (Opcode) {"SBC", 0, y, -4, op_SBC, AM_ABSOLUTE};
-    cpu->opcodes[0xE1] = (Opcode) {"SBC", 0, 0, 6, op_SBC, AM_INDIRECT_X};
-    cpu->opcodes[0xF1] = (Opcode) {"SBC", 0, 0, -5, op_SBC, AM_INDIRECT_Y};
-    
-    cpu->opcodes[0x29] = (Opcode) {"AND", 0, 0, 2, op_AND, AM_IMMEDIATE};
-    cpu->opcodes[0x25] = (Opcode) {"AND", 0, 0, 3, op_AND, AM_ZP};
-    cpu->opcodes[0x35] = (Opcode) {"AND", 0, x, 4, op_AND, AM_ZP};
-    cpu->opcodes[0x2D] = (Opcode) {"AND", 0, 0, 4, op_AND, AM_ABSOLUTE};
-    cpu->opcodes[0x3D] = (Opcode) {"AND", 0, x, -4, op_AND, AM_ABSOLUTE};
-    cpu->opcodes[0x39] = (Opcode) {"AND", 0, y, -4, op_AND, AM_ABSOLUTE};
-    cpu->opcodes[0x21] = (Opcode) {"AND", 0, 0, 6, op_AND, AM_INDIRECT_X};
-    cpu->opcodes[0x31] = (Opcode) {"AND", 0, 0, -5, op_AND, AM_INDIRECT_Y};
-    
-    cpu->opcodes[0x49] = (Opcode) {"EOR", 0, 0, 2, op_EOR, AM_IMMEDIATE};
-    cpu->opcodes[0x45] = (Opcode) {"EOR", 0, 0, 3, op_EOR, AM_ZP};
-    cpu->opcodes[0x55] = (Opcode) {"EOR", 0, x, 4, op_EOR, AM_ZP};
-    cpu->opcodes[0x4D] = (Opcode) {"EOR", 0, 0, 4, op_EOR, AM_ABSOLUTE};
-    cpu->opcodes[0x5D] = (Opcode) {"EOR", 0, x, -4, op_EOR, AM_ABSOLUTE};
-    cpu->opcodes[0x59] = (Opcode) {"EOR", 0, y, -4, op_EOR, AM_ABSOLUTE};
-    cpu->opcodes[0x41] = (Opcode) {"EOR", 0, 0, 6, op_EOR, AM_INDIRECT_X};
-    cpu->opcodes[0x51] = (Opcode) {"EOR", 0, 0, -5, op_EOR, AM_INDIRECT_Y};
-    
-    cpu->opcodes[0x09] = (Opcode) {"ORA", 0, 0, 2, op_ORA, AM_IMMEDIATE};
-    cpu->opcodes[0x05] = (Opcode) {"ORA", 0, 0, 3, op_ORA, AM_ZP};
-    cpu->opcodes[0x15] = (Opcode) {"ORA", 0, x, 4, op_ORA, AM_ZP};
-    cpu->opcodes[0x0D] = (Opcode) {"ORA", 0, 0, 4, op_ORA, AM_ABSOLUTE};
-    cpu->opcodes[0x1D] = (Opcode) {"ORA", 0, x, -4, op_ORA, AM_ABSOLUTE};
-    cpu->opcodes[0x19] = (Opcode) {"ORA", 0, y, -4, op_ORA, AM_ABSOLUTE};
-    cpu->opcodes[0x01] = (Opcode) {"ORA", 0, 0, 6, op_ORA, AM_INDIRECT_X};
-    cpu->opcodes[0x11] = (Opcode) {"ORA", 0, 0, -5, op_ORA, AM_INDIRECT_Y};
-    
-    cpu->opcodes[0xC9] = (Opcode) {"CMP", a, 0, 2, op_CMP, AM_IMMEDIATE};
-    cpu->opcodes[0xC5] = (Opcode) {"CMP", a, 0, 3, op_CMP, AM_ZP};
-    cpu->opcodes[0xD5] = (Opcode) {"CMP", a, x, 4, op_CMP, AM_ZP};
-    cpu->opcodes[0xCD] = (Opcode) {"CMP", a, 0, 4, op_CMP, AM_ABSOLUTE};
-    cpu->opcodes[0xDD] = (Opcode) {"CMP", a, x, -4, op_CMP, AM_ABSOLUTE};
-    cpu->opcodes[0xD9] = (Opcode) {"CMP", a, y, -4, op_CMP, AM_ABSOLUTE};
-    cpu->opcodes[0xC1] = (Opcode) {"CMP", a, 0, 6, op_CMP, AM_INDIRECT_X};
-    cpu->opcodes[0xD1] = (Opcode) {"CMP", a, 0, -5, op_CMP, AM_INDIRECT_Y};
-    cpu->opcodes[0xE0] = (Opcode) {"CPX", x, 0, 2, op_CMP, AM_IMMEDIATE};
-    cpu->opcodes[0xE4] = (Opcode) {"CPX", x, 0, 3, op_CMP, AM_ZP};
-    cpu->opcodes[0xEC] = (Opcode) {"CPX", x, 0, 4, op_CMP, AM_ABSOLUTE};
-    cpu->opcodes[0xC0] = (Opcode) {"CPY", y, 0, 2, op_CMP, AM_IMMEDIATE};
-    cpu->opcodes[0xC4] = (Opcode) {"CPY", y, 0, 3, op_CMP, AM_ZP};
-    cpu->opcodes[0xCC] = (Opcode) {"CPY", y, 0, 4, op_CMP, AM_ABSOLUTE};
-    
-    cpu->opcodes[0x24] = (Opcode) {"BIT", 0, 0, 3, op_BIT, AM_ZP};
-    cpu->opcodes[0x2C] = (Opcode) {"BIT", 0, 0, 4, op_BIT, AM_ABSOLUTE};
-    
-    cpu->opcodes[0xE6] = (Opcode) {"INC", 0, 0, 5, op_INC, AM_ZP};
-    cpu->opcodes[0xF6] = (Opcode) {"INC", 0, x, 6, op_INC, AM_ZP};
-    cpu->opcodes[0xEE] = (Opcode) {"INC", 0, 0, 6, op_INC, AM_ABSOLUTE};
-    cpu->opcodes[0xFE] = (Opcode) {"INC", 0, x, 7, op_INC, AM_ABSOLUTE};
-    cpu->opcodes[0xE8] = (Opcode) {"INX", x, 0, 2, op_IN, AM_IMPLIED};
-    cpu->opcodes[0xC8] = (Opcode) {"INY", y, 0, 2, op_IN, AM_IMPLIED};
-    
-    cpu->opcodes[0xC6] = (Opcode) {"DEC", 0, 0, 5, op_DEC, AM_ZP};
-    cpu->opcodes[0xD6] = (Opcode) {"DEC", 0, x, 6, op_DEC, AM_ZP};
-    cpu->opcodes[0xCE] = (Opcode) {"DEC", 0, 0, 6, op_DEC, AM_ABSOLUTE};
-    cpu->opcodes[0xDE] = (Opcode) {"DEC", 0, x, 7, op_DEC, AM_ABSOLUTE};
-    cpu->opcodes[0xCA] = (Opcode) {"DEX", x, 0, 2, op_DE, AM_IMPLIED};
-    cpu->opcodes[0x88] = (Opcode) {"DEY", y, 0, 2, op_DE, AM_IMPLIED};
-    
-    cpu->opcodes[0x0A] = (Opcode) {"ASL", a, 0, 2, op_ASL, AM_IMPLIED};
-    cpu->opcodes[0x06] = (Opcode) {"ASL", 0, 0, 5, op_ASL, AM_ZP};
-    cpu->opcodes[0x16] = (Opcode) {"ASL", 0, x, 6, op_ASL, AM_ZP};
-    cpu->opcodes[0x0E] = (Opcode) {"ASL", 0, 0, 6, op_ASL, AM_ABSOLUTE};
-    cpu->opcodes[0x1E] = (Opcode) {"ASL", 0, x, 7, op_ASL, AM_ABSOLUTE};
-    
-    cpu->opcodes[0x4A] = (Opcode) {"LSR", a, 0, 2, op_LSR, AM_IMPLIED};
-    cpu->opcodes[0x46] = (Opcode) {"LSR", 0, 0, 5, op_LSR, AM_ZP};
-    cpu->opcodes[0x56] = (Opcode) {"LSR", 0, x, 6, op_LSR, AM_ZP};
-    cpu->opcodes[0x4E] = (Opcode) {"LSR", 0, 0, 6, op_LSR, AM_ABSOLUTE};
-    cpu->opcodes[0x5E] = (Opcode) {"LSR", 0, x, 7, op_LSR, AM_ABSOLUTE};
-    
-    cpu->opcodes[0x2A] = (Opcode) {"ROL", a, 0, 2, op_ROL, AM_IMPLIED};
-    cpu->opcodes[0x26] = (Opcode) {"ROL", 0, 0, 5, op_ROL, AM_ZP};
-    cpu->opcodes[0x36] = (Opcode) {"ROL", 0, x, 6, op_ROL, AM_ZP};
-    cpu->opcodes[0x2E] = (Opcode) {"ROL", 0, 0, 6, op_ROL, AM_ABSOLUTE};
-    cpu->opcodes[0x3E] = (Opcode) {"ROL", 0, x, 7, op_ROL, AM_ABSOLUTE};
-    
-    cpu->opcodes[0x6A] = (Opcode) {"ROR", a, 0, 2, op_ROR, AM_IMPLIED};
-    cpu->opcodes[0x66] = (Opcode) {"ROR", 0, 0, 5, op_ROR, AM_ZP};
-    cpu->opcodes[0x76] = (Opcode) {"ROR", 0, x, 6, op_ROR, AM_ZP};
-    cpu->opcodes[0x6E] = (Opcode) {"ROR", 0, 0, 6, op_ROR, AM_ABSOLUTE};
-    cpu->opcodes[0x7E] = (Opcode) {"ROR", 0, x, 7, op_ROR, AM_ABSOLUTE};
-    
-    cpu->opcodes[0x4C] = (Opcode) {"JMP", 0, 0, 3, op_JMP, AM_ABSOLUTE};
-    cpu->opcodes[0x6C] = (Opcode) {"JMP", 0, 0, 5, op_JMP, AM_INDIRECT_WORD};
-    cpu->opcodes[0x20] = (Opcode) {"JSR", 0, 0, 6, op_JSR, AM_ABSOLUTE};
-    cpu->opcodes[0x40] = (Opcode) {"RTI", 0, 0, 6, op_RTI, AM_IMPLIED};
-    cpu->opcodes[0x60] = (Opcode) {"RTS", 0, 0, 6, op_RTS, AM_IMPLIED};
-    
-    cpu->opcodes[0x10] = (Opcode) {"BPL", 0, 0, 2, op_BPL, AM_RELATIVE};
-    cpu->opcodes[0x30] = (Opcode) {"BMI", 0, 0, 2, op_BMI, AM_RELATIVE};
-    cpu->opcodes[0x50] = (Opcode) {"BVC", 0, 0, 2, op_BVC, AM_RELATIVE};
-    cpu->opcodes[0x70] = (Opcode) {"BVS", 0, 0, 2, op_BVS, AM_RELATIVE};
-    cpu->opcodes[0x90] = (Opcode) {"BCC", 0, 0, 2, op_BCC, AM_RELATIVE};
-    cpu->opcodes[0xB0] = (Opcode) {"BCS", 0, 0, 2, op_BCS, AM_RELATIVE};
-    cpu->opcodes[0xD0] = (Opcode) {"BNE", 0, 0, 2, op_BNE, AM_RELATIVE};
-    cpu->opcodes[0xF0] = (Opcode) {"BEQ", 0, 0, 2, op_BEQ, AM_RELATIVE};
-    
-    cpu->opcodes[0x00] = (Opcode) {"BRK", 0, 0, 0, op_BRK, AM_IMPLIED};
-    
-    cpu->opcodes[0x18] = (Opcode) {"CLC", 0, 0, 2, op_CLC, AM_IMPLIED};
-    cpu->opcodes[0x58] = (Opcode) {"CLI", 0, 0, 2, op_CLI, AM_IMPLIED};
-    cpu->opcodes[0xD8] = (Opcode) {"CLD", 0, 0, 2, op_CLD, AM_IMPLIED};
-    cpu->opcodes[0xB8] = (Opcode) {"CLV", 0, 0, 2, op_CLV, AM_IMPLIED};
-    cpu->opcodes[0x38] = (Opcode) {"SEC", 0, 0, 2, op_SEC, AM_IMPLIED};
-    cpu->opcodes[0x78] = (Opcode) {"SEI", 0, 0, 2, op_SEI, AM_IMPLIED};
-    cpu->opcodes[0xF8] = (Opcode) {"SED", 0, 0, 2, op_SED, AM_IMPLIED};
-
-    cpu->opcodes[0xEA] = (Opcode) {"NOP", 0, 0, 2, op_NOP, AM_IMPLIED};
+    // Last iteration of an idle loop
+    const CodeBlock *idle_block;
+    IdleState idle_state;
+    uint64_t idle_cycles;
+
+#ifdef JIT
+    uint8_t *code;
+    size_t code_used;
+#endif
+};
+
+static int get_param_size(AddressingMode am) {
+    switch (am) {
+        case AM_IMPLIED:
+            return 0;
+        case AM_ABSOLUTE:
+        case AM_INDIRECT_WORD:
+            return 2;
+        default:
+            return 1;
+    }
 }
 
-int cpu_65xx_step(CPU65xx *cpu, bool verbose) {
-    if (verbose) {
-        printf("$%04x ", cpu->pc);
+static bool is_block_end(const Opcode *op) {
+    return op->am == AM_RELATIVE || op->func == op_JMP ||
+           op->func == op_JSR || op->func == op_RTS ||
+           op->func == op_RTI || op->func == op_BRK;
+}
+
+// SUPERINSTRUCTIONS //
+
+// The pairs that make up most hot loops get dispatched at once. The second
+// instruction runs right after the first, unless that one ended the run (I/O
+// always does), which keeps interrupts and I/O timing exactly the same.
+
+// X(first opcode, second opcode)
+#define FUSIONS(X)                                   \
+    X(0xCA, 0xD0) /* DEX, BNE */                     \
+    X(0xCA, 0x10) /* DEX, BPL */                     \
+    X(0x88, 0xD0) /* DEY, BNE */                     \
+    X(0x88, 0x10) /* DEY, BPL */                     \
+    X(0xE8, 0xD0) /* INX, BNE */                     \
+    X(0xC8, 0xD0) /* INY, BNE */                     \
+    X(0xE6, 0xD0) /* INC zp, BNE */                  \
+    X(0x2C, 0x10) /* BIT abs, BPL */                 \
+    X(0x2C, 0x30) /* BIT abs, BMI */                 \
+    X(0xA9, 0x85) /* LDA #imm, STA zp */             \
+    X(0xA9, 0x8D) /* LDA #imm, STA abs */            \
+    X(0xA5, 0x85) /* LDA zp, STA zp */               \
+    X(0xA5, 0x8D) /* LDA zp, STA abs */              \
+    X(0xAD, 0x85) /* LDA abs, STA zp */              \
+    X(0xAD, 0x8D) /* LDA abs, STA abs */             \
+    X(0xBD, 0x9D) /* LDA abs,X, STA abs,X */         \
+    X(0xBD, 0x99) /* LDA abs,X, STA abs,Y */         \
+    X(0xB9, 0x99) /* LDA abs,Y, STA abs,Y */         \
+    X(0xB1, 0x91) /* LDA (zp),Y, STA (zp),Y */
+
+enum {
+    FUSION_NONE = 0,
+#define X(first, second) FUSION_##first##_##second,
+    FUSIONS(X)
+#undef X
+};
+
+static uint8_t get_fusion(uint8_t first, uint8_t second) {
+#define X(a, b) \
+    if (first == a && second == b) { \
+        return FUSION_##a##_##b; \
+    }
+    FUSIONS(X)
+#undef X
+    return FUSION_NONE;
+}
+
+static bool is_in_ram(CPU65xx *cpu, const Opcode *op, OpParam param) {
+    if (op->am == AM_ZP) {
+        return cpu->ram_end > 0xFF;
+    }
+    return op->am == AM_ABSOLUTE &&
+           param.addr + (op->reg2 ? 0xFF : 0) < cpu->ram_end;
+}
+
+static bool is_in_rom(CPU65xx *cpu, const Opcode *op, OpParam param) {
+    int size;
+    return op->am == AM_ABSOLUTE &&
+           (*cpu->code_func)(cpu->mm, param.addr, &size) &&
+           size > (op->reg2 ? 0xFF : 0);
+}
+
+static bool is_read_only(const Opcode *op) {
+    return op->func == op_LD || op->func == op_ADC || op->func == op_SBC ||
+           op->func == op_AND || op->func == op_EOR || op->func == op_ORA ||
+           op->func == op_CMP || op->func == op_BIT;
+}
+
+static bool get_branch_condition(const Opcode *op, PFlag *flag, bool *value) {
+    static const struct {
+        OpcodeFunc func;
+        PFlag flag;
+        bool value;
+    } branches[] = {
+        {op_BPL, P_N, false}, {op_BMI, P_N, true},
+        {op_BVC, P_V, false}, {op_BVS, P_V, true},
+        {op_BCC, P_C, false}, {op_BCS, P_C, true},
+        {op_BNE, P_Z, false}, {op_BEQ, P_Z, true},
+    };
+    for (int i = 0; i < sizeof(branches) / sizeof(branches[0]); i++) {
+        if (branches[i].func == op->func) {
+            *flag = branches[i].flag;
+            *value = branches[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// IDLE LOOPS //
+
+// A block that jumps back to its own start, without writing anything nor
+// reading outside of RAM and ROM, does the same thing every time it starts
+// from the same registers. When an iteration ends the way it began, the CPU
+// is stuck there until an interrupt, which can't happen before the end of
+// the run: all the iterations until then are skipped at once.
+
+static bool is_idle_inst(CPU65xx *cpu, const Opcode *op, OpParam param) {
+    if (op->am == AM_IMPLIED) {
+        return op->func == op_T || op->func == op_IN || op->func == op_DE ||
+               op->func == op_CLC || op->func == op_SEC ||
+               op->func == op_CLV || op->func == op_NOP;
+    }
+    if (!is_read_only(op)) {
+        return false;
+    }
+    return op->am == AM_IMMEDIATE || is_in_ram(cpu, op, param) ||
+           is_in_rom(cpu, op, param);
+}
+
+static bool is_idle_loop(CPU65xx *cpu, const CodeBlock *block) {
+    uint16_t pc = block->pc;
+    for (int i = 0; i < block->length - 1; i++) {
+        const DecodedInst *di = &block->insts[i];
+        if (!is_idle_inst(cpu, get_opcode(di->opcode), di->param)) {
+            return false;
+        }
+        pc += di->size;
     }
     
-    if (cpu->nmi) {
-        cpu->nmi = false;
-        if (verbose) {
-            printf("/NMI\n");
+    const DecodedInst *di = &block->insts[block->length - 1];
+    const Opcode *op = get_opcode(di->opcode);
+    if (op->am == AM_RELATIVE) {
+        return (uint16_t)(pc + di->size + di->param.relative_addr) ==
+               block->pc;
+    }
+    return op->func == op_JMP && op->am == AM_ABSOLUTE &&
+           di->param.addr == block->pc;
+}
+
+// Called whenever execution enters a block (or NULL when not in ROM)
+static void track_idle_loop(CPU65xx *cpu, const CodeBlock *block) {
+    CPU65xxBlockCache *bc = cpu->blocks;
+    if (!block || !block->is_idle || block->pc != cpu->pc || cpu->trace ||
+        cpu->profile) {
+        bc->idle_block = NULL;
+        return;
+    }
+    
+    IdleState state = {cpu->a, cpu->x, cpu->y, cpu->s, get_p(cpu)};
+    if (bc->idle_block == block &&
+        !memcmp(&state, &bc->idle_state, sizeof(IdleState)) &&
+        cpu->cycles < cpu->run_end) {
+        uint64_t period = cpu->cycles - bc->idle_cycles;
+        cpu->cycles += (cpu->run_end - cpu->cycles - 1) / period * period;
+    }
+    bc->idle_block = block;
+    bc->idle_state = state;
+    bc->idle_cycles = cpu->cycles;
+}
+
+// RECOMPILED CODE //
+
+// Generated code covers a whole bank at once, and runs for as long as it
+// stays within it. It checks for the end of the run before every instruction,
+// and returns before any that could enable interrupts, so it can stop at the
+// same points as the interpreter.
+
+static const CPU65xxRecompiledBank *find_recompiled_bank(CPU65xx *cpu,
+                                                         const uint8_t *host) {
+    const CPU65xxRecompiled *code = cpu->recompiled;
+    if (!code || host < cpu->rom || host >= cpu->rom + code->rom_size) {
+        return NULL;
+    }
+    uint32_t offset = (host - cpu->rom) & ~(code->bank_size - 1);
+    uint16_t addr = cpu->pc & ~(code->bank_size - 1);
+    int lo = 0, hi = code->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const CPU65xxRecompiledBank *bank = &code->banks[mid];
+        if (bank->offset < offset ||
+            (bank->offset == offset && bank->addr < addr)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        return interrupt(cpu, false, IVT_NMI);
     }
-    if (cpu->irq && !get_p_flag(cpu, P_I)) {
-        if (verbose) {
-            printf("/IRQ\n");
+    if (lo < code->count && code->banks[lo].offset == offset &&
+        code->banks[lo].addr == addr) {
+        return &code->banks[lo];
+    }
+    return NULL;
+}
+
+// Returns whether the generated code ran from PC, otherwise the interpreter
+// takes the block
+static bool run_recompiled(CPU65xx *cpu, const CodeBlock *block) {
+    const CPU65xxRecompiledBank *bank = block->recompiled;
+    if (!bank || cpu->trace || cpu->profile) {
+        return false; // Traces and profiles need to see every instruction
+    }
+    if (bank->addr != (cpu->pc & ~(cpu->recompiled->bank_size - 1))) {
+        return false; // Mirrored elsewhere
+    }
+    if (!(*bank->func)(cpu)) {
+        return false;
+    }
+    cpu->blocks->block = NULL;
+    return true;
+}
+
+static void decode_block(CPU65xx *cpu, CodeBlock *block, int size) {
+    block->length = 0;
+    int offset = 0;
+    while (block->length < BLOCK_MAX_LENGTH) {
+        const uint8_t *code = block->host + offset;
+        const Opcode *op = get_opcode(code[0]);
+        int param_size = get_param_size(op->am);
+        // Every byte fetched, including the implied dummy read, must be
+        // within the same bank
+        int fetch_size = 1 + (param_size ? param_size : 1);
+        if (offset + fetch_size > size) {
+            break;
         }
-        return interrupt(cpu, false, IVT_IRQ);
+        
+        DecodedInst *di = &block->insts[block->length++];
+        di->opcode = code[0];
+        di->size = 1 + param_size;
+        di->bus = code[fetch_size - 1];
+        di->param.addr = 0;
+        if (param_size == 2) {
+            di->param.addr = code[1] | (code[2] << 8);
+        } else if (param_size) {
+            di->param.immediate_value = code[1];
+        }
+        
+        if (is_block_end(op)) {
+            break;
+        }
+        offset += di->size;
+    }
+    
+    for (int i = 0; i < block->length; i++) {
+        DecodedInst *di = &block->insts[i];
+        di->fusion = (i + 1 < block->length ?
+                      get_fusion(di->opcode, block->insts[i + 1].opcode) :
+                      FUSION_NONE);
     }
     
-    // Fetch next instruction
-    uint8_t inst = mem_read(cpu, cpu->pc++);
-    const Opcode *op = &cpu->opcodes[inst];
+    block->pc = cpu->pc;
+    block->is_idle = block->length && is_idle_loop(cpu, block);
+    block->recompiled = find_recompiled_bank(cpu, block->host);
+}
+
+static void flush_blocks(CPU65xxBlockCache *bc) {
+    memset(bc->buckets, 0, sizeof(bc->buckets));
+    bc->pool_used = 0;
+    bc->block = NULL;
+    bc->idle_block = NULL;
+#ifdef JIT
+    bc->code_used = 0;
+#endif
+}
+
+static CodeBlock *lookup_block(CPU65xx *cpu) {
+    int size;
+    const uint8_t *host = (*cpu->code_func)(cpu->mm, cpu->pc, &size);
+    if (!host) {
+        return NULL;
+    }
     
-    // Fetch parameter, if any
-    OpParam p1, p2;
-    p1.addr = p2.addr = 0;
+    CPU65xxBlockCache *bc = cpu->blocks;
+    CodeBlock **bucket = &bc->buckets[(uintptr_t)host &
+                                      (BLOCK_CACHE_BUCKETS - 1)];
+    for (CodeBlock *block = *bucket; block; block = block->next) {
+        if (block->host == host) {
+            return block;
+        }
+    }
+    
+    // Not found, decode a new one (flushing everything when full)
+    if (bc->pool_used >= BLOCK_CACHE_POOL) {
+        flush_blocks(bc);
+    }
+    CodeBlock *block = &bc->pool[bc->pool_used++];
+    block->host = host;
+    block->next = *bucket;
+    *bucket = block;
+#ifdef JIT
+    block->heat = 0;
+    block->native = NULL;
+#endif
+    decode_block(cpu, block, size);
+    return block;
+}
+
+// Sets up the block at PC for replay when execution enters it, returns NULL
+// when still in the middle of one or when there is none
+static CodeBlock *enter_block(CPU65xx *cpu) {
+    CPU65xxBlockCache *bc = cpu->blocks;
+    if (!bc) {
+        return NULL;
+    }
+    if (bc->block && cpu->pc == bc->next_pc && *cpu->code_gen == bc->gen) {
+        return NULL;
+    }
+    
+    CodeBlock *block = lookup_block(cpu);
+    track_idle_loop(cpu, block);
+    if (!block || !block->length) {
+        bc->block = NULL;
+        return NULL;
+    }
+    bc->block = block;
+    bc->index = 0;
+    bc->next_pc = cpu->pc;
+    bc->gen = *cpu->code_gen;
+    return block;
+}
+
+static const DecodedInst *next_decoded_inst(CPU65xx *cpu) {
+    CPU65xxBlockCache *bc = cpu->blocks;
+    if (!bc) {
+        return NULL;
+    }
+    if (!bc->block || cpu->pc != bc->next_pc || *cpu->code_gen != bc->gen) {
+        bc->block = lookup_block(cpu);
+        bc->index = 0;
+        bc->gen = *cpu->code_gen;
+        track_idle_loop(cpu, bc->block);
+        if (!bc->block || !bc->block->length) {
+            bc->block = NULL;
+            return NULL;
+        }
+    }
+    const DecodedInst *di = &bc->block->insts[bc->index];
+    bc->next_pc = cpu->pc + di->size;
+    if (++bc->index >= bc->block->length) {
+        bc->block = NULL;
+    }
+    return di;
+}
+
+// INSTRUCTION EXECUTION //
+
+// Reads the raw parameter bytes from the instruction stream
+static ALWAYS_INLINE void fetch_param(CPU65xx *cpu, const Opcode *op,
+                                      OpParam *p1) {
+    p1->addr = 0;
     switch (op->am) {
         case AM_IMPLIED:
             // Implied always does a dummy parameter read of the next byte
             mem_read(cpu, cpu->pc);
             break;
-        case AM_IMMEDIATE:
-            p1.immediate_value = p2.immediate_value = mem_read(cpu, cpu->pc++);
+        case AM_ABSOLUTE:
+        case AM_INDIRECT_WORD:
+            p1->addr = mem_read_word(cpu, cpu->pc);
+            cpu->pc += 2;
             break;
+        default:
+            p1->immediate_value = mem_read(cpu, cpu->pc++);
+            break;
+    }
+}
+
+// Turns the raw parameter into the effective one (indexing, indirection)
+static ALWAYS_INLINE void resolve_param(CPU65xx *cpu, const Opcode *op,
+                                        OpParam p1, OpParam *p2) {
+    *p2 = p1;
+    switch (op->am) {
         case AM_ZP:
-            p1.immediate_value = p2.immediate_value = mem_read(cpu, cpu->pc++);
             if (op->reg2) {
-                p2.immediate_value += *op->reg2;
+                p2->immediate_value += *get_reg(cpu, op->reg2);
             }
-            p2.addr = p2.immediate_value;
+            p2->addr = p2->immediate_value;
             break;
         case AM_ABSOLUTE:
-            p1.addr = p2.addr = mem_read_word(cpu, cpu->pc);
-            cpu->pc += 2;
             if (op->reg2) {
-                p2.addr += *op->reg2;
+                p2->addr += *get_reg(cpu, op->reg2);
             }
             break;
         case AM_INDIRECT_WORD:
-            p1.addr = mem_read_word(cpu, cpu->pc);
-            cpu->pc += 2;
-            p2.addr = mem_read_word(cpu, p1.addr);
+            p2->addr = mem_read_word(cpu, p1.addr);
+            break;
+        case AM_INDIRECT_X:
+            p2->immediate_value = p1.immediate_value + cpu->x;
+            p2->addr = mem_read_word(cpu, p2->immediate_value);
+            break;
+        case AM_INDIRECT_Y:
+            p2->addr = mem_read_word(cpu, p1.immediate_value) + cpu->y;
+            break;
+        default:
+            break;
+    }
+}
+
+static ALWAYS_INLINE int run_instruction(CPU65xx *cpu, const Opcode *op,
+                                         OpParam p1, OpParam p2) {
+    // The penalty comes from indexing across a page, so for (zp),Y it's the
+    // pointed address that matters and not the pointer
+    uint16_t base = (op->am == AM_INDIRECT_Y ? p2.addr - cpu->y : p1.addr);
+    int t = abs(op->cycles) + (*op->func)(cpu, op, p2);
+    if (op->cycles < 0) {
+        t += apply_page_boundary_penalty(base, p2.addr);
+    }
+    return t;
+}
+
+static int format_instruction(const Opcode *op, OpParam p1, char *str,
+                              int size) {
+    int len = snprintf(str, size, "%s", op->name);
+    switch (op->am) {
+        case AM_IMPLIED:
+            break;
+        case AM_IMMEDIATE:
+            len += snprintf(str + len, size - len, " #$%02x",
+                            p1.immediate_value);
+            break;
+        case AM_ZP:
+            len += snprintf(str + len, size - len, " $%02x",
+                            p1.immediate_value);
+            break;
+        case AM_ABSOLUTE:
+            len += snprintf(str + len, size - len, " $%04x", p1.addr);
+            break;
+        case AM_INDIRECT_WORD:
+            len += snprintf(str + len, size - len, " ($%04x)", p1.addr);
             break;
         case AM_INDIRECT_X:
-            p1.immediate_value = mem_read(cpu, cpu->pc++);
-            p2.immediate_value = p1.immediate_value + cpu->x;
-            p2.addr = mem_read_word(cpu, p2.immediate_value);
+            len += snprintf(str + len, size - len, " ($%02x,X)",
+                            p1.immediate_value);
             break;
         case AM_INDIRECT_Y:
-            p1.immediate_value = mem_read(cpu, cpu->pc++);
-            p2.addr = mem_read_word(cpu, p1.immediate_value) + cpu->y;
+            len += snprintf(str + len, size - len, " ($%02x),Y",
+                            p1.immediate_value);
             break;
         case AM_RELATIVE:
-            p1.relative_addr = p2.relative_addr = mem_read(cpu, cpu->pc++);
+            len += snprintf(str + len, size - len, " %+d", p1.relative_addr);
             break;
     }
-    
-    if (verbose) {
-        printf("%s", op->name);
-        switch (op->am) {
-            case AM_IMPLIED:
-                break;
-            case AM_IMMEDIATE:
-                printf(" #$%02x", p1.immediate_value);
-                break;
-            case AM_ZP:
-                printf(" $%02x", p1.immediate_value);
-                break;
-            case AM_ABSOLUTE:
-                printf(" $%04x", p1.addr);
-                break;
-            case AM_INDIRECT_WORD:
-                printf(" ($%04x)", p1.addr);
-                break;
-            case AM_INDIRECT_X:
-                printf(" ($%02x,X)", p1.immediate_value);
-                break;
-            case AM_INDIRECT_Y:
-                printf(" ($%02x),Y", p1.immediate_value);
-                break;
-            case AM_RELATIVE:
-                printf(" %+d", p1.relative_addr);
-                break;
+    if (op->am == AM_ZP || op->am == AM_ABSOLUTE) {
+        if (op->reg2 == REG_X) {
+            len += snprintf(str + len, size - len, ",X");
+        } else if (op->reg2 == REG_Y) {
+            len += snprintf(str + len, size - len, ",Y");
         }
-        if (op->am == AM_ZP || op->am == AM_ABSOLUTE) {
-            if (op->reg2 == &cpu->x) {
-                printf(",X");
-            } else if (op->reg2 == &cpu->y) {
-                printf(",Y");
-            }
+    }
+    return len;
+}
+
+static void print_instruction(const Opcode *op, OpParam p1) {
+    char str[32];
+    format_instruction(op, p1, str, sizeof(str));
+    printf("%s\n", str);
+}
+
+static ALWAYS_INLINE int execute(CPU65xx *cpu, const Opcode *op,
+                                  const DecodedInst *di) {
+    OpParam p1, p2;
+    if (di) {
+        p1 = di->param;
+    } else {
+        fetch_param(cpu, op, &p1);
+    }
+    resolve_param(cpu, op, p1, &p2);
+    return run_instruction(cpu, op, p1, p2);
+}
+
+// Runs the second instruction of a fused pair, after the first one took t
+static ALWAYS_INLINE int execute_fused(CPU65xx *cpu, const Opcode *op, int t) {
+    if (cpu->cycles + t >= cpu->run_end ||
+        *cpu->code_gen != cpu->blocks->gen) {
+        return t;
+    }
+    cpu->cycles += t;
+    const DecodedInst *di = next_decoded_inst(cpu);
+    cpu->pc += di->size;
+    *cpu->bus_latch = di->bus;
+    return execute(cpu, op, di);
+}
+
+static TraceEntry *add_trace_entry(CPU65xx *cpu, TraceType type) {
+    TraceEntry *entry = trace_add(cpu->trace);
+    entry->cycle = cpu->cycles;
+    entry->pc = cpu->pc;
+    entry->type = type;
+    entry->a = cpu->a;
+    entry->x = cpu->x;
+    entry->y = cpu->y;
+    entry->p = get_p(cpu);
+    entry->s = cpu->s;
+    return entry;
+}
+
+// Records the instruction at PC, before it gets executed
+static void trace_instruction(CPU65xx *cpu, const DecodedInst *di) {
+    TraceEntry *entry = add_trace_entry(cpu, TRACE_INSTRUCTION);
+    if (di) {
+        entry->opcode = di->opcode;
+        entry->operands[0] = di->param.addr & 0xFF;
+        entry->operands[1] = di->param.addr >> 8;
+    } else {
+        // The instruction fetches those same bytes again right after, so
+        // this leaves no trace on the bus
+        entry->opcode = mem_read(cpu, cpu->pc);
+        int size = get_param_size(get_opcode(entry->opcode)->am);
+        for (int i = 0; i < 2; i++) {
+            entry->operands[i] = i < size ? mem_read(cpu, cpu->pc + 1 + i)
+                                          : 0;
         }
-        printf("\n");
     }
     
-    // And finally, run the instruction
-    int t = abs(op->cycles) + (*op->func)(cpu, op, p2);
-    if (op->cycles < 0) {
-        t += apply_page_boundary_penalty(p1.addr, p2.addr);
+    Trace *trace = cpu->trace;
+    if (entry->pc == trace->trigger) {
+        trace->is_triggered = true;
+        cpu->run_end = 0;
+    }
+}
+
+// Counts an instruction once it has run, and follows the calls and returns
+static void profile_instruction(CPU65xx *cpu, uint16_t pc, uint8_t inst,
+                                uint8_t s, int t) {
+    Profile *profile = cpu->profile;
+    profile_count(profile, pc, t);
+    switch (inst) {
+        case 0x00: // BRK
+            profile_call(profile, PROFILE_IRQ, cpu->pc, s);
+            break;
+        case 0x20: // JSR
+            profile_call(profile, PROFILE_CALL, cpu->pc, s);
+            break;
+        case 0x40: // RTI
+        case 0x60: // RTS
+            profile_return(profile, cpu->s);
+            break;
+    }
+}
+
+static void profile_interrupt(CPU65xx *cpu, ProfileCallType type, uint8_t s,
+                              int t) {
+    profile_call(cpu->profile, type, cpu->pc, s);
+    cpu->profile->nodes[cpu->profile->current].cycles += t;
+}
+
+// Returns the cycles taken by the interrupt sequence, if any
+static int check_interrupts(CPU65xx *cpu, bool verbose) {
+    uint8_t s = cpu->s;
+    int t = 0;
+    if (cpu->nmi) {
+        cpu->nmi = false;
+        if (verbose) {
+            printf("/NMI\n");
+        }
+        if (cpu->trace) {
+            add_trace_entry(cpu, TRACE_NMI);
+        }
+        t = interrupt(cpu, false, IVT_NMI);
+        if (cpu->profile) {
+            profile_interrupt(cpu, PROFILE_NMI, s, t);
+        }
+    } else if (cpu->irq && !get_p_flag(cpu, P_I)) {
+        if (verbose) {
+            printf("/IRQ\n");
+        }
+        if (cpu->trace) {
+            add_trace_entry(cpu, TRACE_IRQ);
+        }
+        t = interrupt(cpu, false, IVT_IRQ);
+        if (cpu->profile) {
+            profile_interrupt(cpu, PROFILE_IRQ, s, t);
+        }
+    }
+    if (t && cpu->blocks) {
+        cpu->blocks->idle_block = NULL;
     }
     return t;
 }
 
-int cpu_65xx_reset(CPU65xx *cpu, bool verbose) {
-    if (verbose) {
-        printf("$%04x /RESET", cpu->pc);
+// Specialized engine: every opcode gets its own switch case, in which the
+// whole instruction is inlined with its addressing mode, registers and
+// cycle count known at compile time (no table lookup, no indirect call)
+static int step_specialized(CPU65xx *cpu) {
+    // Replay from the block cache when possible, skipping the fetches
+    uint16_t pc = cpu->pc;
+    uint8_t s_before = cpu->s;
+    uint8_t inst;
+    const DecodedInst *di = next_decoded_inst(cpu);
+    if (cpu->trace) {
+        trace_instruction(cpu, di);
     }
-    return interrupt(cpu, true, IVT_RESET);
+    if (di) {
+        inst = di->opcode;
+        cpu->pc += di->size;
+        *cpu->bus_latch = di->bus;
+    } else {
+        inst = mem_read(cpu, cpu->pc++);
+    }
+    
+    // Fused pairs are keyed after the opcodes, and only replayed by runs
+    int key = inst;
+    if (di && di->fusion && !cpu->trace && !cpu->profile) {
+        key = 0x100 + di->fusion;
+    }
+    
+    int t;
+    switch (key) {
+#define X(code, ...) \
+        case code: \
+            t = execute(cpu, &(const Opcode) {__VA_ARGS__}, di); \
+            break;
+        OPCODES(X)
+#undef X
+#define X(first, second) \
+        case 0x100 + FUSION_##first##_##second: \
+            t = execute(cpu, &opcode_table[first], di); \
+            t = execute_fused(cpu, &opcode_table[second], t); \
+            break;
+        FUSIONS(X)
+#undef X
+        default:
+            t = execute(cpu, &(const Opcode) {OPCODE_KIL}, di);
+            break;
+    }
+    
+    if (cpu->profile) {
+        profile_instruction(cpu, pc, inst, s_before, t);
+    }
+    return t;
 }
 
-void cpu_65xx_debug_print_state(CPU65xx *cpu) {
-    printf("PC=%04x A=%02x X=%02x Y=%02x P=%02x[",
-           cpu->pc, cpu->a, cpu->x, cpu->y, cpu->p);
-    for (int i = 0; i < 8; i++) {
-        printf("%c", (cpu->p & (1 << i) ? "czidb-vn"[i] : '.'));
+// CYCLE-STEPPED ENGINE //
+
+// Runs instructions one cycle at a time, each with the bus access the real
+// CPU does then (dummy ones included), so that I/O lands on the right cycle
+// relative to the PPU. The opcode functions still do the actual work, they
+// just get their operand once it has been read. The addresses accessed are
+// the interpreter's though, quirks included, as all engines have to agree.
+
+typedef enum {
+    TICK_IMPLIED,
+    TICK_READ,
+    TICK_WRITE,
+    TICK_MODIFY,
+    TICK_BRANCH,
+    TICK_JMP,
+    TICK_JMP_INDIRECT,
+    TICK_JSR,
+    TICK_RTS,
+    TICK_RTI,
+    TICK_BRK,
+    TICK_PUSH,
+    TICK_PULL,
+    TICK_KIL,
+} TickKind;
+
+static TickKind get_tick_kind(const Opcode *op) {
+    if (op == &opcode_kil) {
+        return TICK_KIL;
+    } else if (op->func == op_JMP) {
+        return op->am == AM_ABSOLUTE ? TICK_JMP : TICK_JMP_INDIRECT;
+    } else if (op->func == op_JSR) {
+        return TICK_JSR;
+    } else if (op->func == op_RTS) {
+        return TICK_RTS;
+    } else if (op->func == op_RTI) {
+        return TICK_RTI;
+    } else if (op->func == op_BRK) {
+        return TICK_BRK;
+    } else if (op->func == op_PH) {
+        return TICK_PUSH;
+    } else if (op->func == op_PL) {
+        return TICK_PULL;
+    } else if (op->func == op_ST) {
+        return TICK_WRITE;
+    } else if (op->am == AM_IMPLIED) {
+        return TICK_IMPLIED;
+    } else if (op->am == AM_RELATIVE) {
+        return TICK_BRANCH;
+    } else if (op->func == op_INC || op->func == op_DEC ||
+               op->func == op_ASL || op->func == op_ROL ||
+               op->func == op_LSR || op->func == op_ROR) {
+        return TICK_MODIFY;
     }
-    printf("] S=%02x{", cpu->s);
-    for (int i = 0xff; i > cpu->s; i--) {
-        printf(" %02x", mem_read(cpu, 0x100 + i));
+    return TICK_READ;
+}
+
+// Runs a read instruction on the operand it just read
+static void tick_execute(CPU65xx *cpu, const Opcode *op, uint8_t value) {
+    Opcode immediate = *op;
+    immediate.am = AM_IMMEDIATE;
+    (*op->func)(cpu, &immediate, (OpParam) {.immediate_value = value});
+}
+
+// Returns the result of a read-modify-write instruction
+static uint8_t tick_modify(CPU65xx *cpu, const Opcode *op, uint8_t value) {
+    if (op->func == op_INC) {
+        value++;
+    } else if (op->func == op_DEC) {
+        value--;
+    } else if (op->func == op_ASL || op->func == op_ROL) {
+        uint8_t carry = (op->func == op_ROL ? get_p_flag(cpu, P_C) : 0);
+        set_p_flag(cpu, P_C, value & (1 << 7));
+        value = (value << 1) | carry;
+    } else {
+        uint8_t carry = (op->func == op_ROR ? get_p_flag(cpu, P_C) << 7 : 0);
+        set_p_flag(cpu, P_C, value & 1);
+        value = (value >> 1) | carry;
     }
-    printf(" }\n");
+    apply_p_nz(cpu, value);
+    return value;
+}
+
+// The high byte of an indexed address gets fixed on the next cycle, after a
+// dummy read from the wrong page. Reads skip that cycle when not crossing.
+static bool tick_index(CPU65xxTickState *ts, uint8_t index) {
+    uint16_t addr = ts->addr + index;
+    ts->addr = (ts->addr & 0xFF00) | (addr & 0xFF);
+    ts->carry = (addr != ts->addr);
+    return ts->kind == TICK_READ && !ts->carry;
+}
+
+static bool tick_fix_index(CPU65xx *cpu, CPU65xxTickState *ts) {
+    mem_read(cpu, ts->addr);
+    ts->addr += ts->carry << 8;
+    return true;
+}
+
+// Runs a cycle of the addressing mode, returns whether the effective address
+// is ready for the next one
+static bool tick_address(CPU65xx *cpu, CPU65xxTickState *ts) {
+    const Opcode *op = ts->op;
+    switch (op->am) {
+        case AM_ZP:
+            if (ts->cycle == 2) {
+                ts->addr = mem_read(cpu, cpu->pc++);
+                return !op->reg2;
+            }
+            // The index gets added while reading the base address
+            mem_read(cpu, ts->addr);
+            ts->addr = (ts->addr + *get_reg(cpu, op->reg2)) & 0xFF;
+            return true;
+        case AM_ABSOLUTE:
+            switch (ts->cycle) {
+                case 2:
+                    ts->addr = mem_read(cpu, cpu->pc++);
+                    return false;
+                case 3:
+                    ts->addr |= mem_read(cpu, cpu->pc++) << 8;
+                    return !op->reg2 ||
+                           tick_index(ts, *get_reg(cpu, op->reg2));
+                default:
+                    return tick_fix_index(cpu, ts);
+            }
+        case AM_INDIRECT_X:
+            switch (ts->cycle) {
+                case 2:
+                    ts->ptr = mem_read(cpu, cpu->pc++);
+                    return false;
+                case 3:
+                    mem_read(cpu, ts->ptr);
+                    ts->ptr += cpu->x;
+                    return false;
+                case 4:
+                    ts->addr = mem_read(cpu, ts->ptr);
+                    return false;
+                default:
+                    // Not wrapped to the zero page, same as mem_read_word()
+                    ts->addr |= mem_read(cpu, ts->ptr + 1) << 8;
+                    return true;
+            }
+        case AM_INDIRECT_Y:
+            switch (ts->cycle) {
+                case 2:
+                    ts->ptr = mem_read(cpu, cpu->pc++);
+                    return false;
+                case 3:
+                    ts->addr = mem_read(cpu, ts->ptr);
+                    return false;
+                case 4:
+                    // Not wrapped to the zero page, same as mem_read_word()
+                    ts->addr |= mem_read(cpu, ts->ptr + 1) << 8;
+                    return tick_index(ts, cpu->y);
+                default:
+                    return tick_fix_index(cpu, ts);
+            }
+        default:
+            return true;
+    }
+}
+
+// Runs a cycle on the effective address, returns whether it was the last
+static bool tick_access(CPU65xx *cpu, CPU65xxTickState *ts) {
+    const Opcode *op = ts->op;
+    switch (ts->kind) {
+        case TICK_READ:
+            tick_execute(cpu, op, mem_read(cpu, ts->addr));
+            return true;
+        case TICK_WRITE:
+            mem_write(cpu, ts->addr, *get_reg(cpu, op->reg1));
+            return true;
+        default:
+            // Read-modify-write instructions write the value back unchanged
+            // while modifying it
+            switch (ts->access++) {
+                case 0:
+                    ts->value = mem_read(cpu, ts->addr);
+                    return false;
+                case 1:
+                    mem_write(cpu, ts->addr, ts->value);
+                    ts->value = tick_modify(cpu, op, ts->value);
+                    return false;
+                default:
+                    mem_write(cpu, ts->addr, ts->value);
+                    return true;
+            }
+    }
+}
+
+// Runs cycles 2 to 7 of an interrupt sequence (BRK does its own cycle 2)
+static bool tick_interrupt(CPU65xx *cpu, CPU65xxTickState *ts, bool b_flag,
+                           uint16_t ivt_addr) {
+    switch (ts->cycle) {
+        case 2:
+            mem_read(cpu, cpu->pc);
+            return false;
+        case 3:
+            stack_push(cpu, cpu->pc >> 8);
+            return false;
+        case 4:
+            stack_push(cpu, cpu->pc & 0xFF);
+            return false;
+        case 5:
+            set_p_flag(cpu, P_B, b_flag);
+            stack_push(cpu, get_p(cpu));
+            set_p_flag(cpu, P_I, true);
+            return false;
+        case 6:
+            ts->addr = mem_read(cpu, ivt_addr);
+            return false;
+        default:
+            cpu->pc = ts->addr | (mem_read(cpu, ivt_addr + 1) << 8);
+            return true;
+    }
+}
+
+// Runs cycle 2 and up of an instruction, returns whether it was the last
+static bool tick_instruction(CPU65xx *cpu, CPU65xxTickState *ts) {
+    const Opcode *op = ts->op;
+    switch (ts->kind) {
+        case TICK_IMPLIED:
+            mem_read(cpu, cpu->pc);
+            (*op->func)(cpu, op, (OpParam) {0});
+            return true;
+        case TICK_READ:
+        case TICK_WRITE:
+        case TICK_MODIFY:
+            if (op->am == AM_IMMEDIATE) {
+                tick_execute(cpu, op, mem_read(cpu, cpu->pc++));
+                return true;
+            }
+            if (!ts->is_ready) {
+                ts->is_ready = tick_address(cpu, ts);
+                return false;
+            }
+            return tick_access(cpu, ts);
+        case TICK_BRANCH:
+            switch (ts->cycle) {
+                case 2: {
+                    OpParam param = {.immediate_value =
+                                     mem_read(cpu, cpu->pc++)};
+                    ts->addr = cpu->pc;
+                    // Now the extra cycles taken, if any
+                    ts->value = (*op->func)(cpu, op, param);
+                    return !ts->value;
+                }
+                case 3:
+                    mem_read(cpu, ts->addr);
+                    return ts->value == 1;
+                default:
+                    mem_read(cpu, (ts->addr & 0xFF00) | (cpu->pc & 0xFF));
+                    return true;
+            }
+        case TICK_JMP:
+            if (ts->cycle == 2) {
+                ts->addr = mem_read(cpu, cpu->pc++);
+                return false;
+            }
+            cpu->pc = ts->addr | (mem_read(cpu, cpu->pc) << 8);
+            return true;
+        case TICK_JMP_INDIRECT:
+            switch (ts->cycle) {
+                case 2:
+                    ts->addr = mem_read(cpu, cpu->pc++);
+                    return false;
+                case 3:
+                    ts->addr |= mem_read(cpu, cpu->pc++) << 8;
+                    return false;
+                case 4:
+                    ts->value = mem_read(cpu, ts->addr);
+                    return false;
+                default:
+                    cpu->pc = ts->value | (mem_read(cpu, ts->addr + 1) << 8);
+                    return true;
+            }
+        case TICK_JSR:
+            switch (ts->cycle) {
+                case 2:
+                    ts->addr = mem_read(cpu, cpu->pc++);
+                    return false;
+                case 3:
+                    mem_read(cpu, get_stack_addr(cpu));
+                    return false;
+                case 4:
+                    stack_push(cpu, cpu->pc >> 8);
+                    return false;
+                case 5:
+                    stack_push(cpu, cpu->pc & 0xFF);
+                    return false;
+                default:
+                    cpu->pc = ts->addr | (mem_read(cpu, cpu->pc) << 8);
+                    return true;
+            }
+        case TICK_RTS:
+            switch (ts->cycle) {
+                case 2:
+                    mem_read(cpu, cpu->pc);
+                    return false;
+                case 3:
+                    mem_read(cpu, get_stack_addr(cpu));
+                    return false;
+                case 4:
+                    ts->addr = stack_pull(cpu);
+                    return false;
+                case 5:
+                    ts->addr |= stack_pull(cpu) << 8;
+                    return false;
+                default:
+                    mem_read(cpu, ts->addr);
+                    cpu->pc = ts->addr + 1;
+                    return true;
+            }
+        case TICK_RTI:
+            switch (ts->cycle) {
+                case 2:
+                    mem_read(cpu, cpu->pc);
+                    return false;
+                case 3:
+                    mem_read(cpu, get_stack_addr(cpu));
+                    return false;
+                case 4:
+                    set_p(cpu, stack_pull(cpu) & ~(P_B | P__));
+                    return false;
+                case 5:
+                    ts->addr = stack_pull(cpu);
+                    return false;
+                default:
+                    cpu->pc = ts->addr | (stack_pull(cpu) << 8);
+                    return true;
+            }
+        case TICK_BRK:
+            if (ts->cycle == 2) {
+                // Skips a padding byte after the opcode
+                mem_read(cpu, cpu->pc++);
+                return false;
+            }
+            return tick_interrupt(cpu, ts, true, IVT_IRQ);
+        case TICK_PUSH:
+            if (ts->cycle == 2) {
+                mem_read(cpu, cpu->pc);
+                return false;
+            }
+            (*op->func)(cpu, op, (OpParam) {0});
+            return true;
+        case TICK_PULL:
+            switch (ts->cycle) {
+                case 2:
+                    mem_read(cpu, cpu->pc);
+                    return false;
+                case 3:
+                    mem_read(cpu, get_stack_addr(cpu));
+                    return false;
+                default:
+                    (*op->func)(cpu, op, (OpParam) {0});
+                    return true;
+            }
+        default:
+            return true;
+    }
+}
+
+// Runs the first cycle: fetches the next opcode, unless an interrupt is due
+static bool tick_start(CPU65xx *cpu, CPU65xxTickState *ts, bool interrupt) {
+    ts->pc = cpu->pc;
+    ts->s = cpu->s;
+    ts->is_ready = false;
+    ts->access = 0;
+    if (interrupt) {
+        // NMI takes over an IRQ that is already underway
+        ts->op = NULL;
+        ts->nmi = cpu->nmi;
+        cpu->nmi = false;
+        if (cpu->trace) {
+            add_trace_entry(cpu, ts->nmi ? TRACE_NMI : TRACE_IRQ);
+        }
+        // The opcode still gets fetched, but then ignored
+        mem_read(cpu, cpu->pc);
+        return false;
+    }
+    
+    if (cpu->trace) {
+        trace_instruction(cpu, NULL);
+    }
+    ts->opcode = mem_read(cpu, cpu->pc++);
+    ts->op = get_opcode(ts->opcode);
+    ts->kind = get_tick_kind(ts->op);
+    return ts->kind == TICK_KIL;
+}
+
+#ifdef JIT
+
+// NATIVE CODE GENERATION //
+
+// Hot blocks get translated into x86-64 code. Simple instructions working on
+// registers and RAM are emitted inline, the others call a handler specialized
+// for their opcode. Translation stops before any instruction that may reach
+// I/O, so those still go through the interpreter at the right time.
+
+#define JIT_HOT_THRESHOLD 32
+#define JIT_BUFFER_SIZE (4 << 20)
+#define JIT_MAX_BLOCK_SIZE 0x1000
+
+typedef int (*NativeHandler)(CPU65xx *, uint16_t);
+
+#define X(code, ...) \
+    static int native_op_##code(CPU65xx *cpu, uint16_t raw) { \
+        const Opcode *op = &(const Opcode) {__VA_ARGS__}; \
+        OpParam p1 = {.addr = raw}, p2; \
+        resolve_param(cpu, op, p1, &p2); \
+        return run_instruction(cpu, op, p1, p2); \
+    }
+OPCODES(X)
+#undef X
+
+static const NativeHandler native_handlers[0x100] = {
+#define X(code, ...) [code] = native_op_##code,
+    OPCODES(X)
+#undef X
+};
+
+// Instruction encoding
+// rbx: cpu, r12d: cycles, r13: ram, r14: bus latch
+
+#define CPU_FIELD(field) ((int)offsetof(CPU65xx, field))
+#define CPU_REG(reg) ((int)reg_offsets[reg])
+
+static void emit(uint8_t **pos, int count, ...) {
+    va_list bytes;
+    va_start(bytes, count);
+    for (int i = 0; i < count; i++) {
+        *(*pos)++ = (uint8_t)va_arg(bytes, int);
+    }
+    va_end(bytes);
+}
+
+static void emit_imm(uint8_t **pos, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        *(*pos)++ = (uint8_t)(value >> (i * 8));
+    }
+}
+
+// ModRM + displacement for [rbx + offset]
+static void emit_cpu_operand(uint8_t **pos, int reg, int offset) {
+    if (offset < 0x80) {
+        emit(pos, 2, 0x43 | (reg << 3), offset);
+    } else {
+        emit(pos, 1, 0x83 | (reg << 3));
+        emit_imm(pos, offset, 4);
+    }
+}
+
+static void emit_load_al(uint8_t **pos, int offset) {
+    emit(pos, 1, 0x8A); // mov al, [rbx + offset]
+    emit_cpu_operand(pos, 0, offset);
+}
+
+static void emit_store_al(uint8_t **pos, int offset) {
+    emit(pos, 1, 0x88); // mov [rbx + offset], al
+    emit_cpu_operand(pos, 0, offset);
+}
+
+static void emit_p_op(uint8_t **pos, int ext, int mask) {
+    emit(pos, 1, 0x80); // and/or byte [rbx + p], mask
+    emit_cpu_operand(pos, ext, CPU_FIELD(p));
+    emit(pos, 1, mask);
+}
+
+static void emit_set_nz(uint8_t **pos) {
+    emit_store_al(pos, CPU_FIELD(n_result));
+    emit_store_al(pos, CPU_FIELD(z_result));
+}
+
+static void emit_set_pc(uint8_t **pos, uint16_t pc) {
+    emit(pos, 2, 0x66, 0xC7); // mov word [rbx + pc], imm16
+    emit_cpu_operand(pos, 0, CPU_FIELD(pc));
+    emit_imm(pos, pc, 2);
+}
+
+static void emit_bus(uint8_t **pos, uint8_t value) {
+    emit(pos, 4, 0x41, 0xC6, 0x06, value); // mov byte [r14], imm8
+}
+
+static void emit_add_cycles(uint8_t **pos, int cycles) {
+    emit(pos, 3, 0x41, 0x81, 0xC4); // add r12d, imm32
+    emit_imm(pos, cycles, 4);
+}
+
+// Leaves the RAM index of the operand in eax
+static void emit_ram_index(uint8_t **pos, CPU65xx *cpu, const Opcode *op,
+                           OpParam param) {
+    if (!op->reg2) {
+        uint16_t addr = op->am == AM_ZP ? param.immediate_value : param.addr;
+        emit(pos, 1, 0xB8); // mov eax, imm32
+        emit_imm(pos, addr & cpu->ram_mask, 4);
+        return;
+    }
+    emit(pos, 2, 0x0F, 0xB6); // movzx eax, byte [rbx + reg2]
+    emit_cpu_operand(pos, 0, CPU_REG(op->reg2));
+    if (op->am == AM_ZP) {
+        emit(pos, 2, 0x04, param.immediate_value); // add al, imm8
+        return;
+    }
+    emit(pos, 1, 0x05); // add eax, imm32
+    emit_imm(pos, param.addr, 4);
+    if (op->cycles < 0) {
+        emit(pos, 2, 0x89, 0xC1);       // mov ecx, eax
+        emit(pos, 3, 0xC1, 0xE9, 0x08); // shr ecx, 8
+        emit(pos, 2, 0x81, 0xF9);       // cmp ecx, imm32
+        emit_imm(pos, param.addr >> 8, 4);
+        emit(pos, 3, 0x0F, 0x95, 0xC1); // setne cl
+        emit(pos, 3, 0x0F, 0xB6, 0xC9); // movzx ecx, cl
+        emit(pos, 3, 0x41, 0x01, 0xCC); // add r12d, ecx
+    }
+    emit(pos, 1, 0x25); // and eax, imm32
+    emit_imm(pos, cpu->ram_mask, 4);
+}
+
+// Translation rules
+
+// Whether the instruction can only touch RAM, the stack and PRG ROM
+static bool is_native_safe(CPU65xx *cpu, const Opcode *op, OpParam param) {
+    switch (op->am) {
+        case AM_ZP:
+            return true;
+        case AM_ABSOLUTE:
+            if (op->func == op_JMP || op->func == op_JSR ||
+                is_in_ram(cpu, op, param)) {
+                return true;
+            }
+            return is_read_only(op) && param.addr >= 0x8000 &&
+                   param.addr + (op->reg2 ? 0xFF : 0) <= 0xFFFF;
+        case AM_INDIRECT_WORD:
+            return param.addr + 1 < cpu->ram_end || param.addr >= 0x8000;
+        case AM_INDIRECT_X:
+        case AM_INDIRECT_Y:
+            return false;
+        default:
+            return true;
+    }
+}
+
+static bool emit_inline(uint8_t **pos, CPU65xx *cpu, const Opcode *op,
+                        const DecodedInst *di, uint16_t next_pc) {
+    OpParam param = di->param;
+    if (op->func == op_LD && op->am == AM_IMMEDIATE) {
+        emit(pos, 2, 0xB0, param.immediate_value); // mov al, imm8
+        emit_store_al(pos, CPU_REG(op->reg1));
+        emit_set_nz(pos);
+    } else if (op->func == op_LD && is_in_ram(cpu, op, param)) {
+        emit_ram_index(pos, cpu, op, param);
+        emit(pos, 5, 0x41, 0x8A, 0x44, 0x05, 0x00); // mov al, [r13 + rax]
+        emit_store_al(pos, CPU_REG(op->reg1));
+        emit(pos, 3, 0x41, 0x88, 0x06);             // mov [r14], al
+        emit_set_nz(pos);
+        return true;
+    } else if (op->func == op_ST && is_in_ram(cpu, op, param)) {
+        emit_ram_index(pos, cpu, op, param);
+        emit(pos, 1, 0x8A);                         // mov cl, [rbx + reg1]
+        emit_cpu_operand(pos, 1, CPU_REG(op->reg1));
+        emit(pos, 5, 0x41, 0x88, 0x4C, 0x05, 0x00); // mov [r13 + rax], cl
+    } else if (op->func == op_T) {
+        emit_load_al(pos, CPU_REG(op->reg1));
+        emit_store_al(pos, CPU_REG(op->reg2));
+        if (op->reg2 != REG_S) {
+            emit_set_nz(pos);
+        }
+    } else if (op->func == op_IN || op->func == op_DE) {
+        emit_load_al(pos, CPU_REG(op->reg1));
+        emit(pos, 2, 0xFE, op->func == op_IN ? 0xC0 : 0xC8); // inc/dec al
+        emit_store_al(pos, CPU_REG(op->reg1));
+        emit_set_nz(pos);
+    } else if (op->am == AM_IMMEDIATE &&
+               (op->func == op_AND || op->func == op_ORA ||
+                op->func == op_EOR)) {
+        emit_load_al(pos, CPU_FIELD(a));
+        emit(pos, 2, op->func == op_AND ? 0x24 :
+                     op->func == op_ORA ? 0x0C : 0x34, // and/or/xor al, imm8
+             param.immediate_value);
+        emit_store_al(pos, CPU_FIELD(a));
+        emit_set_nz(pos);
+    } else if (op->func == op_CMP && op->am == AM_IMMEDIATE) {
+        emit_load_al(pos, CPU_REG(op->reg1));
+        emit_p_op(pos, 4, ~P_C);
+        emit(pos, 2, 0x3C, param.immediate_value); // cmp al, imm8
+        emit(pos, 3, 0x0F, 0x93, 0xC2);            // setae dl
+        emit(pos, 1, 0x08);                        // or [rbx + p], dl
+        emit_cpu_operand(pos, 2, CPU_FIELD(p));
+        emit(pos, 2, 0x2C, param.immediate_value); // sub al, imm8
+        emit_set_nz(pos);
+    } else if (op->func == op_CLC || op->func == op_CLD ||
+               op->func == op_CLV) {
+        emit_p_op(pos, 4, ~(op->func == op_CLC ? P_C :
+                            op->func == op_CLD ? P_D : P_V));
+    } else if (op->func == op_SEC || op->func == op_SED) {
+        emit_p_op(pos, 1, op->func == op_SEC ? P_C : P_D);
+    } else if (op->func == op_NOP && op->am == AM_IMPLIED) {
+        // Nothing to do
+    } else if (op->func == op_JMP && op->am == AM_ABSOLUTE) {
+        emit_set_pc(pos, param.addr);
+    } else if (op->am == AM_RELATIVE) {
+        PFlag flag;
+        bool value;
+        if (!get_branch_condition(op, &flag, &value)) {
+            return false;
+        }
+        uint16_t target = next_pc + param.relative_addr;
+        emit_set_pc(pos, next_pc);
+        bool is_zero_when_set = false;
+        if (flag == P_Z) {
+            emit(pos, 1, 0x80); // cmp byte [rbx + z_result], 0
+            emit_cpu_operand(pos, 7, CPU_FIELD(z_result));
+            emit(pos, 1, 0);
+            is_zero_when_set = true;
+        } else if (flag == P_N) {
+            emit(pos, 1, 0xF6); // test byte [rbx + n_result], 0x80
+            emit_cpu_operand(pos, 0, CPU_FIELD(n_result));
+            emit(pos, 1, 0x80);
+        } else {
+            emit(pos, 1, 0xF6); // test byte [rbx + p], flag
+            emit_cpu_operand(pos, 0, CPU_FIELD(p));
+            emit(pos, 1, flag);
+        }
+        uint8_t *skip = *pos;
+        emit(pos, 2, value != is_zero_when_set ? 0x74 : 0x75, 0); // jz/jnz
+        emit_set_pc(pos, target);
+        emit_add_cycles(pos, 1 + apply_page_boundary_penalty(next_pc,
+                                                             target));
+        skip[1] = *pos - skip - 2;
+    } else {
+        return false;
+    }
+    emit_bus(pos, di->bus);
+    return true;
+}
+
+static void emit_handler_call(uint8_t **pos, const DecodedInst *di,
+                              uint16_t next_pc) {
+    emit_set_pc(pos, next_pc);
+    emit_bus(pos, di->bus);
+    emit(pos, 3, 0x48, 0x89, 0xDF); // mov rdi, rbx
+    emit(pos, 1, 0xBE);             // mov esi, imm32
+    emit_imm(pos, di->param.addr, 4);
+    emit(pos, 2, 0x48, 0xB8);       // mov rax, imm64
+    emit_imm(pos, (uintptr_t)native_handlers[di->opcode], 8);
+    emit(pos, 2, 0xFF, 0xD0);       // call rax
+    emit(pos, 3, 0x41, 0x01, 0xC4); // add r12d, eax
+}
+
+// Returns the number of instructions translated
+static int compile_block(CPU65xx *cpu, CodeBlock *block, uint8_t *code) {
+    uint8_t *pos = code;
+    emit(&pos, 1, 0x53);                  // push rbx
+    // r15 isn't used, but pushing it keeps the stack aligned for calls
+    emit(&pos, 8, 0x41, 0x54, 0x41, 0x55, // push r12-r15
+                  0x41, 0x56, 0x41, 0x57);
+    emit(&pos, 3, 0x48, 0x89, 0xFB);      // mov rbx, rdi
+    emit(&pos, 3, 0x49, 0x89, 0xF5);      // mov r13, rsi
+    emit(&pos, 3, 0x49, 0x89, 0xD6);      // mov r14, rdx
+    emit(&pos, 3, 0x45, 0x31, 0xE4);      // xor r12d, r12d
+    
+    uint16_t pc = cpu->pc;
+    int cycles = 0;
+    int max_cycles = 0;
+    bool pc_is_set = false;
+    int count = 0;
+    while (count < block->length) {
+        const DecodedInst *di = &block->insts[count];
+        const Opcode *op = get_opcode(di->opcode);
+        if (!is_native_safe(cpu, op, di->param)) {
+            break;
+        }
+        uint16_t next_pc = pc + di->size;
+        max_cycles += abs(op->cycles) + (op->cycles < 0) +
+                      (op->am == AM_RELATIVE ? 2 : 0);
+        if (emit_inline(&pos, cpu, op, di, next_pc)) {
+            cycles += abs(op->cycles);
+            pc_is_set = op->func == op_JMP || op->am == AM_RELATIVE;
+        } else {
+            emit_handler_call(&pos, di, next_pc);
+            pc_is_set = true;
+        }
+        pc = next_pc;
+        count++;
+        // Unmasking the IRQ line must give it a chance to fire
+        if (op->func == op_CLI || (op->func == op_PL && op->reg1 == REG_P)) {
+            break;
+        }
+    }
+    
+    if (!pc_is_set) {
+        emit_set_pc(&pos, pc);
+    }
+    emit_add_cycles(&pos, cycles);
+    emit(&pos, 3, 0x44, 0x89, 0xE0);      // mov eax, r12d
+    emit(&pos, 8, 0x41, 0x5F, 0x41, 0x5E, // pop r15-r12
+                  0x41, 0x5D, 0x41, 0x5C);
+    emit(&pos, 2, 0x5B, 0xC3);            // pop rbx, ret
+    
+    block->native = (NativeBlockFunc)code;
+    block->native_pc = cpu->pc;
+    block->native_size = (int)(pos - code);
+    block->native_cycles = max_cycles;
+    return count;
+}
+
+static void init_native(CPU65xxBlockCache *bc) {
+    bc->code = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bc->code == MAP_FAILED) {
+        eprintf("Couldn't allocate memory for native code\n");
+        bc->code = NULL;
+    }
+}
+
+// Runs the native version of the block just entered, if it is hot enough and
+// sure to end before the run does
+static int run_native(CPU65xx *cpu, CodeBlock *block) {
+    CPU65xxBlockCache *bc = cpu->blocks;
+    if (!bc->code || !cpu->ram || cpu->trace || cpu->profile) {
+        return 0; // Traces and profiles need to see every instruction
+    }
+    
+    if (!block->native) {
+        if (block->heat < 0 || ++block->heat < JIT_HOT_THRESHOLD) {
+            return 0;
+        }
+        if (bc->code_used + JIT_MAX_BLOCK_SIZE > JIT_BUFFER_SIZE) {
+            flush_blocks(bc);
+            return 0;
+        }
+        if (!compile_block(cpu, block, bc->code + bc->code_used)) {
+            block->native = NULL;
+            block->heat = -1;
+            return 0;
+        }
+        bc->code_used += block->native_size;
+    }
+    if (block->native_pc != cpu->pc) {
+        return 0; // Mirrored elsewhere, branches would go to the wrong place
+    }
+    if (cpu->cycles + block->native_cycles > cpu->run_end) {
+        return 0; // Interrupts must be checked in between
+    }
+    
+    bc->block = NULL;
+    return (*block->native)(cpu, cpu->ram, cpu->bus_latch);
+}
+
+#endif /* JIT */
+
+// RUN LOOP //
+
+// Runs the next instruction or interrupt sequence, or as much translated code
+// as fits in the run
+static void run_next(CPU65xx *cpu) {
+    int t = check_interrupts(cpu, false);
+    CodeBlock *block = (t ? NULL : enter_block(cpu));
+    if (block && run_recompiled(cpu, block)) {
+        return; // It keeps track of the cycles itself
+    }
+#ifdef JIT
+    if (block) {
+        t = run_native(cpu, block);
+    }
+#endif
+    if (!t) {
+        t = step_specialized(cpu);
+    }
+    cpu->cycles += t;
+}
+
+// BATCH ENGINE //
+
+// CPUs running the same ROM step together while they are at the same PC:
+// each instruction gets decoded once, then runs on all of them in loops over
+// their state, packed by register rather than by CPU so that the compiler can
+// vectorize them. Anything that may reach I/O or interrupts, and branches
+// that don't go the same way for all of them, go through the usual path on
+// each CPU alone. The lowest PC always runs first, so the CPUs that went
+// separate ways meet again where the code joins.
+
+#define BATCH_LANES CPU65XX_BATCH_MAX_LANES
+
+struct CPU65xxBatch {
+    CPU65xx **cpus;
+    int count;
+    int waiting[BATCH_LANES]; // CPUs at the lowest PC
+    
+    // Lanes stepping together, the first one leads
+    int length;
+    int lanes[BATCH_LANES]; // Which CPU each lane is
+    uint16_t pc;
+    uint8_t a[BATCH_LANES];
+    uint8_t x[BATCH_LANES];
+    uint8_t y[BATCH_LANES];
+    uint8_t s[BATCH_LANES];
+    uint8_t p[BATCH_LANES];
+    uint8_t n_result[BATCH_LANES];
+    uint8_t z_result[BATCH_LANES];
+    uint8_t bus[BATCH_LANES];
+    uint64_t cycles[BATCH_LANES];
+    uint64_t run_end[BATCH_LANES];
+    uint8_t *ram[BATCH_LANES];
+    uint16_t ram_mask;
+    uint16_t ram_end;
+    
+    // Current instruction
+    uint16_t addr[BATCH_LANES];    // Effective address
+    uint8_t pointer[BATCH_LANES];  // High byte of the indirect modes' pointer
+    uint8_t value[BATCH_LANES];    // Operand
+    uint8_t penalty[BATCH_LANES];  // Page boundary crossed by indexing
+    uint8_t zero[BATCH_LANES];     // Index of the modes without one
+    bool is_diverged;
+    uint16_t next_pc[BATCH_LANES]; // Once diverged
+    
+    // Last iteration of an idle loop, same as the block cache
+    uint64_t idle_state[BATCH_LANES];
+    uint64_t idle_cycles[BATCH_LANES];
+};
+
+static uint8_t *batch_reg(CPU65xxBatch *b, Register reg) {
+    switch (reg) {
+        case REG_A:
+            return b->a;
+        case REG_X:
+            return b->x;
+        case REG_Y:
+            return b->y;
+        case REG_S:
+            return b->s;
+        case REG_P:
+            return b->p;
+        default:
+            return b->zero;
+    }
+}
+
+static bool is_runnable(CPU65xx *cpu) {
+    return cpu->cycles < cpu->run_end;
+}
+
+// Whether the CPU can step with the others from PC, as it won't take an
+// interrupt before it runs something that can change that
+static bool is_batchable(CPU65xx *cpu, const CPU65xx *leader) {
+    return cpu->blocks && !cpu->trace && !cpu->profile && !cpu->nmi &&
+           !(cpu->irq && !get_p_flag(cpu, P_I)) && cpu->ram_end >= 0x200 &&
+           cpu->ram_end == leader->ram_end &&
+           cpu->ram_mask == leader->ram_mask;
+}
+
+static void batch_pack(CPU65xxBatch *b, int lane) {
+    CPU65xx *cpu = b->cpus[lane];
+    int i = b->length++;
+    b->lanes[i] = lane;
+    b->a[i] = cpu->a;
+    b->x[i] = cpu->x;
+    b->y[i] = cpu->y;
+    b->s[i] = cpu->s;
+    b->p[i] = cpu->p;
+    b->n_result[i] = cpu->n_result;
+    b->z_result[i] = cpu->z_result;
+    b->bus[i] = *cpu->bus_latch;
+    b->cycles[i] = cpu->cycles;
+    b->run_end[i] = cpu->run_end;
+    b->ram[i] = cpu->ram;
+}
+
+static void batch_unpack(CPU65xxBatch *b, int i, bool has_run) {
+    CPU65xx *cpu = b->cpus[b->lanes[i]];
+    cpu->a = b->a[i];
+    cpu->x = b->x[i];
+    cpu->y = b->y[i];
+    cpu->s = b->s[i];
+    cpu->p = b->p[i];
+    cpu->n_result = b->n_result[i];
+    cpu->z_result = b->z_result[i];
+    cpu->pc = (b->is_diverged ? b->next_pc[i] : b->pc);
+    *cpu->bus_latch = b->bus[i];
+    cpu->cycles = b->cycles[i];
+    
+    // Whatever the block cache was replaying or watching is gone
+    if (has_run) {
+        cpu->blocks->block = NULL;
+        cpu->blocks->idle_block = NULL;
+    }
+}
+
+static void batch_move(CPU65xxBatch *b, int from, int to) {
+    b->lanes[to] = b->lanes[from];
+    b->a[to] = b->a[from];
+    b->x[to] = b->x[from];
+    b->y[to] = b->y[from];
+    b->s[to] = b->s[from];
+    b->p[to] = b->p[from];
+    b->n_result[to] = b->n_result[from];
+    b->z_result[to] = b->z_result[from];
+    b->bus[to] = b->bus[from];
+    b->cycles[to] = b->cycles[from];
+    b->run_end[to] = b->run_end[from];
+    b->ram[to] = b->ram[from];
+}
+
+// Lets the lanes whose run is over go (the others don't depend on them),
+// returns whether there were any
+static bool batch_drop_finished(CPU65xxBatch *b) {
+    bool is_any = false;
+    for (int i = 0; i < b->length; i++) {
+        is_any |= b->cycles[i] >= b->run_end[i];
+    }
+    for (int i = b->length - 1; is_any && i >= 0; i--) {
+        if (b->cycles[i] >= b->run_end[i]) {
+            batch_unpack(b, i, true);
+            batch_move(b, --b->length, i);
+        }
+    }
+    return is_any;
+}
+
+// Whether the ROM at PC is the same for all lanes, through size bytes
+static bool batch_check_code(CPU65xxBatch *b, const uint8_t **host,
+                             int *size) {
+    *host = (*b->cpus[b->lanes[0]]->code_func)(b->cpus[b->lanes[0]]->mm,
+                                               b->pc, size);
+    for (int i = 1; *host && i < b->length; i++) {
+        CPU65xx *cpu = b->cpus[b->lanes[i]];
+        int lane_size;
+        if ((*cpu->code_func)(cpu->mm, b->pc, &lane_size) != *host) {
+            return false;
+        }
+    }
+    return *host != NULL;
+}
+
+// Works out the effective address on every lane, only the pointers of the
+// indirect modes get read (from RAM, and like mem_read_word() the high byte
+// of a pointer at $FF comes from $0100, not $0000)
+static bool batch_address(CPU65xxBatch *b, const Opcode *op, OpParam p1) {
+    const int n = b->length;
+    const uint8_t *index = batch_reg(b, op->reg2);
+    const uint16_t mask = b->ram_mask;
+    switch (op->am) {
+        case AM_ZP:
+            for (int i = 0; i < n; i++) {
+                b->addr[i] = (uint8_t)(p1.immediate_value + index[i]);
+                b->penalty[i] = 0;
+            }
+            return true;
+        case AM_ABSOLUTE:
+            for (int i = 0; i < n; i++) {
+                b->addr[i] = p1.addr + index[i];
+                b->penalty[i] = (b->addr[i] >> 8) != (p1.addr >> 8);
+            }
+            return true;
+        case AM_INDIRECT_X:
+            for (int i = 0; i < n; i++) {
+                uint8_t ptr = p1.immediate_value + b->x[i];
+                b->pointer[i] = b->ram[i][(ptr + 1) & mask];
+                b->addr[i] = b->ram[i][ptr & mask] | (b->pointer[i] << 8);
+                b->penalty[i] = 0;
+            }
+            return true;
+        case AM_INDIRECT_Y: {
+            uint8_t ptr = p1.immediate_value;
+            for (int i = 0; i < n; i++) {
+                b->pointer[i] = b->ram[i][(ptr + 1) & mask];
+                uint16_t base = b->ram[i][ptr & mask] | (b->pointer[i] << 8);
+                b->addr[i] = base + b->y[i];
+                b->penalty[i] = (b->addr[i] >> 8) != (base >> 8);
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static bool batch_is_in_ram(CPU65xxBatch *b) {
+    bool is_in_ram = true;
+    for (int i = 0; i < b->length; i++) {
+        is_in_ram &= b->addr[i] < b->ram_end;
+    }
+    return is_in_ram;
+}
+
+// Reads the operand on every lane, unless one of them isn't in RAM or ROM
+static bool batch_read(CPU65xxBatch *b) {
+    const int n = b->length;
+    const uint16_t mask = b->ram_mask;
+    if (batch_is_in_ram(b)) {
+        for (int i = 0; i < n; i++) {
+            b->value[i] = b->ram[i][b->addr[i] & mask];
+        }
+        return true;
+    }
+    for (int i = 0; i < n; i++) {
+        CPU65xx *cpu = b->cpus[b->lanes[i]];
+        int size;
+        const uint8_t *host;
+        if (b->addr[i] < b->ram_end) {
+            b->value[i] = b->ram[i][b->addr[i] & mask];
+        } else if ((host = (*cpu->code_func)(cpu->mm, b->addr[i], &size))) {
+            b->value[i] = *host;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void batch_write(CPU65xxBatch *b, const uint8_t *values) {
+    for (int i = 0; i < b->length; i++) {
+        b->ram[i][b->addr[i] & b->ram_mask] = values[i];
+    }
+}
+
+static void batch_apply_nz(CPU65xxBatch *b, const uint8_t *values) {
+    for (int i = 0; i < b->length; i++) {
+        b->n_result[i] = b->z_result[i] = values[i];
+    }
+}
+
+static void batch_push(CPU65xxBatch *b, const uint8_t *values) {
+    for (int i = 0; i < b->length; i++) {
+        b->ram[i][(0x100 + b->s[i]--) & b->ram_mask] = values[i];
+    }
+}
+
+static void batch_pull(CPU65xxBatch *b, uint8_t *values) {
+    for (int i = 0; i < b->length; i++) {
+        values[i] = b->ram[i][(0x100 + ++b->s[i]) & b->ram_mask];
+    }
+}
+
+static void batch_set_flag(CPU65xxBatch *b, PFlag flag, bool value) {
+    for (int i = 0; i < b->length; i++) {
+        b->p[i] = (value ? b->p[i] | flag : b->p[i] & ~flag);
+    }
+}
+
+// The branch is taken or not on all lanes, or they diverge
+static int batch_branch(CPU65xxBatch *b, const Opcode *op, OpParam p1) {
+    const int n = b->length;
+    PFlag flag = P_C;
+    bool value = false;
+    get_branch_condition(op, &flag, &value);
+    uint8_t *taken = b->value;
+    for (int i = 0; i < n; i++) {
+        bool is_set = (flag == P_N ? b->n_result[i] & P_N :
+                       flag == P_Z ? !b->z_result[i] : b->p[i] & flag);
+        taken[i] = (is_set == value);
+    }
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        count += taken[i];
+    }
+    
+    uint16_t target = b->pc + p1.relative_addr;
+    int t = 1 + apply_page_boundary_penalty(b->pc, target);
+    if (count == n) {
+        b->pc = target;
+        return t;
+    } else if (!count) {
+        return 0;
+    }
+    for (int i = 0; i < n; i++) {
+        b->next_pc[i] = (taken[i] ? target : b->pc);
+        b->cycles[i] += (taken[i] ? t : 0);
+    }
+    b->is_diverged = true;
+    return 0;
+}
+
+static void batch_shift(CPU65xxBatch *b, const Opcode *op, uint8_t *values) {
+    const int n = b->length;
+    bool is_left = (op->func == op_ASL || op->func == op_ROL);
+    bool is_rotate = (op->func == op_ROL || op->func == op_ROR);
+    for (int i = 0; i < n; i++) {
+        uint8_t carry = (is_rotate ? b->p[i] & P_C : 0);
+        uint8_t value = values[i];
+        if (is_left) {
+            b->p[i] = (b->p[i] & ~P_C) | (value >> 7);
+            value = (value << 1) | carry;
+        } else {
+            b->p[i] = (b->p[i] & ~P_C) | (value & 1);
+            value = (value >> 1) | (carry << 7);
+        }
+        values[i] = b->n_result[i] = b->z_result[i] = value;
+    }
+}
+
+// Runs the opcode on every lane after the operand got read, same as its
+// function does on a single CPU. Returns the cycles it adds.
+static int batch_operate(CPU65xxBatch *b, const Opcode *op, OpParam p1,
+                         uint16_t next_pc) {
+    const int n = b->length;
+    uint8_t *reg1 = batch_reg(b, op->reg1);
+    uint8_t *value = b->value;
+    OpcodeFunc func = op->func;
+    if (func == op_LD) {
+        for (int i = 0; i < n; i++) {
+            reg1[i] = value[i];
+        }
+        batch_apply_nz(b, value);
+    } else if (func == op_ST) {
+        batch_write(b, reg1);
+    } else if (op->am == AM_RELATIVE) {
+        b->pc = next_pc;
+        return batch_branch(b, op, p1);
+    } else if (func == op_ADC || func == op_SBC) {
+        bool is_sub = (func == op_SBC);
+        for (int i = 0; i < n; i++) {
+            uint8_t carry = b->p[i] & P_C;
+            int sum = (is_sub ? b->a[i] + carry - 1 - value[i]
+                              : b->a[i] + carry + value[i]);
+            uint8_t result = sum;
+            bool is_carry = (is_sub ? sum >= 0 : sum >= 0x100);
+            b->p[i] = (b->p[i] & ~(P_C | P_V)) | (is_carry ? P_C : 0) |
+                      ((result ^ b->a[i]) & P_N ? P_V : 0);
+            b->a[i] = b->n_result[i] = b->z_result[i] = result;
+        }
+    } else if (func == op_AND || func == op_EOR || func == op_ORA) {
+        for (int i = 0; i < n; i++) {
+            b->a[i] = (func == op_AND ? b->a[i] & value[i] :
+                       func == op_EOR ? b->a[i] ^ value[i] :
+                                        b->a[i] | value[i]);
+        }
+        batch_apply_nz(b, b->a);
+    } else if (func == op_CMP) {
+        for (int i = 0; i < n; i++) {
+            b->p[i] = (b->p[i] & ~P_C) | (reg1[i] >= value[i] ? P_C : 0);
+            b->n_result[i] = b->z_result[i] = reg1[i] - value[i];
+        }
+    } else if (func == op_BIT) {
+        for (int i = 0; i < n; i++) {
+            b->z_result[i] = (b->a[i] & value[i]) != 0;
+            b->n_result[i] = value[i] & P_N;
+            b->p[i] = (b->p[i] & ~P_V) | (value[i] & P_V);
+        }
+    } else if (func == op_INC || func == op_DEC) {
+        for (int i = 0; i < n; i++) {
+            value[i] += (func == op_INC ? 1 : -1);
+        }
+        batch_write(b, value);
+        batch_apply_nz(b, value);
+    } else if (func == op_IN || func == op_DE) {
+        for (int i = 0; i < n; i++) {
+            reg1[i] += (func == op_IN ? 1 : -1);
+        }
+        batch_apply_nz(b, reg1);
+    } else if (func == op_ASL || func == op_ROL || func == op_LSR ||
+               func == op_ROR) {
+        batch_shift(b, op, op->reg1 ? reg1 : value);
+        if (!op->reg1) {
+            batch_write(b, value);
+        }
+    } else if (func == op_T) {
+        uint8_t *reg2 = batch_reg(b, op->reg2);
+        for (int i = 0; i < n; i++) {
+            reg2[i] = reg1[i];
+        }
+        if (op->reg2 != REG_S) {
+            batch_apply_nz(b, reg2);
+        }
+    } else if (func == op_PH) {
+        for (int i = 0; i < n; i++) {
+            value[i] = (op->reg1 != REG_P ? reg1[i] :
+                        b->p[i] | (b->n_result[i] & P_N) |
+                        (b->z_result[i] ? 0 : P_Z) | P_B | P__);
+        }
+        batch_push(b, value);
+    } else if (func == op_PL) {
+        batch_pull(b, value);
+        for (int i = 0; i < n; i++) {
+            b->a[i] = b->bus[i] = value[i];
+        }
+        batch_apply_nz(b, value);
+    } else if (func == op_JMP) {
+        b->pc = p1.addr;
+        return 0;
+    } else if (func == op_JSR) {
+        uint16_t ret = next_pc - 1;
+        memset(value, ret >> 8, n);
+        batch_push(b, value);
+        memset(value, ret & 0xFF, n);
+        batch_push(b, value);
+        b->pc = p1.addr;
+        return 0;
+    } else if (func == op_RTS) {
+        uint8_t *lower = b->pointer;
+        batch_pull(b, lower);
+        batch_pull(b, value);
+        bool is_same = true;
+        for (int i = 0; i < n; i++) {
+            b->bus[i] = value[i];
+            b->next_pc[i] = (lower[i] | (value[i] << 8)) + 1;
+            is_same &= b->next_pc[i] == b->next_pc[0];
+        }
+        b->pc = b->next_pc[0];
+        b->is_diverged = !is_same;
+        return 0;
+    } else if (func == op_CLC || func == op_SEC) {
+        batch_set_flag(b, P_C, func == op_SEC);
+    } else if (func == op_CLV) {
+        batch_set_flag(b, P_V, false);
+    } else if (func == op_CLD || func == op_SED) {
+        batch_set_flag(b, P_D, func == op_SED);
+    } else if (func == op_SEI) {
+        batch_set_flag(b, P_I, true);
+    }
+    b->pc = next_pc;
+    return 0;
+}
+
+// Whether the instruction may run on all lanes at once: it only touches
+// registers, RAM and ROM, and doesn't make interrupts possible
+static bool is_batch_safe(const Opcode *op) {
+    if (op == &opcode_kil || op->func == op_BRK || op->func == op_RTI ||
+        op->func == op_CLI) {
+        return false;
+    }
+    if (op->func == op_PL) {
+        return op->reg1 != REG_P;
+    }
+    return op->am != AM_INDIRECT_WORD;
+}
+
+static bool is_batch_write(const Opcode *op) {
+    return op->func == op_ST ||
+           ((op->func == op_INC || op->func == op_DEC || op->func == op_ASL ||
+             op->func == op_ROL || op->func == op_LSR || op->func == op_ROR) &&
+            !op->reg1);
+}
+
+// Decodes the instruction at PC and reads its operand on every lane, or
+// returns NULL when it can't run on all of them at once
+static const Opcode *batch_fetch(CPU65xxBatch *b, const uint8_t *code,
+                                 int size, OpParam *p1) {
+    const Opcode *op = get_opcode(code[0]);
+    int param_size = get_param_size(op->am);
+    int fetch_size = 1 + (param_size ? param_size : 1);
+    if (fetch_size > size || !is_batch_safe(op)) {
+        return NULL;
+    }
+    p1->addr = 0;
+    if (param_size == 2) {
+        p1->addr = code[1] | (code[2] << 8);
+    } else if (param_size) {
+        p1->immediate_value = code[1];
+    }
+    
+    // Only the operand and the pointers of the indirect modes get read
+    bool is_write = is_batch_write(op);
+    bool is_read = is_read_only(op) || (is_write && op->func != op_ST);
+    if (!is_read && !is_write) {
+        return op;
+    } else if (op->am == AM_IMMEDIATE) {
+        memset(b->value, p1->immediate_value, b->length);
+        return op;
+    }
+    if ((op->am == AM_INDIRECT_X || op->am == AM_INDIRECT_Y) &&
+        b->ram_end <= 0x100) {
+        return NULL;
+    }
+    batch_address(b, op, *p1);
+    if (is_write && !batch_is_in_ram(b)) {
+        return NULL;
+    }
+    if (is_read && !batch_read(b)) {
+        return NULL;
+    }
+    return op;
+}
+
+// Runs the instruction fetched from code on all lanes
+static void batch_execute(CPU65xxBatch *b, const Opcode *op, OpParam p1,
+                          const uint8_t *code) {
+    const int n = b->length;
+    int param_size = get_param_size(op->am);
+    
+    // Same as the fetch, then the reads
+    const uint8_t *bus = NULL;
+    if (op->am == AM_INDIRECT_X || op->am == AM_INDIRECT_Y) {
+        bus = (is_read_only(op) ? b->value : b->pointer);
+    } else if (op->am == AM_ZP || op->am == AM_ABSOLUTE) {
+        bool is_rmw = is_batch_write(op) && op->func != op_ST;
+        bus = (is_read_only(op) || is_rmw ? b->value : NULL);
+    }
+    for (int i = 0; i < n; i++) {
+        b->bus[i] = (bus ? bus[i] : code[param_size ? param_size : 1]);
+    }
+    
+    int t = abs(op->cycles) + batch_operate(b, op, p1, b->pc + 1 + param_size);
+    for (int i = 0; i < n; i++) {
+        b->cycles[i] += t + (op->cycles < 0 ? b->penalty[i] : 0);
+    }
+}
+
+static uint64_t get_idle_state(CPU65xxBatch *b, int i) {
+    uint8_t p = b->p[i] | (b->n_result[i] & P_N) | (b->z_result[i] ? 0 : P_Z);
+    return b->a[i] | (b->x[i] << 8) | (b->y[i] << 16) |
+           ((uint64_t)b->s[i] << 24) | ((uint64_t)p << 32);
+}
+
+// Called after each iteration of an idle loop, skips the ones that got back
+// to where they started, like track_idle_loop would
+static void batch_track_idle_loop(CPU65xxBatch *b, bool is_repeat) {
+    for (int i = 0; i < b->length; i++) {
+        uint64_t state = get_idle_state(b, i);
+        if (is_repeat && state == b->idle_state[i] &&
+            b->cycles[i] < b->run_end[i]) {
+            uint64_t period = b->cycles[i] - b->idle_cycles[i];
+            b->cycles[i] += (b->run_end[i] - b->cycles[i] - 1) / period *
+                            period;
+        }
+        b->idle_state[i] = state;
+        b->idle_cycles[i] = b->cycles[i];
+    }
+}
+
+// Runs the lanes together for as long as they stay at the same PC, below
+// limit (where the next CPU waits). Returns how many instructions ran.
+static int batch_run_lanes(CPU65xxBatch *b, uint32_t limit) {
+    const uint8_t *host = NULL;
+    uint16_t host_pc = 0;
+    int host_size = 0;
+    const CodeBlock *loop = NULL; // Last block jumped back to
+    const CodeBlock *idle = NULL; // Idle loop started since
+    int idle_length = 0;
+    int count = 0;
+    b->is_diverged = false;
+    while (true) {
+        if (batch_drop_finished(b)) {
+            loop = idle = NULL;
+        }
+        if (b->length < 2) {
+            break;
+        }
+        
+        // All the lanes run the same code up to where it may be mapped
+        // differently
+        uint16_t pc = b->pc;
+        if (!host || pc < host_pc || pc >= host_pc + host_size) {
+            if (!batch_check_code(b, &host, &host_size)) {
+                break;
+            }
+            host_pc = pc;
+        }
+        const uint8_t *code = host + (pc - host_pc);
+        OpParam p1;
+        const Opcode *op = batch_fetch(b, code, host_size - (pc - host_pc),
+                                       &p1);
+        if (!op) {
+            break;
+        }
+        batch_execute(b, op, p1, code);
+        count++;
+        idle_length++;
+        if (b->is_diverged || b->pc >= limit) {
+            break;
+        }
+        
+        // Idle loops are blocks that jump back to their start, with nothing
+        // else running in between two iterations
+        if (b->pc <= pc) {
+            if (!loop || loop->pc != b->pc) {
+                CPU65xx *leader = b->cpus[b->lanes[0]];
+                leader->pc = b->pc;
+                loop = lookup_block(leader);
+            }
+            if (loop && loop->is_idle && loop->pc == b->pc) {
+                batch_track_idle_loop(b, idle == loop &&
+                                         idle_length == loop->length);
+                idle = loop;
+                idle_length = 0;
+            }
+        }
+    }
+    for (int i = 0; i < b->length; i++) {
+        batch_unpack(b, i, count > 0);
+    }
+    return count;
+}
+
+// Runs the CPUs at the lowest PC until they get past the next one, returns
+// false once all the runs are over
+static bool batch_run_lowest(CPU65xxBatch *b) {
+    uint32_t pc = 0x10000;
+    uint32_t limit = 0x10000;
+    for (int i = 0; i < b->count; i++) {
+        CPU65xx *cpu = b->cpus[i];
+        if (!is_runnable(cpu)) {
+            continue;
+        }
+        if (cpu->pc < pc) {
+            limit = pc;
+            pc = cpu->pc;
+        } else if (cpu->pc > pc && cpu->pc < limit) {
+            limit = cpu->pc;
+        }
+    }
+    if (pc > 0xFFFF) {
+        return false;
+    }
+    
+    // The lanes need the same code at PC, the others go alone
+    int waiting = 0;
+    for (int i = 0; i < b->count; i++) {
+        if (is_runnable(b->cpus[i]) && b->cpus[i]->pc == pc) {
+            b->waiting[waiting++] = i;
+        }
+    }
+    // The first one that can step with others leads, when the instruction
+    // can run batched at all
+    int lead = 0;
+    const uint8_t *host = NULL;
+    int size;
+    for (; lead < waiting && !host; lead++) {
+        CPU65xx *cpu = b->cpus[b->waiting[lead]];
+        if (is_batchable(cpu, cpu)) {
+            host = (*cpu->code_func)(cpu->mm, pc, &size);
+        }
+    }
+    b->length = 0;
+    OpParam p1;
+    if (host) {
+        CPU65xx *leader = b->cpus[b->waiting[lead - 1]];
+        batch_pack(b, b->waiting[lead - 1]);
+        b->pc = pc;
+        b->ram_mask = leader->ram_mask;
+        b->ram_end = leader->ram_end;
+        if (!batch_fetch(b, host, size, &p1)) {
+            b->length = 0;
+        }
+        for (int i = lead; b->length && i < waiting; i++) {
+            CPU65xx *cpu = b->cpus[b->waiting[i]];
+            int cpu_size;
+            if (is_batchable(cpu, leader) &&
+                (*cpu->code_func)(cpu->mm, pc, &cpu_size) == host) {
+                batch_pack(b, b->waiting[i]);
+            }
+        }
+    }
+    if (b->length > 1 && batch_run_lanes(b, limit)) {
+        return true;
+    }
+    
+    // Alone, or on an instruction that can't run on all lanes at once
+    for (int i = 0; i < waiting; i++) {
+        CPU65xx *cpu = b->cpus[b->waiting[i]];
+        run_next(cpu);
+        while (waiting == 1 && is_runnable(cpu) && cpu->pc < limit) {
+            run_next(cpu);
+        }
+    }
+    return true;
+}
+
+#undef BATCH_LANES
+
+// PUBLIC FUNCTIONS //
+
+void cpu_65xx_init(CPU65xx *cpu, void *mm, CPU65xxReadFuncPtr read_func,
+                                           CPU65xxWriteFuncPtr write_func) {
+    cpu->a = cpu->x = cpu->y = cpu->s = 0;
+    set_p(cpu, P__);
+    cpu->pc = 0;
+    cpu->nmi = false;
+    cpu->irq = 0;
+    cpu->cycles = cpu->run_end = 0;
+    
+    cpu->mm = mm;
+    cpu->read_func = read_func;
+    cpu->write_func = write_func;
+    
+    cpu->code_func = NULL;
+    cpu->code_gen = NULL;
+    cpu->bus_latch = NULL;
+    cpu->blocks = NULL;
+    cpu->ram = NULL;
+    cpu->ram_end = 0;
+    cpu->recompiled = NULL;
+    cpu->rom = NULL;
+    cpu->trace = NULL;
+    cpu->profile = NULL;
+    memset(&cpu->tick, 0, sizeof(CPU65xxTickState));
+}
+
+void cpu_65xx_set_code_map(CPU65xx *cpu, CPU65xxCodeFuncPtr code_func,
+                           const unsigned *code_gen, uint8_t *bus_latch) {
+    // code_gen must change whenever the memory behind code_func is remapped,
+    // and bus_latch receives the last byte fetched by a cached instruction
+    cpu->code_func = code_func;
+    cpu->code_gen = code_gen;
+    cpu->bus_latch = bus_latch;
+    if (!cpu->blocks) {
+        cpu->blocks = calloc(1, sizeof(CPU65xxBlockCache));
+#ifdef JIT
+        init_native(cpu->blocks);
+#endif
+    }
+}
+
+void cpu_65xx_set_direct_ram(CPU65xx *cpu, uint8_t *ram, uint16_t mask,
+                             uint16_t end) {
+    cpu->ram = ram;
+    cpu->ram_mask = mask;
+    cpu->ram_end = end;
+}
+
+void cpu_65xx_set_recompiled(CPU65xx *cpu, const CPU65xxRecompiled *code,
+                             const uint8_t *rom) {
+    cpu->recompiled = code;
+    cpu->rom = rom;
+    flush_blocks(cpu->blocks);
+}
+
+void cpu_65xx_set_trace(CPU65xx *cpu, Trace *trace) {
+    cpu->trace = trace;
+}
+
+void cpu_65xx_set_profile(CPU65xx *cpu, Profile *profile) {
+    cpu->profile = profile;
+}
+
+void cpu_65xx_teardown(CPU65xx *cpu) {
+#ifdef JIT
+    if (cpu->blocks && cpu->blocks->code) {
+        munmap(cpu->blocks->code, JIT_BUFFER_SIZE);
+    }
+#endif
+    free(cpu->blocks);
+    cpu->blocks = NULL;
+}
+
+int cpu_65xx_step(CPU65xx *cpu, bool verbose) {
+    if (verbose) {
+        printf("$%04x ", cpu->pc);
+    }
+    
+    int t = check_interrupts(cpu, verbose);
+    if (!t && !verbose) {
+        t = step_specialized(cpu);
+    } else if (!t) {
+        if (cpu->trace) {
+            trace_instruction(cpu, NULL);
+        }
+        // Fetch next instruction through the lookup table
+        uint16_t pc = cpu->pc;
+        uint8_t s = cpu->s;
+        uint8_t inst = mem_read(cpu, cpu->pc++);
+        const Opcode *op = get_opcode(inst);
+        
+        OpParam p1, p2;
+        fetch_param(cpu, op, &p1);
+        resolve_param(cpu, op, p1, &p2);
+        print_instruction(op, p1);
+        t = run_instruction(cpu, op, p1, p2);
+        if (cpu->profile) {
+            profile_instruction(cpu, pc, inst, s, t);
+        }
+        if (cpu->blocks) {
+            cpu->blocks->idle_block = NULL;
+        }
+    }
+    cpu->cycles += t;
+    return t;
+}
+
+int cpu_65xx_run(CPU65xx *cpu, int budget) {
+    uint64_t start = cpu->cycles;
+    cpu->run_end = start + budget;
+    while (cpu->cycles < cpu->run_end) {
+        run_next(cpu);
+    }
+    cpu->run_end = 0;
+    return (int)(cpu->cycles - start);
+}
+
+void cpu_65xx_stop(CPU65xx *cpu) {
+    cpu->run_end = 0;
+}
+
+CPU65xxBatch *cpu_65xx_batch_create(CPU65xx *const *cpus, int count) {
+    if (count > CPU65XX_BATCH_MAX_LANES) {
+        return NULL;
+    }
+    CPU65xxBatch *batch = calloc(1, sizeof(CPU65xxBatch));
+    batch->cpus = malloc(count * sizeof(CPU65xx *));
+    memcpy(batch->cpus, cpus, count * sizeof(CPU65xx *));
+    batch->count = count;
+    return batch;
+}
+
+void cpu_65xx_batch_free(CPU65xxBatch *batch) {
+    free(batch->cpus);
+    free(batch);
+}
+
+void cpu_65xx_batch_run(CPU65xxBatch *batch, const int *budgets) {
+    for (int i = 0; i < batch->count; i++) {
+        CPU65xx *cpu = batch->cpus[i];
+        cpu->run_end = cpu->cycles + (budgets[i] > 0 ? budgets[i] : 0);
+    }
+    while (batch_run_lowest(batch)) {
+    }
+    for (int i = 0; i < batch->count; i++) {
+        batch->cpus[i]->run_end = 0;
+    }
+}
+
+bool cpu_65xx_tick(CPU65xx *cpu) {
+    CPU65xxTickState *ts = &cpu->tick;
+    
+    // Interrupts are polled at the start of the last cycle, so the ones
+    // pending then get taken right after the instruction
+    bool is_pending = ts->poll;
+    ts->poll = cpu->nmi || (cpu->irq && !get_p_flag(cpu, P_I));
+    
+    bool is_done;
+    if (++ts->cycle == 1) {
+        is_done = tick_start(cpu, ts, is_pending);
+    } else if (ts->op) {
+        is_done = tick_instruction(cpu, ts);
+    } else {
+        is_done = tick_interrupt(cpu, ts, false, ts->nmi ? IVT_NMI : IVT_IRQ);
+    }
+    cpu->cycles++;
+    
+    if (is_done) {
+        if (cpu->profile && ts->op) {
+            profile_instruction(cpu, ts->pc, ts->opcode, ts->s, ts->cycle);
+        } else if (cpu->profile) {
+            profile_interrupt(cpu, ts->nmi ? PROFILE_NMI : PROFILE_IRQ, ts->s,
+                              ts->cycle);
+        }
+        ts->cycle = 0;
+    }
+    return is_done;
+}
+
+int cpu_65xx_reset(CPU65xx *cpu, bool verbose) {
+    if (verbose) {
+        printf("$%04x /RESET", cpu->pc);
+    }
+    return interrupt(cpu, true, IVT_RESET);
+}
+
+uint8_t cpu_65xx_get_p(CPU65xx *cpu) {
+    return get_p(cpu);
+}
+
+void cpu_65xx_set_p(CPU65xx *cpu, uint8_t value) {
+    set_p(cpu, value);
+}
+
+const Opcode *cpu_65xx_get_opcode(uint8_t opcode) {
+    return get_opcode(opcode);
+}
+
+void cpu_65xx_debug_print_state(CPU65xx *cpu) {
+    uint8_t p = get_p(cpu);
+    printf("PC=%04x A=%02x X=%02x Y=%02x P=%02x[",
+           cpu->pc, cpu->a, cpu->x, cpu->y, p);
+    for (int i = 0; i < 8; i++) {
+        printf("%c", (p & (1 << i) ? "czidb-vn"[i] : '.'));
+    }
+    printf("] S=%02x{", cpu->s);
+    for (int i = 0xff; i > cpu->s; i--) {
+        printf(" %02x", mem_read(cpu, 0x100 + i));
+    }
+    printf(" }\n");
+}
+
+int cpu_65xx_format_instruction(uint8_t opcode, const uint8_t *operands,
+                                char *str, int size) {
+    OpParam p1 = {.addr = operands[0] | (operands[1] << 8)};
+    return format_instruction(get_opcode(opcode), p1, str, size);
 }
@@ -2,6 +2,8 @@
 #define cpu_65xx_h
 
 #include "../common.h"
+#include "../profile.h"
+#include "../trace.h"
 
 // P flags
 typedef enum {
@@ -15,6 +17,9 @@ typedef enum {
     P_N = 1 << 7  // Negative value
 } PFlag;
 
+// Most CPUs a batch can step together (see cpu_65xx_batch_run)
+#define CPU65XX_BATCH_MAX_LANES 256
+
 // Interrupt Vector Table
 #define IVT_NMI   0xFFFA
 #define IVT_RESET 0xFFFC
@@ -23,9 +28,14 @@ typedef enum {
 // Forward declarations
 typedef struct CPU65xx CPU65xx;
 typedef struct Opcode Opcode;
+typedef struct CPU65xxBlockCache CPU65xxBlockCache;
+typedef struct CPU65xxBatch CPU65xxBatch;
 
 typedef uint8_t (*CPU65xxReadFuncPtr)(void *, uint16_t);
 typedef void (*CPU65xxWriteFuncPtr)(void *, uint16_t, uint8_t);
+// Returns a direct pointer to the read-only code at an address (or NULL if it
+// isn't ROM), and how many bytes are contiguous from there in size
+typedef const uint8_t *(*CPU65xxCodeFuncPtr)(void *, uint16_t, int *size);
 
 typedef enum {
     AM_IMPLIED,
@@ -38,6 +48,16 @@ typedef enum {
     AM_RELATIVE
 } AddressingMode;
 
+// Registers an opcode works on
+typedef enum {
+    REG_NONE = 0,
+    REG_A,
+    REG_X,
+    REG_Y,
+    REG_S,
+    REG_P,
+} Register;
+
 typedef union {
     uint16_t addr;
     uint8_t immediate_value;
@@ -48,13 +68,50 @@ typedef int (*OpcodeFunc)(CPU65xx *, const Opcode *, OpParam);
 
 struct Opcode {
     const char *name;
-    uint8_t *reg1;
-    uint8_t *reg2;
+    Register reg1;
+    Register reg2;
     int cycles;
     OpcodeFunc func;
     AddressingMode am;
 };
 
+// Code translated to C ahead of time by f-recompile, for one bank of ROM
+// mapped at one address. Returns whether it ran anything, which it doesn't
+// when PC wasn't discovered as code.
+typedef bool (*CPU65xxRecompiledFunc)(CPU65xx *);
+
+typedef struct {
+    uint32_t offset; // Of the bank in ROM
+    uint16_t addr;   // Where the bank is mapped
+    CPU65xxRecompiledFunc func;
+} CPU65xxRecompiledBank;
+
+typedef struct {
+    uint32_t crc;       // Of the ROM it was generated from
+    uint32_t rom_size;
+    uint32_t bank_size; // Must be a power of 2
+    int count;
+    const CPU65xxRecompiledBank *banks; // Sorted by offset, then address
+} CPU65xxRecompiled;
+
+// Progress of the cycle-stepped engine through the current instruction
+typedef struct {
+    const Opcode *op; // NULL for an interrupt sequence
+    int kind;
+    int cycle;        // Last cycle run, 0 between instructions
+    int access;       // Cycles run since the effective address was ready
+    bool is_ready;    // Whether the effective address is ready
+    bool poll;        // Interrupt pending at the start of the last cycle
+    bool nmi;
+    uint8_t opcode;
+    uint16_t pc;      // PC and S from before the instruction
+    uint8_t s;
+    uint16_t addr;    // Effective address, built over several cycles
+    uint8_t ptr;      // Zero page pointer of the indirect modes
+    uint8_t value;    // Operand read from memory
+    bool carry;       // Whether indexing crossed a page
+} CPU65xxTickState;
+
 struct CPU65xx {
     // General purpose registers
     uint8_t a;
@@ -62,8 +119,11 @@ struct CPU65xx {
     uint8_t y;
     // Stack register
     uint8_t s;
-    // Processor status register
+    // Processor status register, except for N and Z which are derived from
+    // the last result they apply to (use cpu_65xx_get_p/set_p for the value)
     uint8_t p;
+    uint8_t n_result;
+    uint8_t z_result;
     // Program counter
     uint16_t pc;
     // Memory I/O
@@ -73,16 +133,72 @@ struct CPU65xx {
     // Interrupt lines
     bool nmi;
     int irq;
-    // Opcode lookup table
-    Opcode opcodes[0x100];
+    // Cycles run since power on, and where the current cpu_65xx_run stops
+    uint64_t cycles;
+    uint64_t run_end;
+    // Decoded block cache (optional)
+    CPU65xxCodeFuncPtr code_func;
+    const unsigned *code_gen;
+    uint8_t *bus_latch;
+    CPU65xxBlockCache *blocks;
+    // Plain RAM, mirrored every ram_mask + 1 bytes from 0 to ram_end (optional)
+    uint8_t *ram;
+    uint16_t ram_mask;
+    uint16_t ram_end;
+    // Recompiled code, for the ROM at rom that code_func points into
+    // (optional)
+    const CPU65xxRecompiled *recompiled;
+    const uint8_t *rom;
+    // Instruction trace and profile (optional)
+    Trace *trace;
+    Profile *profile;
+    // Cycle-stepped engine (see cpu_65xx_tick)
+    CPU65xxTickState tick;
 };
 
 void cpu_65xx_init(CPU65xx *cpu, void *mm, CPU65xxReadFuncPtr read_func,
                                            CPU65xxWriteFuncPtr write_func);
+void cpu_65xx_set_code_map(CPU65xx *cpu, CPU65xxCodeFuncPtr code_func,
+                           const unsigned *code_gen, uint8_t *bus_latch);
+void cpu_65xx_set_direct_ram(CPU65xx *cpu, uint8_t *ram, uint16_t mask,
+                             uint16_t end);
+// Needs the code map to be set
+void cpu_65xx_set_recompiled(CPU65xx *cpu, const CPU65xxRecompiled *code,
+                             const uint8_t *rom);
+void cpu_65xx_set_trace(CPU65xx *cpu, Trace *trace);
+void cpu_65xx_set_profile(CPU65xx *cpu, Profile *profile);
+void cpu_65xx_teardown(CPU65xx *cpu);
 
 int cpu_65xx_step(CPU65xx *cpu, bool verbose);
+// Runs instructions until budget cycles have passed, and returns how many
+// actually did. The interrupt lines must not change by themselves within the
+// budget, except from I/O after which cpu_65xx_stop ends the run early.
+int cpu_65xx_run(CPU65xx *cpu, int budget);
+void cpu_65xx_stop(CPU65xx *cpu);
+// Batches of CPUs running the same ROM, which must come from the same data
+// (code_func returns the same pointer when they map the same bank). Each one
+// needs a code map and direct RAM to step with the others. Returns NULL when
+// there are too many.
+CPU65xxBatch *cpu_65xx_batch_create(CPU65xx *const *cpus, int count);
+void cpu_65xx_batch_free(CPU65xxBatch *batch);
+// Same as cpu_65xx_run on each CPU with its own budget, except that the ones
+// at the same PC step together
+void cpu_65xx_batch_run(CPU65xxBatch *batch, const int *budgets);
+// Cycle-stepped engine: runs a single cycle, with its bus access, and returns
+// whether it ended an instruction (or interrupt sequence). The interrupt
+// lines may change at any time, they are polled at the start of the last
+// cycle of each instruction. Only switch engines between instructions.
+bool cpu_65xx_tick(CPU65xx *cpu);
 int cpu_65xx_reset(CPU65xx *cpu, bool verbose);
 
+uint8_t cpu_65xx_get_p(CPU65xx *cpu);
+void cpu_65xx_set_p(CPU65xx *cpu, uint8_t value);
+
+// Never NULL, illegal opcodes all share a single KIL entry
+const Opcode *cpu_65xx_get_opcode(uint8_t opcode);
+
 void cpu_65xx_debug_print_state(CPU65xx *cpu);
+int cpu_65xx_format_instruction(uint8_t opcode, const uint8_t *operands,
+                                char *str, int size);
 
 #endif /* cpu_65xx_h */
@@ -0,0 +1,128 @@
+#ifndef cpu_65xx_recompiled_h
+#define cpu_65xx_recompiled_h
+
+#include "65xx.h"
+
+// Support code for the C generated by f-recompile, which does exactly what
+// the interpreter does for the same instructions (flags, bus and cycles)
+
+// Returns to the caller at an instruction boundary
+#define RC_EXIT(next_pc) \
+    do { \
+        cpu->pc = (next_pc); \
+        return true; \
+    } while (0)
+
+// Stops before the instruction at pc if the run is over, I/O ends it early
+#define RC_CHECK(pc) \
+    if (cpu->cycles >= cpu->run_end) { \
+        RC_EXIT(pc); \
+    }
+
+// MEMORY I/O //
+
+static inline uint8_t rc_read(CPU65xx *cpu, uint16_t addr) {
+    if (addr < cpu->ram_end) {
+        return *cpu->bus_latch = cpu->ram[addr & cpu->ram_mask];
+    }
+    return (*cpu->read_func)(cpu->mm, addr);
+}
+
+static inline void rc_write(CPU65xx *cpu, uint16_t addr, uint8_t value) {
+    if (addr < cpu->ram_end) {
+        cpu->ram[addr & cpu->ram_mask] = value;
+    } else {
+        (*cpu->write_func)(cpu->mm, addr, value);
+    }
+}
+
+// No wrapping within the page, same as the interpreter
+static inline uint16_t rc_read_word(CPU65xx *cpu, uint16_t addr) {
+    uint16_t lower = rc_read(cpu, addr);
+    return lower + (rc_read(cpu, addr + 1) << 8);
+}
+
+static inline void rc_push(CPU65xx *cpu, uint8_t value) {
+    rc_write(cpu, 0x100 + cpu->s--, value);
+}
+
+static inline uint8_t rc_pull(CPU65xx *cpu) {
+    return rc_read(cpu, 0x100 + ++cpu->s);
+}
+
+// P.STATUS REGISTER //
+
+static inline void rc_set_flag(CPU65xx *cpu, PFlag flag, bool value) {
+    cpu->p = (value ? cpu->p | flag : cpu->p & ~flag);
+}
+
+static inline void rc_nz(CPU65xx *cpu, uint8_t value) {
+    cpu->n_result = cpu->z_result = value;
+}
+
+static inline uint8_t rc_get_p(CPU65xx *cpu) {
+    return cpu->p | (cpu->n_result & P_N) | (cpu->z_result ? 0 : P_Z);
+}
+
+static inline void rc_set_p(CPU65xx *cpu, uint8_t value) {
+    cpu->p = value & ~(P_N | P_Z);
+    cpu->n_result = value & P_N;
+    cpu->z_result = !(value & P_Z);
+}
+
+// OPCODES //
+
+static inline void rc_adc(CPU65xx *cpu, uint8_t value) {
+    uint8_t carry = cpu->p & P_C;
+    rc_set_flag(cpu, P_C, cpu->a + carry + value >= 0x100);
+    uint8_t result = cpu->a + carry + value;
+    rc_set_flag(cpu, P_V, (result & P_N) != (cpu->a & P_N));
+    rc_nz(cpu, cpu->a = result);
+}
+
+static inline void rc_sbc(CPU65xx *cpu, uint8_t value) {
+    uint8_t carry = cpu->p & P_C;
+    rc_set_flag(cpu, P_C, cpu->a + carry - 1 - value >= 0);
+    uint8_t result = cpu->a + carry - 1 - value;
+    rc_set_flag(cpu, P_V, (result & P_N) != (cpu->a & P_N));
+    rc_nz(cpu, cpu->a = result);
+}
+
+static inline void rc_cmp(CPU65xx *cpu, uint8_t reg, uint8_t value) {
+    rc_set_flag(cpu, P_C, reg >= value);
+    rc_nz(cpu, reg - value);
+}
+
+static inline void rc_bit(CPU65xx *cpu, uint8_t value) {
+    cpu->z_result = (cpu->a & value) != 0;
+    cpu->n_result = value & P_N;
+    rc_set_flag(cpu, P_V, value & P_V);
+}
+
+static inline uint8_t rc_asl(CPU65xx *cpu, uint8_t value) {
+    rc_set_flag(cpu, P_C, value & 0x80);
+    rc_nz(cpu, value <<= 1);
+    return value;
+}
+
+static inline uint8_t rc_rol(CPU65xx *cpu, uint8_t value) {
+    uint8_t carry = cpu->p & P_C;
+    rc_set_flag(cpu, P_C, value & 0x80);
+    rc_nz(cpu, value = (value << 1) | carry);
+    return value;
+}
+
+static inline uint8_t rc_lsr(CPU65xx *cpu, uint8_t value) {
+    rc_set_flag(cpu, P_C, value & 1);
+    rc_nz(cpu, value >>= 1);
+    return value;
+}
+
+static inline uint8_t rc_ror(CPU65xx *cpu, uint8_t value) {
+    uint8_t carry = (cpu->p & P_C) << 7;
+    rc_set_flag(cpu, P_C, value & 1);
+    rc_nz(cpu, value = (value >> 1) | carry);
+    return value;
+}
+
+#endif /* cpu_65xx_recompiled_h */
@@ -0,0 +1,301 @@
+#include "common.h"
+#include <inttypes.h>
+#include <time.h>
+
+#include "cpu/65xx.h"
+
+// Runs synthetic programs on the 65xx core alone, against flat memory, to
+// measure its throughput without the rest of the machine
+
+#define DEFAULT_MCYCLES 50
+#define SIZE_DIRECT_RAM 0x800
+#define BATCH_LANES 16
+
+typedef struct {
+    const char *name;
+    const uint8_t *code;
+    int size;
+} Program;
+
+// All programs start at $8000 and loop forever
+static const uint8_t addressing_code[] = {
+    0xA2, 0x03,             // $8000 LDX #$03
+    0xA0, 0x05,             // $8002 LDY #$05
+    0xA9, 0x12,             // $8004 LDA #$12
+    0xA5, 0x20,             // $8006 LDA $20
+    0xB5, 0x20,             // $8008 LDA $20,X
+    0xAD, 0x00, 0x03,       // $800a LDA $0300
+    0xBD, 0x00, 0x03,       // $800d LDA $0300,X
+    0xB9, 0xFE, 0x03,       // $8010 LDA $03fe,Y (crosses a page)
+    0xA1, 0x10,             // $8013 LDA ($10,X)
+    0xB1, 0x10,             // $8015 LDA ($10),Y
+    0x85, 0x21,             // $8017 STA $21
+    0x95, 0x21,             // $8019 STA $21,X
+    0x8D, 0x01, 0x03,       // $801b STA $0301
+    0x9D, 0x01, 0x03,       // $801e STA $0301,X
+    0x99, 0x01, 0x03,       // $8021 STA $0301,Y
+    0x81, 0x10,             // $8024 STA ($10,X)
+    0x91, 0x10,             // $8026 STA ($10),Y
+    0x4C, 0x04, 0x80,       // $8028 JMP $8004
+};
+
+static const uint8_t alu_code[] = {
+    0x18,                   // $8000 CLC
+    0x69, 0x03,             // $8001 ADC #$03
+    0xE9, 0x01,             // $8003 SBC #$01
+    0x29, 0xF7,             // $8005 AND #$f7
+    0x09, 0x11,             // $8007 ORA #$11
+    0x49, 0x5A,             // $8009 EOR #$5a
+    0x0A,                   // $800b ASL
+    0x2A,                   // $800c ROL
+    0x4A,                   // $800d LSR
+    0x6A,                   // $800e ROR
+    0xC9, 0x40,             // $800f CMP #$40
+    0xE8,                   // $8011 INX
+    0x88,                   // $8012 DEY
+    0xAA,                   // $8013 TAX
+    0x98,                   // $8014 TYA
+    0x65, 0x20,             // $8015 ADC $20
+    0xC5, 0x21,             // $8017 CMP $21
+    0x4C, 0x01, 0x80,       // $8019 JMP $8001
+};
+
+static const uint8_t branch_code[] = {
+    0xA2, 0x00,             // $8000 LDX #$00
+    0xA0, 0x08,             // $8002 LDY #$08
+    0x88,                   // $8004 DEY
+    0xD0, 0xFD,             // $8005 BNE $8004
+    0xE8,                   // $8007 INX
+    0xE0, 0x10,             // $8008 CPX #$10
+    0x90, 0xF6,             // $800a BCC $8002
+    0xF0, 0x00,             // $800c BEQ $800e
+    0x30, 0x00,             // $800e BMI $8010
+    0x4C, 0x00, 0x80,       // $8010 JMP $8000
+};
+
+static const uint8_t stack_code[] = {
+    0xA9, 0x00,             // $8000 LDA #$00
+    0x48,                   // $8002 PHA
+    0x08,                   // $8003 PHP
+    0x68,                   // $8004 PLA
+    0x28,                   // $8005 PLP
+    0x20, 0x10, 0x80,       // $8006 JSR $8010
+    0x48,                   // $8009 PHA
+    0x68,                   // $800a PLA
+    0x4C, 0x02, 0x80,       // $800b JMP $8002
+    0xEA,                   // $800e NOP
+    0xEA,                   // $800f NOP
+    0x20, 0x14, 0x80,       // $8010 JSR $8014
+    0x60,                   // $8013 RTS
+    0x48,                   // $8014 PHA
+    0x68,                   // $8015 PLA
+    0x60,                   // $8016 RTS
+};
+
+// Everything here is outside of the direct RAM, like I/O registers
+static const uint8_t memory_code[] = {
+    0xA2, 0x00,             // $8000 LDX #$00
+    0xEE, 0x00, 0x60,       // $8002 INC $6000
+    0xCE, 0x01, 0x60,       // $8005 DEC $6001
+    0x0E, 0x02, 0x60,       // $8008 ASL $6002
+    0x7E, 0x00, 0x60,       // $800b ROR $6000,X
+    0xAD, 0x03, 0x60,       // $800e LDA $6003
+    0x8D, 0x04, 0x60,       // $8011 STA $6004
+    0xBD, 0x05, 0x60,       // $8014 LDA $6005,X
+    0x9D, 0x06, 0x60,       // $8017 STA $6006,X
+    0xE8,                   // $801a INX
+    0x4C, 0x02, 0x80,       // $801b JMP $8002
+};
+
+#define PROGRAM(name) {#name, name##_code, sizeof(name##_code)}
+static const Program programs[] = {
+    PROGRAM(addressing),
+    PROGRAM(alu),
+    PROGRAM(branch),
+    PROGRAM(stack),
+    PROGRAM(memory),
+};
+#undef PROGRAM
+
+// FLAT MEMORY //
+
+typedef struct {
+    uint8_t data[0x10000];
+    const uint8_t *rom; // Code, shared by all the lanes of a batch
+    uint64_t handler_calls;
+    unsigned generation;
+    uint8_t bus;
+} FlatMemory;
+
+static uint8_t read_flat(FlatMemory *mem, uint16_t addr) {
+    mem->handler_calls++;
+    return mem->data[addr];
+}
+
+static void write_flat(FlatMemory *mem, uint16_t addr, uint8_t value) {
+    mem->handler_calls++;
+    if (addr < 0x8000) {
+        mem->data[addr] = value;
+    }
+}
+
+static const uint8_t *get_code(FlatMemory *mem, uint16_t addr, int *size) {
+    if (addr < 0x8000) {
+        return NULL;
+    }
+    *size = 0x10000 - addr;
+    return mem->rom + addr;
+}
+
+static void load_program(FlatMemory *mem, const Program *program) {
+    memset(mem, 0, sizeof(FlatMemory));
+    memcpy(mem->data + 0x8000, program->code, program->size);
+    mem->rom = mem->data;
+    mem->data[0xFFFC] = 0x00;
+    mem->data[0xFFFD] = 0x80;
+    
+    // Pointers for the indirect addressing modes
+    mem->data[0x10] = 0x00;
+    mem->data[0x11] = 0x03;
+    mem->data[0x13] = 0x10;
+    mem->data[0x14] = 0x03;
+    mem->data[0x20] = 0x42;
+    mem->data[0x21] = 0x24;
+}
+
+// BENCHMARKS //
+
+typedef enum {
+    MODE_STEP,  // cpu_65xx_step, every access goes through the handlers
+    MODE_RUN,   // cpu_65xx_run, with the block cache and direct RAM
+    MODE_BATCH, // cpu_65xx_batch_run, on lanes that only differ in data
+} BenchMode;
+
+static const char *const mode_names[] = {"step", "run", "batch"};
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t handler_calls;
+    double seconds;
+} BenchResult;
+
+static double get_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static BenchResult run_bench(FlatMemory *mems, const Program *program,
+                             BenchMode mode, uint64_t cycles) {
+    int lanes = (mode == MODE_BATCH ? BATCH_LANES : 1);
+    CPU65xx cpus[BATCH_LANES];
+    CPU65xx *lane_cpus[BATCH_LANES];
+    int budgets[BATCH_LANES];
+    for (int i = 0; i < lanes; i++) {
+        FlatMemory *mem = &mems[i];
+        load_program(mem, program);
+        mem->rom = mems[0].data;
+        mem->data[0x20] += i;
+        CPU65xx *cpu = lane_cpus[i] = &cpus[i];
+        cpu_65xx_init(cpu, mem, (CPU65xxReadFuncPtr)read_flat,
+                                (CPU65xxWriteFuncPtr)write_flat);
+        if (mode != MODE_STEP) {
+            cpu_65xx_set_code_map(cpu, (CPU65xxCodeFuncPtr)get_code,
+                                  &mem->generation, &mem->bus);
+            cpu_65xx_set_direct_ram(cpu, mem->data, SIZE_DIRECT_RAM - 1,
+                                    SIZE_DIRECT_RAM);
+        }
+        cpu_65xx_reset(cpu, false);
+        mem->handler_calls = 0;
+        budgets[i] = 10000;
+    }
+    CPU65xxBatch *batch = (mode == MODE_BATCH ?
+                           cpu_65xx_batch_create(lane_cpus, lanes) : NULL);
+    
+    BenchResult result = {0};
+    uint64_t start = cpus[0].cycles;
+    double t = get_seconds();
+    if (mode == MODE_STEP) {
+        while (cpus[0].cycles - start < cycles) {
+            cpu_65xx_step(&cpus[0], false);
+            result.instructions++;
+        }
+    } else if (mode == MODE_RUN) {
+        // Same slices as a frame split in a few runs
+        while (cpus[0].cycles - start < cycles) {
+            cpu_65xx_run(&cpus[0], 10000);
+        }
+    } else {
+        // Every lane gets the same number of cycles as a single run
+        while (cpus[0].cycles - start < cycles) {
+            cpu_65xx_batch_run(batch, budgets);
+        }
+        cpu_65xx_batch_free(batch);
+    }
+    result.seconds = get_seconds() - t;
+    for (int i = 0; i < lanes; i++) {
+        result.cycles += cpus[i].cycles - start;
+        result.handler_calls += mems[i].handler_calls;
+        cpu_65xx_teardown(&cpus[i]);
+    }
+    return result;
+}
+
+static void print_result(const char *name, const char *mode,
+                         const BenchResult *r) {
+    printf("%-12s %-5s %9.2f %9.2f %10.3f\n", name, mode,
+           r->cycles / r->seconds * 1e-6,
+           r->seconds * 1e9 / r->instructions,
+           (double)r->handler_calls / r->instructions);
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t mcycles = argc > 1 ? strtoull(argv[1], NULL, 10) : 0;
+    if (argc > 2 || (argc > 1 && !mcycles)) {
+        eprintf("Usage: %s [millions of cycles per benchmark]\n", argv[0]);
+        return 1;
+    }
+    uint64_t cycles = (mcycles ? mcycles : DEFAULT_MCYCLES) * 1000000;
+
+#ifdef JIT
+    const char *engine = "with JIT";
+#else
+    const char *engine = "interpreter only";
+#endif
+    printf("%" PRIu64 "M cycles per benchmark, %s\n\n", cycles / 1000000,
+           engine);
+    printf("%-12s %-5s %9s %9s %10s\n", "program", "mode", "MHz", "ns/inst",
+           "calls/inst");
+    
+    FlatMemory *mems = malloc(BATCH_LANES * sizeof(FlatMemory));
+    BenchResult totals[3] = {{0}};
+    for (int i = 0; i < sizeof(programs) / sizeof(Program); i++) {
+        BenchResult results[3];
+        for (int m = 0; m < 3; m++) {
+            results[m] = run_bench(mems, &programs[i], m, cycles);
+        }
+        
+        // All of them run the same instructions, so the mix from stepping
+        // applies
+        for (int m = 0; m < 3; m++) {
+            if (m != MODE_STEP) {
+                results[m].instructions = (uint64_t)(
+                    (double)results[m].cycles * results[0].instructions /
+                    results[0].cycles);
+            }
+            print_result(programs[i].name, mode_names[m], &results[m]);
+            totals[m].cycles += results[m].cycles;
+            totals[m].instructions += results[m].instructions;
+            totals[m].handler_calls += results[m].handler_calls;
+            totals[m].seconds += results[m].seconds;
+        }
+    }
+    printf("\n");
+    for (int m = 0; m < 3; m++) {
+        print_result("total", mode_names[m], &totals[m]);
+    }
+    
+    free(mems);
+    return 0;
+}
@@ -0,0 +1,204 @@
+#include "common.h"
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "driver.h"
+#include "f/loader.h"
+#include "f/machine.h"
+
+// Runs a ROM on both CPU engines side by side, one frame at a time, and
+// reports the first divergence of the cycle-stepped engine from the fast one.
+// Games that never diverge don't need CYCLE_ACCURATE=1.
+//
+// The engines don't poll interrupts nor access I/O on the same cycles, so the
+// CPUs may be a few cycles apart when a frame ends (ie. the fast one took the
+// NMI an instruction earlier). Only what the game shows is compared right
+// away; the registers and WRAM have to be the same again within SKEW_FRAMES.
+
+#define DEFAULT_FRAMES 600
+#define HISTORY_LENGTH 16
+#define SKEW_FRAMES 30
+
+static const char *const engine_names[] = {"fast", "cycle"};
+
+static bool load_rom(const char *path, blob *rom) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        eprintf("%s: Error opening file\n", path);
+        return false;
+    }
+    fseeko(file, 0, SEEK_END);
+    rom->size = ftello(file);
+    fseeko(file, 0, SEEK_SET);
+    rom->data = malloc(rom->size);
+    bool is_read = (rom->size > HEADER_SIZE &&
+                    fread(rom->data, rom->size, 1, file) == 1);
+    fclose(file);
+    if (!is_read || strncmp((const char *)rom->data, "NES\x1a", 4)) {
+        eprintf("%s: Not an iNES file\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Returns the first pixel that differs on the screens of the frame, or -1
+static int compare_screens(Machine *vms[2], int frame) {
+    const uint16_t *a = vms[0]->ppu.screens[frame & 1];
+    const uint16_t *b = vms[1]->ppu.screens[frame & 1];
+    for (int i = 0; i < WIDTH * HEIGHT_CROPPED; i++) {
+        if (a[i] != b[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Returns the first address where the WRAM differs, SIZE_WRAM when only the
+// registers do, or -1 when the CPUs are in step
+static int compare_cpus(Machine *vms[2]) {
+    for (int i = 0; i < SIZE_WRAM; i++) {
+        if (vms[0]->wram[i] != vms[1]->wram[i]) {
+            return i;
+        }
+    }
+    CPU65xx *a = &vms[0]->cpu, *b = &vms[1]->cpu;
+    if (a->pc != b->pc || a->a != b->a || a->x != b->x || a->y != b->y ||
+        a->s != b->s || cpu_65xx_get_p(a) != cpu_65xx_get_p(b)) {
+        return SIZE_WRAM;
+    }
+    return -1;
+}
+
+static void print_history(Machine *vm, const DebugMap *dbg_map) {
+    int length = trace_get_length(vm->trace);
+    int start = length > HISTORY_LENGTH ? length - HISTORY_LENGTH : 0;
+    for (int i = start; i < length; i++) {
+        const TraceEntry *entry = trace_get_entry(vm->trace, i);
+        const char *label = dbg_map ? debug_map_get_label(dbg_map, entry->pc)
+                                    : NULL;
+        if (label) {
+            printf(":%s\n", label);
+        }
+        char str[32];
+        if (entry->type == TRACE_INSTRUCTION) {
+            cpu_65xx_format_instruction(entry->opcode, entry->operands, str,
+                                        sizeof(str));
+        } else {
+            snprintf(str, sizeof(str), "/%s",
+                     entry->type == TRACE_NMI ? "NMI" : "IRQ");
+        }
+        printf("$%04x %-16sA:%02x X:%02x Y:%02x P:%02x S:%02x CYC:%" PRIu64
+               "\n", entry->pc, str, entry->a, entry->x, entry->y, entry->p,
+               entry->s, entry->cycle);
+    }
+}
+
+static void print_divergence(Machine *vms[2], int frame, int pixel,
+                             int wram_addr, const DebugMap *dbg_map) {
+    printf("Diverged in frame %d\n", frame);
+    if (pixel >= 0) {
+        const uint16_t *a = vms[0]->ppu.screens[frame & 1];
+        const uint16_t *b = vms[1]->ppu.screens[frame & 1];
+        int total = 0, last = pixel;
+        for (int i = pixel; i < WIDTH * HEIGHT_CROPPED; i++) {
+            if (a[i] != b[i]) {
+                total++;
+                last = i;
+            }
+        }
+        printf("Screen at %d,%d: %03x (fast), %03x (cycle)\n", pixel % WIDTH,
+               pixel / WIDTH + HEIGHT_CROPPED_BEGIN, a[pixel], b[pixel]);
+        printf("%d pixel%s differ, on scanlines %d to %d\n", total,
+               (total > 1 ? "s" : ""), pixel / WIDTH + HEIGHT_CROPPED_BEGIN,
+               last / WIDTH + HEIGHT_CROPPED_BEGIN);
+    } else if (wram_addr < SIZE_WRAM) {
+        printf("WRAM at $%04x: %02x (fast), %02x (cycle), for %d frames\n",
+               wram_addr, vms[0]->wram[wram_addr], vms[1]->wram[wram_addr],
+               SKEW_FRAMES);
+    } else {
+        printf("CPUs out of step for %d frames\n", SKEW_FRAMES);
+    }
+    for (int i = 0; i < 2; i++) {
+        CPU65xx *cpu = &vms[i]->cpu;
+        printf("\nLast instructions on the %s engine:\n", engine_names[i]);
+        print_history(vms[i], dbg_map);
+        printf("$%04x %-16sA:%02x X:%02x Y:%02x P:%02x S:%02x CYC:%" PRIu64
+               "\n", cpu->pc, "(next)", cpu->a, cpu->x, cpu->y,
+               cpu_65xx_get_p(cpu), cpu->s, cpu->cycles);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int frames = DEFAULT_FRAMES;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:")) != -1) {
+        if (opt == 'f' && atoi(optarg) > 0) {
+            frames = atoi(optarg);
+        } else {
+            argc = 0;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2) {
+        eprintf("Usage: %s [-f frames] rom_file [debug.map]\n", argv[0]);
+        eprintf("  -f  How many frames to compare (default: %d)\n",
+                DEFAULT_FRAMES);
+        return 1;
+    }
+    
+    blob rom;
+    if (!load_rom(argv[optind], &rom)) {
+        return 1;
+    }
+    DebugMap *dbg_map = NULL;
+    if (argc - optind > 1) {
+        dbg_map = debug_map_load(argv[optind + 1]);
+        if (!dbg_map) {
+            return 1;
+        }
+    }
+    
+    // Both machines share the ROM, and get the same (lack of) input
+    Driver *drivers = calloc(2, sizeof(Driver));
+    Machine *vms[2];
+    for (int i = 0; i < 2; i++) {
+        drivers[i].input.lightgun_pos = -1;
+        drivers[i].dbg_map = dbg_map;
+        if (ines_loader(&drivers[i], &rom)) {
+            return 1;
+        }
+        vms[i] = drivers[i].vm;
+        vms[i]->is_cycle_accurate = i;
+        if (!vms[i]->trace) {
+            machine_start_trace(vms[i], NULL, -1);
+        }
+    }
+    
+    int result = 0;
+    int skewed_frames = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        machine_advance_frame(vms[0], frame, false);
+        machine_advance_frame(vms[1], frame, false);
+        
+        int pixel = compare_screens(vms, frame);
+        int wram_addr = compare_cpus(vms);
+        skewed_frames = (wram_addr >= 0 ? skewed_frames + 1 : 0);
+        if (pixel >= 0 || skewed_frames >= SKEW_FRAMES) {
+            print_divergence(vms, frame, pixel, wram_addr, dbg_map);
+            result = 2;
+            break;
+        }
+    }
+    if (!result) {
+        printf("No divergence in %d frames\n", frames);
+    }
+    
+    for (int i = 0; i < 2; i++) {
+        (*drivers[i].teardown_func)(&drivers[i]);
+    }
+    free(drivers);
+    if (dbg_map) {
+        debug_map_free(dbg_map);
+    }
+    free(rom.data);
+    return result;
+}
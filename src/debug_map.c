@@ -0,0 +1,104 @@
+#include "debug_map.h"
+
+#include <ctype.h>
+
+static char *read_text(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        eprintf("%s: Error opening file\n", path);
+        return NULL;
+    }
+    char *text = NULL;
+    long size;
+    if (fseek(file, 0, SEEK_END) || (size = ftell(file)) < 0 ||
+        fseek(file, 0, SEEK_SET)) {
+        eprintf("%s: Error determining file size\n", path);
+    } else {
+        text = malloc(size + 1);
+        if (fread(text, 1, size, file) < size) {
+            eprintf("%s: Error reading file\n", path);
+            free(text);
+            text = NULL;
+        } else {
+            text[size] = 0;
+        }
+    }
+    fclose(file);
+    return text;
+}
+
+static char *skip_space(char *c) {
+    while (*c && isspace((unsigned char)*c)) {
+        c++;
+    }
+    return c;
+}
+
+static char *skip_word(char *c) {
+    while (*c && !isspace((unsigned char)*c)) {
+        c++;
+    }
+    return c;
+}
+
+// PUBLIC FUNCTIONS //
+
+DebugMap *debug_map_load(const char *path) {
+    char *text = read_text(path);
+    if (!text) {
+        return NULL;
+    }
+    
+    DebugMap *map = malloc(sizeof(DebugMap));
+    memset(map->is_labeled, 0, sizeof(map->is_labeled));
+    map->count = 0;
+    map->text = text;
+    
+    // Labels get terminated in place, so nothing is copied
+    char *c = text;
+    while (*(c = skip_space(c))) {
+        char *label = c;
+        c = skip_word(c);
+        char *label_end = c;
+        c = skip_space(c);
+        
+        char *addr_end = NULL;
+        long addr = -1;
+        if (*c == '@') {
+            c = skip_space(c + 1);
+            addr = strtol(c, &addr_end, 16);
+        }
+        if (!addr_end || addr_end == c || addr < 0 || addr > 0xFFFF) {
+            eprintf("%s: Unexpected text after \"%.*s\"\n", path,
+                    (int)(label_end - label), label);
+            debug_map_free(map);
+            return NULL;
+        }
+        c = addr_end;
+        *label_end = 0;
+        
+        // Keep the first label when there are more than one
+        if (!debug_map_is_labeled(map, addr)) {
+            BIT_SET(map->is_labeled[addr >> 3], addr & 7);
+            map->labels[addr] = label;
+            map->count++;
+        }
+    }
+    
+    return map;
+}
+
+int debug_map_find(const DebugMap *map, const char *label) {
+    for (int addr = 0; addr < 0x10000; addr++) {
+        if (debug_map_is_labeled(map, addr) &&
+            !strcmp(map->labels[addr], label)) {
+            return addr;
+        }
+    }
+    return -1;
+}
+
+void debug_map_free(DebugMap *map) {
+    free(map->text);
+    free(map);
+}
@@ -0,0 +1,32 @@
+#ifndef debug_map_h
+#define debug_map_h
+
+#include "common.h"
+
+// Labels loaded from a .map file ("Label @ ADDR" lines), indexed by address
+typedef struct DebugMap {
+    // One bit per address that has a label, so most lookups stop there
+    uint8_t is_labeled[0x10000 / 8];
+    const char *labels[0x10000];
+    int count;
+    
+    char *text; // The whole file, labels point into it
+} DebugMap;
+
+DebugMap *debug_map_load(const char *path);
+void debug_map_free(DebugMap *map);
+
+// Returns the address of a label, or -1 if not found
+int debug_map_find(const DebugMap *map, const char *label);
+
+static inline bool debug_map_is_labeled(const DebugMap *map, uint16_t addr) {
+    return BIT_CHECK(map->is_labeled[addr >> 3], addr & 7);
+}
+
+// Returns NULL if there is no label at that address
+static inline const char *debug_map_get_label(const DebugMap *map,
+                                              uint16_t addr) {
+    return debug_map_is_labeled(map, addr) ? map->labels[addr] : NULL;
+}
+
+#endif /* debug_map_h */
@@ -2,21 +2,26 @@
 #define driver_h
 
 #include "common.h"
+#include "debug_map.h"
 #include "input.h"
 
 #define MSG_NONE 0
 #define MSG_TERMINATE 1
+#define MSG_DUMP_TRACE 2
 
 typedef struct Driver Driver;
 
 typedef void (*AdvanceFrameFuncPtr)(void *, int, bool);
 typedef void (*TeardownFuncPtr)(Driver *);
+typedef void (*DumpTraceFuncPtr)(void *);
 
 typedef struct Driver {
     void *vm;
     InputState input;
+    const DebugMap *dbg_map;
     uint64_t refresh_rate;
-    uint32_t *screens[2];
+    uint16_t *screens[2]; // Indices into the palette
+    const uint32_t *palette; // ARGB8888
     int screen_w;
     int screen_h;
     int frame;
@@ -24,6 +29,7 @@ typedef struct Driver {
     int audio_pos;
     AdvanceFrameFuncPtr advance_frame_func;
     TeardownFuncPtr teardown_func;
+    DumpTraceFuncPtr dump_trace_func;
     int message;
 } Driver;
 
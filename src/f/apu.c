@@ -272,32 +272,50 @@ void apu_init(APU *apu, CPU65xx *cpu, int16_t *audio_buffer, int *audio_pos) {
     MemoryMap *mm = cpu->mm;
     
     // 4000-4007: Pulse channels
-    for (int i = 0; i < 8; i += 4) {
-        mm->write[0x4000 + i] = write_envelope_volume;
-        mm->write[0x4001 + i] = write_pulse_sweep;
-        mm->write[0x4002 + i] = write_timer_low;
-        mm->write[0x4003 + i] = write_length_counter_timer_high;
-    }
+    mm_map_range(mm, 0x4000, 0x4007, NULL, write_envelope_volume, 3);
+    mm_map_range(mm, 0x4001, 0x4007, NULL, write_pulse_sweep, 3);
+    mm_map_range(mm, 0x4002, 0x4007, NULL, write_timer_low, 3);
+    mm_map_range(mm, 0x4003, 0x4007, NULL, write_length_counter_timer_high, 3);
     // 4008-400B: Triangle channel
-    mm->write[0x4008] = write_triangle_linear_counter;
+    mm_map_range(mm, 0x4008, 0x4008, NULL, write_triangle_linear_counter, 0);
     //        0x4009 Unused
-    mm->write[0x400A] = write_timer_low;
-    mm->write[0x400B] = write_length_counter_timer_high;
+    mm_map_range(mm, 0x400A, 0x400A, NULL, write_timer_low, 0);
+    mm_map_range(mm, 0x400B, 0x400B, NULL, write_length_counter_timer_high, 0);
     // 400C-400F: Noise channel
-    mm->write[0x400C] = write_envelope_volume;
+    mm_map_range(mm, 0x400C, 0x400C, NULL, write_envelope_volume, 0);
     //        0x400D Unused
-    mm->write[0x400E] = write_noise_mode_period;
-    mm->write[0x400F] = write_length_counter_timer_high;
+    mm_map_range(mm, 0x400E, 0x400E, NULL, write_noise_mode_period, 0);
+    mm_map_range(mm, 0x400F, 0x400F, NULL, write_length_counter_timer_high, 0);
     // 4010-4013: DMC channel
-    mm->write[0x4010] = write_dmc_flags_rate;
-    mm->write[0x4011] = write_dmc_load;
-    mm->write[0x4012] = write_dmc_addr;
-    mm->write[0x4013] = write_dmc_length;
+    mm_map_range(mm, 0x4010, 0x4010, NULL, write_dmc_flags_rate, 0);
+    mm_map_range(mm, 0x4011, 0x4011, NULL, write_dmc_load, 0);
+    mm_map_range(mm, 0x4012, 0x4012, NULL, write_dmc_addr, 0);
+    mm_map_range(mm, 0x4013, 0x4013, NULL, write_dmc_length, 0);
     // 4015: Status and control
-    mm->read[0x4015] = read_status;
-    mm->write[0x4015] = write_control;
+    mm_map_range(mm, 0x4015, 0x4015, read_status, NULL, 0);
+    mm_map_range(mm, 0x4015, 0x4015, NULL, write_control, 0);
     // 4017: Frame control (write only, overlaps controller #2 on read)
-    mm->write[0x4017] = write_frame_counter;
+    mm_map_range(mm, 0x4017, 0x4017, NULL, write_frame_counter, 0);
+}
+
+// How many steps until an IRQ may be raised, or -1 if it can't
+int apu_next_irq(const APU *apu) {
+    int steps = -1;
+    if (!BIT_CHECK(apu->flags, AF_FC_DIVIDER) &&
+        !BIT_CHECK(apu->flags, AF_FC_IRQ_DISABLE)) {
+        steps = FC_CYCLES * 4 - apu->fc_timer;
+    }
+    if (apu->dmc_remain && BIT_CHECK(apu->flags, AF_DMC_IRQ_ENABLE) &&
+        !BIT_CHECK(apu->flags, AF_DMC_LOOP)) {
+        // The last byte is fetched 9 timer periods after the one before
+        int dmc_steps = apu->dmc_timer + 1 +
+                        (apu->dmc_bit + 9 * (apu->dmc_remain - 1)) *
+                        (apu->dmc_timer_load + 1);
+        if (steps < 0 || dmc_steps < steps) {
+            steps = dmc_steps;
+        }
+    }
+    return steps;
 }
 
 void apu_step(APU *apu) {
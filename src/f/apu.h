@@ -94,4 +94,6 @@ void apu_init(APU *apu, CPU65xx *cpu, int16_t *audio_buffer, int *audio_pos);
 void apu_step(APU *apu);
 void apu_sample(APU *apu);
 
+int apu_next_irq(const APU *apu);
+
 #endif /* f_apu_h */
@@ -1,4 +1,7 @@
 #include "cartridge.h"
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #include "../cpu/65xx.h"
 #include "machine.h"
@@ -6,117 +9,149 @@
 
 // GENERIC MAPPER I/O //
 
-static uint8_t read_prg(Machine *vm, uint16_t addr) {
-    return vm->cart.prg_banks[(addr >> 13) & (PRG_BANKS - 1)]
-                             [addr & MASK_PRG_BANK];
-}
-
 static uint8_t read_chr(Machine *vm, uint16_t addr) {
     return vm->cart.chr_banks[(addr >> 10) & (CHR_BANKS - 1)]
                              [addr & MASK_CHR_BANK];
 }
-static void write_chr(Machine *vm, uint16_t addr, uint8_t value) {
-    vm->cart.chr_banks[(addr >> 10) & (CHR_BANKS - 1)]
-                      [addr & MASK_CHR_BANK] = value;
-}
 
-static uint8_t read_sram(Machine *vm, uint16_t addr) {
-    if (vm->cart.sram_enabled) {
-        return vm->cart.sram.data[(addr & MASK_SRAM) % vm->cart.sram.size];
-    }
-    return vm->cpu_mm.last_read;
-}
-static void write_sram(Machine *vm, uint16_t addr, uint8_t value) {
-    if (vm->cart.sram_enabled) {
-        vm->cart.sram.data[(addr & MASK_SRAM) % vm->cart.sram.size] = value;
+static void map_sram(Machine *vm) {
+    Cartridge *cart = &vm->cart;
+    uint8_t *data = (cart->sram_enabled ? cart->sram.data : NULL);
+    
+    // 6000-7FFF: SRAM (up to 8kB, repeated if less), or open bus if disabled
+    for (int i = 0; i < SIZE_SRAM; i += cart->sram.size) {
+        mm_map_memory(&vm->cpu_mm, 0x6000 + i, (int)cart->sram.size, data,
+                      data);
     }
 }
 
 // SHARED INITIALIZERS //
 
+// CHR RAM starts out zeroed on the (copy-on-write) zero page of the host, so
+// each machine only pays for the pages that it actually writes to
+static void free_chr_ram(blob *chr_ram) {
+#ifdef _WIN32
+    free(chr_ram->data);
+#else
+    munmap(chr_ram->data, chr_ram->size);
+#endif
+}
+
+// Replaces the CHR memory, which is left to the caller to free if it was RAM.
+// On failure it is left empty, and mapper_init() fails.
+static bool init_chr_ram(Cartridge *cart, size_t size) {
+    cart->chr_is_ram = true;
+#ifdef _WIN32
+    uint8_t *data = calloc(1, size);
+#else
+    uint8_t *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+        data = NULL;
+    }
+#endif
+    if (!data) {
+        eprintf("Error allocating %zukB of CHR RAM\n", size >> 10);
+        cart->chr_memory.data = NULL;
+        cart->chr_memory.size = 0;
+        return false;
+    }
+    cart->chr_memory.data = data;
+    cart->chr_memory.size = size;
+    return true;
+}
+
 static void init_sram(Machine *vm, int size) {
     vm->cart.sram.size = size;
     vm->cart.sram.data = malloc(size);
-    
-    // 6000-7FFF: SRAM (up to 8kB, repeated if less)
-    for (int i = 0; i < SIZE_SRAM; i++) {
-        vm->cpu_mm.read[0x6000 + i] = read_sram;
-        vm->cpu_mm.write[0x6000 + i] = write_sram;
-    }
+    map_sram(vm);
 }
 
 static void init_register_prg(Machine *vm, WriteFuncPtr register_func) {
-    for (int i = 0; i < SIZE_PRG_ROM; i++) {
-        vm->cpu_mm.write[0x8000 + i] = register_func;
-    }
+    mm_map_range(&vm->cpu_mm, 0x8000, 0xFFFF, NULL, register_func, 0);
 }
 
 static void init_register_sram(Machine *vm, WriteFuncPtr register_func) {
-    for (int i = 0; i < SIZE_SRAM; i++) {
-        vm->cpu_mm.write[0x6000 + i] = register_func;
-    }
+    mm_map_range(&vm->cpu_mm, 0x6000, 0x7FFF, NULL, register_func, 0);
 }
 
 // BANK SELECT //
 
-static void select_prg_full(Cartridge *cart, uint8_t pos) {
+// The banks are read straight from the pages of the memory maps
+static void set_prg_bank(Machine *vm, int bank, uint8_t *data) {
+    vm->cart.prg_banks[bank] = data;
+    mm_map_memory(&vm->cpu_mm, 0x8000 + bank * SIZE_PRG_BANK, SIZE_PRG_BANK,
+                  data, NULL);
+}
+
+static void set_chr_bank(Machine *vm, int bank, uint8_t *data) {
+    vm->cart.chr_banks[bank] = data;
+    mm_map_memory(&vm->ppu_mm, bank * SIZE_CHR_BANK, SIZE_CHR_BANK, data,
+                  (vm->cart.chr_is_ram ? data : NULL));
+}
+
+static void select_prg_full(Machine *vm, uint8_t pos) {
+    Cartridge *cart = &vm->cart;
     uint8_t *offset = cart->prg_rom.data + ((pos << 15) % cart->prg_rom.size);
-    cart->prg_banks[0] = offset;
-    cart->prg_banks[1] = offset + SIZE_PRG_BANK;
-    cart->prg_banks[2] = offset + SIZE_PRG_BANK * 2;
-    cart->prg_banks[3] = offset + SIZE_PRG_BANK * 3;
     for (int i = 0; i < 4; i++) {
-        cart->prg_banks[i] = offset;
+        set_prg_bank(vm, i, offset);
         offset += SIZE_PRG_BANK;
     }
+    machine_invalidate(vm, REGION_PRG);
 }
 
-static void select_prg_half(Cartridge *cart, int bank, uint8_t pos) {
+static void select_prg_half(Machine *vm, int bank, uint8_t pos) {
+    Cartridge *cart = &vm->cart;
     uint8_t *offset = cart->prg_rom.data + ((pos << 14) % cart->prg_rom.size);
     bank <<= 1;
-    cart->prg_banks[bank] = offset;
-    cart->prg_banks[bank + 1] = offset + SIZE_PRG_BANK;
+    set_prg_bank(vm, bank, offset);
+    set_prg_bank(vm, bank + 1, offset + SIZE_PRG_BANK);
+    machine_invalidate(vm, REGION_PRG);
 }
 
-static void select_prg_quarter(Cartridge *cart, int bank, uint8_t pos) {
-    cart->prg_banks[bank] = cart->prg_rom.data +
-                            ((pos << 13) % cart->prg_rom.size);
+static void select_prg_quarter(Machine *vm, int bank, uint8_t pos) {
+    Cartridge *cart = &vm->cart;
+    set_prg_bank(vm, bank, cart->prg_rom.data +
+                           ((pos << 13) % cart->prg_rom.size));
+    machine_invalidate(vm, REGION_PRG);
 }
 
-static void select_chr_full(Cartridge *cart, uint8_t pos) {
+static void select_chr_full(Machine *vm, uint8_t pos) {
+    Cartridge *cart = &vm->cart;
     uint8_t *offset = cart->chr_memory.data +
                       ((pos << 13) % cart->chr_memory.size);
-    cart->chr_banks[0] = offset;
-    cart->chr_banks[1] = offset + SIZE_CHR_BANK;
-    cart->chr_banks[2] = offset + SIZE_CHR_BANK * 2;
-    cart->chr_banks[3] = offset + SIZE_CHR_BANK * 3;
-    cart->chr_banks[4] = offset + SIZE_CHR_BANK * 4;
-    cart->chr_banks[5] = offset + SIZE_CHR_BANK * 5;
-    cart->chr_banks[6] = offset + SIZE_CHR_BANK * 6;
-    cart->chr_banks[7] = offset + SIZE_CHR_BANK * 7;
+    for (int i = 0; i < 8; i++) {
+        set_chr_bank(vm, i, offset + SIZE_CHR_BANK * i);
+    }
+    machine_invalidate(vm, REGION_CHR);
 }
 
-static void select_chr_half(Cartridge *cart, int bank, uint8_t pos) {
+static void select_chr_half(Machine *vm, int bank, uint8_t pos) {
+    Cartridge *cart = &vm->cart;
     uint8_t *offset = cart->chr_memory.data +
                       ((pos << 12) % cart->chr_memory.size);
     bank <<= 2;
-    cart->chr_banks[bank] = offset;
-    cart->chr_banks[bank + 1] = offset + SIZE_CHR_BANK;
-    cart->chr_banks[bank + 2] = offset + SIZE_CHR_BANK * 2;
-    cart->chr_banks[bank + 3] = offset + SIZE_CHR_BANK * 3;
+    for (int i = 0; i < 4; i++) {
+        set_chr_bank(vm, bank + i, offset + SIZE_CHR_BANK * i);
+    }
+    machine_invalidate(vm, REGION_CHR);
 }
 
-static void select_chr_quarter(Cartridge *cart, int bank, uint8_t pos) {
+static void select_chr_quarter(Machine *vm, int bank, uint8_t pos) {
+    Cartridge *cart = &vm->cart;
     uint8_t *offset = cart->chr_memory.data +
                       ((pos << 11) % cart->chr_memory.size);
     bank <<= 1;
-    cart->chr_banks[bank] = offset;
-    cart->chr_banks[bank + 1] = offset + SIZE_CHR_BANK;
+    set_chr_bank(vm, bank, offset);
+    set_chr_bank(vm, bank + 1, offset + SIZE_CHR_BANK);
+    machine_invalidate(vm, REGION_CHR);
 }
 
-static void select_chr_eighth(Cartridge *cart, int bank, uint8_t pos) {
-    cart->chr_banks[bank] = cart->chr_memory.data +
-                            ((pos << 10) % cart->chr_memory.size);
+static void select_chr_eighth(Machine *vm, int bank, uint8_t pos) {
+    Cartridge *cart = &vm->cart;
+    set_chr_bank(vm, bank, cart->chr_memory.data +
+                           ((pos << 10) % cart->chr_memory.size));
+    machine_invalidate(vm, REGION_CHR);
 }
 
 static int get_prg_last_half(Cartridge *cart, uint8_t pos) {
@@ -139,24 +174,26 @@ static void NROM_init(Machine *vm) {
 // MAPPER   1: Nintendo MMC1 (variable banking, A/B/H/V control) //
 //        155: Nintendo MMC1A (no SRAM protect toggle)           //
 
-static void MMC1_update_prg_banks(Cartridge *cart) {
+static void MMC1_update_prg_banks(Machine *vm) {
+    Cartridge *cart = &vm->cart;
     if (!BIT_CHECK(cart->mapper.mmc1.ctrl_flags, 3)) {
-        select_prg_full(cart, cart->mapper.mmc1.prg_bank >> 1);
+        select_prg_full(vm, cart->mapper.mmc1.prg_bank >> 1);
     } else if (!BIT_CHECK(cart->mapper.mmc1.ctrl_flags, 2)) {
-        select_prg_half(cart, 0, 0);
-        select_prg_half(cart, 1, cart->mapper.mmc1.prg_bank);
+        select_prg_half(vm, 0, 0);
+        select_prg_half(vm, 1, cart->mapper.mmc1.prg_bank);
     } else {
-        select_prg_half(cart, 0, cart->mapper.mmc1.prg_bank);
-        select_prg_half(cart, 1, get_prg_last_half(cart, 1));
+        select_prg_half(vm, 0, cart->mapper.mmc1.prg_bank);
+        select_prg_half(vm, 1, get_prg_last_half(cart, 1));
     }
 }
 
-static void MMC1_update_chr_banks(Cartridge *cart) {
+static void MMC1_update_chr_banks(Machine *vm) {
+    Cartridge *cart = &vm->cart;
     if (BIT_CHECK(cart->mapper.mmc1.ctrl_flags, 4)) {
-        select_chr_half(cart, 0, cart->mapper.mmc1.chr_banks[0]);
-        select_chr_half(cart, 1, cart->mapper.mmc1.chr_banks[1]);
+        select_chr_half(vm, 0, cart->mapper.mmc1.chr_banks[0]);
+        select_chr_half(vm, 1, cart->mapper.mmc1.chr_banks[1]);
     } else {
-        select_chr_full(cart, cart->mapper.mmc1.chr_banks[0] >> 1);
+        select_chr_full(vm, cart->mapper.mmc1.chr_banks[0] >> 1);
     }
 }
 
@@ -175,19 +212,20 @@ static void MMC1_write_register(Machine *vm, uint16_t addr, uint8_t value) {
         case 0: // 8000-9FFF: Control
             mmc1->ctrl_flags = mmc1->shift_reg;
             machine_set_nt_mirroring(vm, mmc1->ctrl_flags & 3);
-            MMC1_update_prg_banks(&vm->cart);
-            MMC1_update_chr_banks(&vm->cart);
+            MMC1_update_prg_banks(vm);
+            MMC1_update_chr_banks(vm);
             break;
         case 3: // E000-FFFF: PRG bank + SRAM write protect
             mmc1->prg_bank = mmc1->shift_reg & 0b1111;
             if (!mmc1->is_a) {
                 vm->cart.sram_enabled = !(mmc1->shift_reg & (1 << 4));
+                map_sram(vm);
             }
-            MMC1_update_prg_banks(&vm->cart);
+            MMC1_update_prg_banks(vm);
             break;
         default: // A000-DFFF: CHR banks 0, 1
             mmc1->chr_banks[(addr >> 14) & 1] = mmc1->shift_reg;
-            MMC1_update_chr_banks(&vm->cart);
+            MMC1_update_chr_banks(vm);
     }
     mmc1->shift_reg = mmc1->shift_pos = 0;
 }
@@ -198,7 +236,7 @@ static void MMC1_init(Machine *vm) {
     
     // Booting in 16b+16f PRG mode seems to be the most compatible
     cart->mapper.mmc1.ctrl_flags = 3 << 2;
-    MMC1_update_prg_banks(cart);
+    MMC1_update_prg_banks(vm);
     
     init_register_prg(vm, MMC1_write_register);
     init_sram(vm, SIZE_SRAM);
@@ -215,7 +253,7 @@ static void MMC1A_init(Machine *vm) {
 //        180: Nintendo UNROM with 74HC08 (16f+16b/8f)                  //
 
 static void UxROM_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_half(&vm->cart, vm->cart.mapper.uxrom.target_bank,
+    select_prg_half(vm, vm->cart.mapper.uxrom.target_bank,
                     value >> vm->cart.mapper.uxrom.bit_offset);
 }
 
@@ -223,7 +261,7 @@ static void UxROM_init(Machine *vm) {
     Cartridge *cart = &vm->cart;
     memset(&cart->mapper.uxrom, 0, sizeof(UxROMVariants));
     init_register_prg(vm, UxROM_write_register);
-    select_prg_half(cart, 1, get_prg_last_half(cart, 1));
+    select_prg_half(vm, 1, get_prg_last_half(cart, 1));
 }
 
 static void Sunsoft2R_init(Machine *vm) {
@@ -246,7 +284,7 @@ static void UNROM08_init(Machine *vm) {
 // MAPPER 3: Nintendo CNROM (32f/8b) //
 
 static void CNROM_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_chr_full(&vm->cart, value);
+    select_chr_full(vm, value);
 }
 
 static void CNROM_init(Machine *vm) {
@@ -257,45 +295,46 @@ static void CNROM_init(Machine *vm) {
 //             (variable banking, H/V control, scanline counter)            //
 //        119: TQROM variant (uses both CHR ROM and CHR RAM simultaneously) //
 
-static void MMC3_update_banks(Cartridge *cart) {
+static void MMC3_update_banks(Machine *vm) {
+    Cartridge *cart = &vm->cart;
     MMC3State *mmc = &cart->mapper.mmc3;
     
     // PRG ROM
-    select_prg_quarter(cart, 1, mmc->banks[7]);
+    select_prg_quarter(vm, 1, mmc->banks[7]);
     if (BIT_CHECK(mmc->bank_select, 6)) {
-        select_prg_quarter(cart, 0, get_prg_last_quarter(cart, 2));
-        select_prg_quarter(cart, 2, mmc->banks[6]);
+        select_prg_quarter(vm, 0, get_prg_last_quarter(cart, 2));
+        select_prg_quarter(vm, 2, mmc->banks[6]);
     } else {
-        select_prg_quarter(cart, 0, mmc->banks[6]);
-        select_prg_quarter(cart, 2, get_prg_last_quarter(cart, 2));
+        select_prg_quarter(vm, 0, mmc->banks[6]);
+        select_prg_quarter(vm, 2, get_prg_last_quarter(cart, 2));
     }
     
     // CHR ROM
     if (BIT_CHECK(mmc->bank_select, 7)) {
-        select_chr_eighth(cart, 4, mmc->banks[0]);
-        select_chr_eighth(cart, 5, mmc->banks[0] + 1);
-        select_chr_eighth(cart, 6, mmc->banks[1]);
-        select_chr_eighth(cart, 7, mmc->banks[1] + 1);
-        select_chr_eighth(cart, 0, mmc->banks[2]);
-        select_chr_eighth(cart, 1, mmc->banks[3]);
-        select_chr_eighth(cart, 2, mmc->banks[4]);
-        select_chr_eighth(cart, 3, mmc->banks[5]);
+        select_chr_eighth(vm, 4, mmc->banks[0]);
+        select_chr_eighth(vm, 5, mmc->banks[0] + 1);
+        select_chr_eighth(vm, 6, mmc->banks[1]);
+        select_chr_eighth(vm, 7, mmc->banks[1] + 1);
+        select_chr_eighth(vm, 0, mmc->banks[2]);
+        select_chr_eighth(vm, 1, mmc->banks[3]);
+        select_chr_eighth(vm, 2, mmc->banks[4]);
+        select_chr_eighth(vm, 3, mmc->banks[5]);
     } else {
-        select_chr_eighth(cart, 0, mmc->banks[0]);
-        select_chr_eighth(cart, 1, mmc->banks[0] + 1);
-        select_chr_eighth(cart, 2, mmc->banks[1]);
-        select_chr_eighth(cart, 3, mmc->banks[1] + 1);
-        select_chr_eighth(cart, 4, mmc->banks[2]);
-        select_chr_eighth(cart, 5, mmc->banks[3]);
-        select_chr_eighth(cart, 6, mmc->banks[4]);
-        select_chr_eighth(cart, 7, mmc->banks[5]);
+        select_chr_eighth(vm, 0, mmc->banks[0]);
+        select_chr_eighth(vm, 1, mmc->banks[0] + 1);
+        select_chr_eighth(vm, 2, mmc->banks[1]);
+        select_chr_eighth(vm, 3, mmc->banks[1] + 1);
+        select_chr_eighth(vm, 4, mmc->banks[2]);
+        select_chr_eighth(vm, 5, mmc->banks[3]);
+        select_chr_eighth(vm, 6, mmc->banks[4]);
+        select_chr_eighth(vm, 7, mmc->banks[5]);
     }
 }
 
 static void MMC3_write_register_bank_select(Machine *vm, uint16_t addr,
                                             uint8_t value) {
     vm->cart.mapper.mmc3.bank_select = value;
-    MMC3_update_banks(&vm->cart);
+    MMC3_update_banks(vm);
 }
 
 static void MMC3_write_register_bank_data(Machine *vm, uint16_t addr,
@@ -306,7 +345,7 @@ static void MMC3_write_register_bank_data(Machine *vm, uint16_t addr,
         value &= ~1;
     }
     cart->mapper.mmc3.banks[bank] = value;
-    MMC3_update_banks(cart);
+    MMC3_update_banks(vm);
 }
 
 static void MMC3_write_register_mirroring(Machine *vm, uint16_t addr,
@@ -352,35 +391,47 @@ static uint8_t MMC3_read_chr(Machine *vm, uint16_t addr) {
     return read_chr(vm, addr);
 }
 
+static int MMC3_next_irq(Machine *vm) {
+    MMC3State *mmc = &vm->cart.mapper.mmc3;
+    if (!mmc->irq_enabled) {
+        return -1;
+    }
+    int clocks = mmc->irq_counter;
+    if (!clocks) {
+        clocks = 1 + mmc->irq_latch;
+    }
+    // A12 rises at most once every two 8-dot fetch groups
+    return (clocks - 1) * 16;
+}
+
 static void MMC3_init(Machine *vm) {
     Cartridge *cart = &vm->cart;
     memset(&cart->mapper.mmc3, 0, sizeof(MMC3State));
+    cart->next_irq_func = MMC3_next_irq;
     
-    select_prg_quarter(cart, 3, get_prg_last_quarter(cart, 1));
-    MMC3_update_banks(cart);
+    select_prg_quarter(vm, 3, get_prg_last_quarter(cart, 1));
+    MMC3_update_banks(vm);
     
-    int i = 0x8000;
-    while (i < 0xA000) {
-        vm->cpu_mm.write[i++] = MMC3_write_register_bank_select;
-        vm->cpu_mm.write[i++] = MMC3_write_register_bank_data;
-    }
-    while (i < 0xC000) {
-        vm->cpu_mm.write[i++] = MMC3_write_register_mirroring;
-        i++;    // SRAM protect, intentionally not implemented to ensure
-                // cross-compatibility with MMC6 which shares the same mapper ID
-    }
-    while (i < 0xE000) {
-        vm->cpu_mm.write[i++] = MMC3_write_register_irq_latch;
-        vm->cpu_mm.write[i++] = MMC3_write_register_irq_reload;
-    }
-    while (i < 0x10000) {
-        vm->cpu_mm.write[i++] = MMC3_write_register_irq_disable;
-        vm->cpu_mm.write[i++] = MMC3_write_register_irq_enable;
-    }
+    // Even and odd registers, repeated in each 8kB
+    MemoryMap *mm = &vm->cpu_mm;
+    mm_map_range(mm, 0x8000, 0x9FFF, NULL, MMC3_write_register_bank_select,
+                 0xE001);
+    mm_map_range(mm, 0x8001, 0x9FFF, NULL, MMC3_write_register_bank_data,
+                 0xE001);
+    mm_map_range(mm, 0xA000, 0xBFFF, NULL, MMC3_write_register_mirroring,
+                 0xE001);
+    // A001: SRAM protect, intentionally not implemented to ensure
+    //       cross-compatibility with MMC6 which shares the same mapper ID
+    mm_map_range(mm, 0xC000, 0xDFFF, NULL, MMC3_write_register_irq_latch,
+                 0xE001);
+    mm_map_range(mm, 0xC001, 0xDFFF, NULL, MMC3_write_register_irq_reload,
+                 0xE001);
+    mm_map_range(mm, 0xE000, 0xFFFF, NULL, MMC3_write_register_irq_disable,
+                 0xE001);
+    mm_map_range(mm, 0xE001, 0xFFFF, NULL, MMC3_write_register_irq_enable,
+                 0xE001);
     
-    for (int i = 0; i < SIZE_CHR_ROM; i++) {
-        vm->ppu_mm.read[i] = MMC3_read_chr;
-    }
+    mm_map_range(&vm->ppu_mm, 0x0000, 0x1FFF, MMC3_read_chr, NULL, 0);
     
     init_sram(vm, SIZE_SRAM);
 }
@@ -388,13 +439,20 @@ static void MMC3_init(Machine *vm) {
 static void MMC3Q_init(Machine *vm) {
     Cartridge *cart = &vm->cart;
     
-    // Change the CHR to RAM and grow it to 128kB
+    // Change the CHR to RAM and grow it to 128kB. The ROM half has to be
+    // copied (iNES files don't keep it page aligned), the rest stays shared.
     blob chr_rom = cart->chr_memory;
-    cart->chr_is_ram = true;
-    cart->chr_memory.size = 16 * SIZE_CHR_ROM;
-    cart->chr_memory.data = malloc(cart->chr_memory.size);
-    memset(cart->chr_memory.data, 0, cart->chr_memory.size);
-    memcpy(cart->chr_memory.data, chr_rom.data, chr_rom.size);
+    bool was_ram = cart->chr_is_ram;
+    bool is_allocated = init_chr_ram(cart, 16 * SIZE_CHR_ROM);
+    if (is_allocated) {
+        memcpy(cart->chr_memory.data, chr_rom.data, chr_rom.size);
+    }
+    if (was_ram) {
+        free_chr_ram(&chr_rom);
+    }
+    if (!is_allocated) {
+        return;
+    }
     
     MMC3_init(vm);
 }
@@ -402,7 +460,7 @@ static void MMC3Q_init(Machine *vm) {
 // MAPPER 7: Nintendo AxROM (32b/8f, A/B control) //
 
 static void AxROM_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_full(&vm->cart, value & 0b111);
+    select_prg_full(vm, value & 0b111);
     machine_set_nt_mirroring(vm, (value & 0b10000 ? NT_SINGLE_B : NT_SINGLE_A));
 }
 
@@ -416,26 +474,27 @@ static void AxROM_init(Machine *vm) {
 //        10: Nintendo MMC4                                        //
 //            (similar but 16b+16f/4b+4b and simpler read trigger) //
 
-static void MMC24_update_chr_banks(Cartridge *cart) {
+static void MMC24_update_chr_banks(Machine *vm) {
+    Cartridge *cart = &vm->cart;
     for (int i = 0; i < 2; i++) {
-        select_chr_half(cart, i,
+        select_chr_half(vm, i,
             cart->mapper.mmc24.chr_banks[i][cart->mapper.mmc24.chr_latches[i]]);
     }
 }
 
 static void MMC2_write_register_prg(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_quarter(&vm->cart, 0, value);
+    select_prg_quarter(vm, 0, value);
 }
 
 static void MMC4_write_register_prg(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_half(&vm->cart, 0, value);
+    select_prg_half(vm, 0, value);
 }
 
 static void MMC24_write_register_chr(Machine *vm, uint16_t addr,
                                      uint8_t value) {
     int bank = ((addr >> 12) & 7) - 3;
     vm->cart.mapper.mmc24.chr_banks[bank / 2][bank % 2] = value;
-    MMC24_update_chr_banks(&vm->cart);
+    MMC24_update_chr_banks(vm);
 }
 
 static void MMC24_write_register_mirroring(Machine *vm, uint16_t addr,
@@ -454,18 +513,18 @@ static uint8_t MMC24_read_chr(Machine *vm, uint16_t addr) {
     if (mmc->is_2 && bank) {
         if (addr >= 0xFD8 && addr <= 0xFDF) {
             mmc->chr_latches[bank] = 0;
-            MMC24_update_chr_banks(cart);
+            MMC24_update_chr_banks(vm);
         } else if (addr >= 0xFE8 && addr <= 0xFEF) {
             mmc->chr_latches[bank] = 1;
-            MMC24_update_chr_banks(cart);
+            MMC24_update_chr_banks(vm);
         }
     } else {
         if (addr == 0xFD8) {
             mmc->chr_latches[bank] = 0;
-            MMC24_update_chr_banks(cart);
+            MMC24_update_chr_banks(vm);
         } else if (addr == 0xFE8) {
             mmc->chr_latches[bank] = 1;
-            MMC24_update_chr_banks(cart);
+            MMC24_update_chr_banks(vm);
         }
     }
     
@@ -475,20 +534,12 @@ static uint8_t MMC24_read_chr(Machine *vm, uint16_t addr) {
 static void MMC24_init_common(Machine *vm, WriteFuncPtr register_prg_func) {
     memset(&vm->cart.mapper.mmc24, 0, sizeof(MMC24State));
     
-    int i = 0xA000;
-    while (i < 0xB000) {
-        vm->cpu_mm.write[i++] = register_prg_func;
-    }
-    while (i < 0xF000) {
-        vm->cpu_mm.write[i++] = MMC24_write_register_chr;
-    }
-    while (i < 0x10000) {
-        vm->cpu_mm.write[i++] = MMC24_write_register_mirroring;
-    }
+    MemoryMap *mm = &vm->cpu_mm;
+    mm_map_range(mm, 0xA000, 0xAFFF, NULL, register_prg_func, 0);
+    mm_map_range(mm, 0xB000, 0xEFFF, NULL, MMC24_write_register_chr, 0);
+    mm_map_range(mm, 0xF000, 0xFFFF, NULL, MMC24_write_register_mirroring, 0);
     
-    for (int i = 0; i < SIZE_CHR_ROM; i++) {
-        vm->ppu_mm.read[i] = MMC24_read_chr;
-    }
+    mm_map_range(&vm->ppu_mm, 0x0000, 0x1FFF, MMC24_read_chr, NULL, 0);
 }
 
 static void MMC2_init(Machine *vm) {
@@ -499,16 +550,16 @@ static void MMC2_init(Machine *vm) {
     
     // Last three banks are fixed to the end
     const int last = get_prg_last_quarter(cart, 1);
-    select_prg_quarter(cart, 1, last - 2);
-    select_prg_quarter(cart, 2, last - 1);
-    select_prg_quarter(cart, 3, last);
+    select_prg_quarter(vm, 1, last - 2);
+    select_prg_quarter(vm, 2, last - 1);
+    select_prg_quarter(vm, 3, last);
 }
 
 static void MMC4_init(Machine *vm) {
     MMC24_init_common(vm, MMC4_write_register_prg);
     
     Cartridge *cart = &vm->cart;
-    select_prg_half(cart, 1, get_prg_last_half(cart, 1));
+    select_prg_half(vm, 1, get_prg_last_half(cart, 1));
     
     init_sram(vm, SIZE_SRAM);
 }
@@ -517,8 +568,8 @@ static void MMC4_init(Machine *vm) {
 
 static void Color_Dreams_write_register(Machine *vm, uint16_t addr,
                                         uint8_t value) {
-    select_prg_full(&vm->cart, value & 0xF);
-    select_chr_full(&vm->cart, value >> 4);
+    select_prg_full(vm, value & 0xF);
+    select_chr_full(vm, value >> 4);
 }
 
 static void Color_Dreams_init(Machine *vm) {
@@ -528,21 +579,20 @@ static void Color_Dreams_init(Machine *vm) {
 // MAPPER 13: Nintendo CPROM (32f/4f+4b, 16kB CHR RAM) //
 
 static void CPROM_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_chr_half(&vm->cart, 1, value);
+    select_chr_half(vm, 1, value);
 }
 
 static void CPROM_init(Machine *vm) {
     Cartridge *cart = &vm->cart;
     
     // Force CHR RAM and expand it to 16kB
-    cart->chr_memory.size = SIZE_CHR_ROM * 2;
     if (cart->chr_is_ram) {
-        cart->chr_memory.data = realloc(cart->chr_memory.data,
-                                        cart->chr_memory.size);
-    } else {
-        cart->chr_memory.data = malloc(cart->chr_memory.size);
+        free_chr_ram(&cart->chr_memory);
     }
-    cart->chr_is_ram = true;
+    if (!init_chr_ram(cart, SIZE_CHR_ROM * 2)) {
+        return;
+    }
+    select_chr_full(vm, 0);
 
     init_register_prg(vm, CPROM_write_register);
 }
@@ -551,7 +601,7 @@ static void CPROM_init(Machine *vm) {
 //        39: Unnamed Subor equivalent //
 
 static void BNROM_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_full(&vm->cart, value);
+    select_prg_full(vm, value);
 }
 
 static void BNROM_init(Machine *vm) {
@@ -561,23 +611,21 @@ static void BNROM_init(Machine *vm) {
 // MAPPER 38: PCI556 (32b/8b) //
 
 static void PCI556_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_full(&vm->cart, value & 7);
-    select_chr_full(&vm->cart, value >> 2);
+    select_prg_full(vm, value & 7);
+    select_chr_full(vm, value >> 2);
 }
 
 static void PCI556_init(Machine *vm) {
     // Register is only in the upper half of the SRAM area
-    for (int i = 0x7000; i < 0x8000; i++) {
-        vm->cpu_mm.write[i] = PCI556_write_register;
-    }
+    mm_map_range(&vm->cpu_mm, 0x7000, 0x7FFF, NULL, PCI556_write_register, 0);
 }
 
 // MAPPER  66: Nintendo GNROM and MHROM (32b/8b)                          //
 //        140: Jaleco JF-11/14 (similar but register in the SRAM area)    //
 
 static void GxROM_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_full(&vm->cart, value >> 4);
-    select_chr_full(&vm->cart, value & 0xF);
+    select_prg_full(vm, value >> 4);
+    select_chr_full(vm, value & 0xF);
 }
 
 static void GxROM_init(Machine *vm) {
@@ -600,16 +648,19 @@ static void Sunsoft4_update_nametables(Machine *vm) {
     Cartridge *cart = &vm->cart;
     uint8_t *nts[] = {vm->nametables[0], vm->nametables[1]};
     const int *layout = layouts + (cart->mapper.sunsoft4.ctrl & 0b11) * 4;
-    uint8_t **memory = (BIT_CHECK(cart->mapper.sunsoft4.ctrl, 4) ?
-                        cart->mapper.sunsoft4.chr_nt_banks : nts);
+    const bool is_chr = BIT_CHECK(cart->mapper.sunsoft4.ctrl, 4);
+    uint8_t **memory = (is_chr ? cart->mapper.sunsoft4.chr_nt_banks : nts);
+    uint8_t *nt_layout[4];
     for (int i = 0; i < 4; i++) {
-        vm->nt_layout[i] = memory[layout[i]];
+        nt_layout[i] = memory[layout[i]];
     }
+    // CHR ROM may be mapped straight from the (read-only) file
+    machine_set_nt_layout(vm, nt_layout, !is_chr);
 }
 
 static void Sunsoft4_write_register_chr(Machine *vm, uint16_t addr,
                                         uint8_t value) {
-    select_chr_quarter(&vm->cart, (addr >> 12) & 3, value);
+    select_chr_quarter(vm, (addr >> 12) & 3, value);
 }
 
 static void Sunsoft4_write_register_nt(Machine *vm, uint16_t addr,
@@ -629,7 +680,7 @@ static void Sunsoft4_write_register_ctrl(Machine *vm, uint16_t addr,
 
 static void Sunsoft4_write_register_prg(Machine *vm, uint16_t addr,
                                         uint8_t value) {
-    select_prg_half(&vm->cart, 0, value & 0xF);
+    select_prg_half(vm, 0, value & 0xF);
     // TODO: bit 4 enable SRAM?
 }
 
@@ -644,35 +695,27 @@ static void Sunsoft4_init(Machine *vm) {
     Cartridge *cart = &vm->cart;
     memset(&cart->mapper.sunsoft4, 0, sizeof(Sunsoft4State));
     
-    for (int i = 0x8000; i < 0xC000; i++) {
-        vm->cpu_mm.write[i] = Sunsoft4_write_register_chr;
-    }
-    for (int i = 0xC000; i < 0xE000; i++) {
-        vm->cpu_mm.write[i] = Sunsoft4_write_register_nt;
-    }
-    for (int i = 0xE000; i < 0xF000; i++) {
-        vm->cpu_mm.write[i] = Sunsoft4_write_register_ctrl;
-    }
-    for (int i = 0xF000; i < 0x10000; i++) {
-        vm->cpu_mm.write[i] = Sunsoft4_write_register_prg;
-    }
+    MemoryMap *mm = &vm->cpu_mm;
+    mm_map_range(mm, 0x8000, 0xBFFF, NULL, Sunsoft4_write_register_chr, 0);
+    mm_map_range(mm, 0xC000, 0xDFFF, NULL, Sunsoft4_write_register_nt, 0);
+    mm_map_range(mm, 0xE000, 0xEFFF, NULL, Sunsoft4_write_register_ctrl, 0);
+    mm_map_range(mm, 0xF000, 0xFFFF, NULL, Sunsoft4_write_register_prg, 0);
     
     init_sram(vm, SIZE_SRAM);
     
-    select_prg_half(cart, 1, get_prg_last_half(cart, 1));
+    select_prg_half(vm, 1, get_prg_last_half(cart, 1));
     
     // Need to enforce write protection when CHR ROM is mapped to NT
-    for (int i = 0; i < 0x1EFF; i++) {
-        vm->ppu_mm.write[0x2000 + i] = Sunsoft4_write_nametables;
-    }
+    mm_map_range(&vm->ppu_mm, 0x2000, 0x3EFF, NULL, Sunsoft4_write_nametables,
+                 0);
 }
 
 // MAPPER  70: Bandai 74*161/161/32 (16b+16f/8b with equivalent register) //
 //        152: Bandai 74*161/161/32 single screen (70 with A/B control)   //
 
 static void Bandai74_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_half(&vm->cart, 0, (value >> 4) & 7);
-    select_chr_full(&vm->cart, value & 0xF);
+    select_prg_half(vm, 0, (value >> 4) & 7);
+    select_chr_full(vm, value & 0xF);
 }
 
 static void Bandai74s_write_register(Machine *vm, uint16_t addr, uint8_t value) {
@@ -683,7 +726,7 @@ static void Bandai74s_write_register(Machine *vm, uint16_t addr, uint8_t value)
 
 static void Bandai74_init_common(Machine *vm, WriteFuncPtr register_func) {
     Cartridge *cart = &vm->cart;
-    select_prg_half(cart, 1, get_prg_last_half(cart, 1));
+    select_prg_half(vm, 1, get_prg_last_half(cart, 1));
     init_register_prg(vm, register_func);
 }
 
@@ -699,13 +742,14 @@ static void Bandai74s_init(Machine *vm) {
 // MAPPER  75: Konami VRC1 (8b+8b+8b+8f/4b+4b, H/V control) //
 //        151: Duplicate (intended for Vs. System)          //
 
-static void VRC1_update_chr_banks(Cartridge *cart) {
-    select_chr_half(cart, 0, cart->mapper.vrc1_chr_banks[0]);
-    select_chr_half(cart, 1, cart->mapper.vrc1_chr_banks[1]);
+static void VRC1_update_chr_banks(Machine *vm) {
+    Cartridge *cart = &vm->cart;
+    select_chr_half(vm, 0, cart->mapper.vrc1_chr_banks[0]);
+    select_chr_half(vm, 1, cart->mapper.vrc1_chr_banks[1]);
 }
 
 static void VRC1_write_register_prg(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_quarter(&vm->cart, (addr >> 13) & 3, value);
+    select_prg_quarter(vm, (addr >> 13) & 3, value);
 }
 
 static void VRC1_write_register_misc(Machine *vm, uint16_t addr,
@@ -715,7 +759,7 @@ static void VRC1_write_register_misc(Machine *vm, uint16_t addr,
     uint8_t *banks = vm->cart.mapper.vrc1_chr_banks;
     banks[0] = (banks[0] & 0xF) | (!!BIT_CHECK(value, 1) << 4);
     banks[1] = (banks[1] & 0xF) | (!!BIT_CHECK(value, 2) << 4);
-    VRC1_update_chr_banks(&vm->cart);
+    VRC1_update_chr_banks(vm);
 }
 
 static void VRC1_write_register_chr(Machine *vm, uint16_t addr, uint8_t value) {
@@ -725,20 +769,14 @@ static void VRC1_write_register_chr(Machine *vm, uint16_t addr, uint8_t value) {
 
 static void VRC1_init(Machine *vm) {
     Cartridge *cart = &vm->cart;
-    select_prg_quarter(cart, 3, get_prg_last_quarter(cart, 1));
+    select_prg_quarter(vm, 3, get_prg_last_quarter(cart, 1));
     cart->mapper.vrc1_chr_banks[0] = cart->mapper.vrc1_chr_banks[1] = 0;
     
-    for (int i = 0x8000; i < 0xE000; i += 0x2000) {
-        for (int j = 0; j < 0x1000; j++) {
-            vm->cpu_mm.write[i + j] = VRC1_write_register_prg;
-        }
-    }
-    for (int i = 0x9000; i < 0xA000; i++) {
-        vm->cpu_mm.write[i] = VRC1_write_register_misc;
-    }
-    for (int i = 0xE000; i < 0x10000; i++) {
-        vm->cpu_mm.write[i] = VRC1_write_register_chr;
-    }
+    // 8000, A000 and C000: PRG banks (4kB each, in the first half of 8kB)
+    MemoryMap *mm = &vm->cpu_mm;
+    mm_map_range(mm, 0x8000, 0xDFFF, NULL, VRC1_write_register_prg, 0x1000);
+    mm_map_range(mm, 0x9000, 0x9FFF, NULL, VRC1_write_register_misc, 0);
+    mm_map_range(mm, 0xE000, 0xFFFF, NULL, VRC1_write_register_chr, 0);
 }
 
 // MAPPER  79: American Video Entertainment NINA-03/06 (32b/8b)      //
@@ -746,23 +784,21 @@ static void VRC1_init(Machine *vm) {
 //        146: Duplicate of 79                                       //
 
 static void NINA0306_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_full(&vm->cart, value >> 3);
-    select_chr_full(&vm->cart, value & 7);
+    select_prg_full(vm, value >> 3);
+    select_chr_full(vm, value & 7);
 }
 
 static void NINA0306MC_write_register(Machine *vm, uint16_t addr,
                                       uint8_t value) {
-    select_prg_full(&vm->cart, (value >> 3) & 7);
-    select_chr_full(&vm->cart, ((value >> 3) & 8) | (value & 7));
+    select_prg_full(vm, (value >> 3) & 7);
+    select_chr_full(vm, ((value >> 3) & 8) | (value & 7));
     machine_set_nt_mirroring(vm, (BIT_CHECK(value, 7) ? NT_VERTICAL
                                                       : NT_HORIZONTAL));
 }
 
 static void NINA0306_init_register(Machine *vm, WriteFuncPtr register_func) {
     // The register is at a more complicated location but who cares
-    for (int i = 0x4100; i < 0x6000; i++) {
-        vm->cpu_mm.write[i] = register_func;
-    }
+    mm_map_range(&vm->cpu_mm, 0x4100, 0x5FFF, NULL, register_func, 0);
 }
 
 static void NINA0306_init(Machine *vm) {
@@ -777,7 +813,7 @@ static void NINA0306MC_init(Machine *vm) {
 //            (32f/8b, reversed bits in register) //
 
 static void KJT74_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_chr_full(&vm->cart, ((value & 1) << 1) | ((value & 2) >> 1));
+    select_chr_full(vm, ((value & 1) << 1) | ((value & 2) >> 1));
 }
 
 static void KJT74_init(Machine *vm) {
@@ -787,15 +823,15 @@ static void KJT74_init(Machine *vm) {
 // MAPPER 89: Sunsoft-2 IC on Sunsoft-3 board (16b+16f/8b, A/B control) //
 
 static void Sunsoft2_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_half(&vm->cart, 0, (addr >> 4) & 7);
-    select_chr_full(&vm->cart, ((addr >> 4) & 8) | (addr & 7));
+    select_prg_half(vm, 0, (addr >> 4) & 7);
+    select_chr_full(vm, ((addr >> 4) & 8) | (addr & 7));
     machine_set_nt_mirroring(vm, (BIT_CHECK(value, 3) ? NT_SINGLE_B
                                                       : NT_SINGLE_A));
 }
 
 static void Sunsoft2_init(Machine *vm) {
     Cartridge *cart = &vm->cart;
-    select_prg_half(cart, 1, get_prg_last_half(cart, 1));
+    select_prg_half(vm, 1, get_prg_last_half(cart, 1));
     init_register_prg(vm, Sunsoft2_write_register);
     machine_set_nt_mirroring(vm, NT_SINGLE_A);
 }
@@ -803,7 +839,7 @@ static void Sunsoft2_init(Machine *vm) {
 // MAPPER 97: Irem TAM-S1 (16f+16b/8f, A/B/H/V control) //
 
 static void TAMS1_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_prg_half(&vm->cart, 1, value & 0x1F);
+    select_prg_half(vm, 1, value & 0x1F);
     machine_set_nt_mirroring(vm, BIT_CHECK(value, 7) ? NT_VERTICAL
                                                      : NT_HORIZONTAL);
 }
@@ -814,23 +850,23 @@ static void TAMS1_init(Machine *vm) {
     machine_set_nt_mirroring(vm, NT_SINGLE_A);
     
     // This is not a typo, it really fixes the *first* bank to the end
-    select_prg_half(cart, 0, get_prg_last_half(cart, 1));
+    select_prg_half(vm, 0, get_prg_last_half(cart, 1));
 }
 
 // MAPPER 99: Nintendo Vs. System default board (8b+24f/8b via $4016 bit 2) //
 
 static void VS_write_register(Machine *vm, uint16_t addr, uint8_t value) {
     bool selected = BIT_CHECK(value, 2);
-    select_prg_quarter(&vm->cart, 0, selected << 2);
-    select_chr_full(&vm->cart, selected);
+    select_prg_quarter(vm, 0, selected << 2);
+    select_chr_full(vm, selected);
     (*vm->cart.mapper.hijacked_reg)(vm, addr, value);
 }
 
 static void VS_init(Machine *vm) {
     Cartridge *cart = &vm->cart;
     
-    cart->mapper.hijacked_reg = vm->cpu_mm.write[0x4016];
-    vm->cpu_mm.write[0x4016] = VS_write_register;
+    cart->mapper.hijacked_reg = mm_get_write(&vm->cpu_mm, 0x4016);
+    mm_map_range(&vm->cpu_mm, 0x4016, 0x4016, NULL, VS_write_register, 0);
     
     init_sram(vm, SIZE_SRAM);
 }
@@ -838,12 +874,12 @@ static void VS_init(Machine *vm) {
 // MAPPER 184: Sunsoft-1 (32f/4b+4b) //
 
 static void Sunsoft1_write_register(Machine *vm, uint16_t addr, uint8_t value) {
-    select_chr_half(&vm->cart, 0, value & 7);
-    select_chr_half(&vm->cart, 1, 4 | ((value >> 4) & 3));
+    select_chr_half(vm, 0, value & 7);
+    select_chr_half(vm, 1, 4 | ((value >> 4) & 3));
 }
 
 static void Sunsoft1_init(Machine *vm) {
-    select_chr_half(&vm->cart, 1, 4);
+    select_chr_half(vm, 1, 4);
     init_register_sram(vm, Sunsoft1_write_register);
 }
 
@@ -861,9 +897,7 @@ static uint8_t CNROM_CP_read_chr(Machine *vm, uint16_t addr) {
 static void CNROM_CP_init(Machine *vm) {
     vm->cart.mapper.cp_counter = 0;
     
-    for (int i = 0; i < SIZE_CHR_ROM; i++) {
-        vm->ppu_mm.read[i] = CNROM_CP_read_chr;
-    }
+    mm_map_range(&vm->ppu_mm, 0x0000, 0x1FFF, CNROM_CP_read_chr, NULL, 0);
 }
 
 // MAPPER ENUMERATION ARRAY //
@@ -1049,27 +1083,25 @@ bool mapper_check_support(int mapper_id, const char **name) {
     return false;
 }
 
-void mapper_init(Machine *vm, int mapper_id) {
+bool mapper_init(Machine *vm, int mapper_id) {
     Cartridge *cart = &vm->cart;
     cart->sram_enabled = true;
     
-    // Initialize banks to first ranges
-    for (int i = 0; i < 4; i++) {
-        cart->prg_banks[i] = cart->prg_rom.data +
-                             ((SIZE_PRG_BANK * i) % cart->prg_rom.size);
-    }
-    for (int i = 0; i < 8; i++) {
-        cart->chr_banks[i] = cart->chr_memory.data + SIZE_CHR_BANK * i;
+    // Without CHR ROM, there are 8kB of CHR RAM instead
+    if (!cart->chr_memory.size && !init_chr_ram(cart, SIZE_CHR_ROM)) {
+        return false;
     }
     
+    // Initialize banks to first ranges
     // CPU 8000-FFFF: PRG ROM (32kB, repeated if 16kB)
-    for (int i = 0; i < SIZE_PRG_ROM; i++) {
-        vm->cpu_mm.read[0x8000 + i] = read_prg;
+    for (int i = 0; i < 4; i++) {
+        set_prg_bank(vm, i, cart->prg_rom.data +
+                            ((SIZE_PRG_BANK * i) % cart->prg_rom.size));
     }
-    
+    machine_invalidate(vm, REGION_PRG);
     // PPU 0000-1FFF: CHR ROM (8kB)
-    for (int i = 0; i < SIZE_CHR_ROM; i++) {
-        vm->ppu_mm.read[i] = read_chr;
+    for (int i = 0; i < 8; i++) {
+        set_chr_bank(vm, i, cart->chr_memory.data + SIZE_CHR_BANK * i);
     }
     
     for (int i = 0; i < mappers_len; i++) {
@@ -1078,10 +1110,20 @@ void mapper_init(Machine *vm, int mapper_id) {
             break;
         }
     }
+    if (!cart->chr_memory.data) {
+        return false; // The mapper couldn't get its CHR RAM
+    }
     
-    if (cart->chr_is_ram) {
-        for (int i = 0; i < SIZE_CHR_ROM; i++) {
-            vm->ppu_mm.write[i] = write_chr;
-        }
+    // The mapper may have switched to CHR RAM, which is also writable
+    for (int i = 0; i < 8; i++) {
+        set_chr_bank(vm, i, cart->chr_banks[i]);
+    }
+    machine_invalidate(vm, REGION_CHR);
+    return true;
+}
+
+void mapper_teardown(Machine *vm) {
+    if (vm->cart.chr_is_ram && vm->cart.chr_memory.data) {
+        free_chr_ram(&vm->cart.chr_memory);
     }
 }
@@ -79,6 +79,8 @@ typedef struct Cartridge {
     
     // Memory mapper
     Mapper mapper;
+    // Dots until the mapper may raise an IRQ, or -1 if it can't (optional)
+    int (*next_irq_func)(Machine *);
 } Cartridge;
 
 typedef struct MapperInfo {
@@ -89,6 +91,7 @@ typedef struct MapperInfo {
 
 bool mapper_check_support(int mapper_id, const char **name);
 
-void mapper_init(Machine *vm, int mapper_id);
+bool mapper_init(Machine *vm, int mapper_id);
+void mapper_teardown(Machine *vm);
 
 #endif /* f_cartridge_h */
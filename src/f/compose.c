@@ -0,0 +1,74 @@
+#include "compose.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// PUBLIC FUNCTIONS //
+
+bool compose_span(const uint8_t *bg, const uint8_t *spr, uint8_t *out,
+                  int len) {
+    bool zero_hit = false;
+    for (int i = 0; i < len; i++) {
+        int bg_index = BG_PIXEL_INDEX(bg[i]);
+        int s_index = SPR_PIXEL_INDEX(spr[i]);
+        if (bg_index && s_index && spr[i] & SPR_PIXEL_ZERO) {
+            zero_hit = true;
+        }
+        if (s_index && (!(spr[i] & OAM_ATTR_UNDER_BG) || !bg_index)) {
+            out[i] = 0x10 | ((spr[i] & 0b11) << 2) | s_index;
+        } else {
+            out[i] = bg[i] & 0xF;
+        }
+    }
+    return zero_hit;
+}
+
+#ifdef __SSE2__
+// 16 pixels at a time, the rest with compose_span
+bool compose_line(const uint8_t *bg, const uint8_t *spr, uint8_t *out,
+                  int len) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mask_index = _mm_set1_epi8(0b11);
+    const __m128i mask_bg = _mm_set1_epi8(0xF);
+    const __m128i spr_zero = _mm_set1_epi8(SPR_PIXEL_ZERO);
+    const __m128i under_bg = _mm_set1_epi8(OAM_ATTR_UNDER_BG);
+    const __m128i spr_palettes = _mm_set1_epi8(0x10);
+    
+    int hits = 0;
+    int i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(bg + i));
+        __m128i s = _mm_loadu_si128((const __m128i *)(spr + i));
+        
+        // Byte shifts don't exist, but the bits crossing over get masked
+        __m128i s_index = _mm_and_si128(_mm_srli_epi16(s, 2), mask_index);
+        __m128i bg_clear = _mm_cmpeq_epi8(_mm_and_si128(b, mask_index), zero);
+        __m128i s_clear = _mm_cmpeq_epi8(s_index, zero);
+        __m128i is_zero = _mm_cmpeq_epi8(_mm_and_si128(s, spr_zero),
+                                         spr_zero);
+        hits |= _mm_movemask_epi8(
+            _mm_andnot_si128(_mm_or_si128(bg_clear, s_clear), is_zero));
+        
+        __m128i is_under = _mm_cmpeq_epi8(_mm_and_si128(s, under_bg),
+                                          under_bg);
+        __m128i s_wins = _mm_andnot_si128(
+            _mm_or_si128(s_clear, _mm_andnot_si128(bg_clear, is_under)),
+            _mm_cmpeq_epi8(zero, zero));
+        __m128i s_addr = _mm_or_si128(
+            _mm_or_si128(spr_palettes,
+                         _mm_slli_epi16(_mm_and_si128(s, mask_index), 2)),
+            s_index);
+        __m128i b_addr = _mm_and_si128(b, mask_bg);
+        _mm_storeu_si128((__m128i *)(out + i),
+                         _mm_or_si128(_mm_and_si128(s_wins, s_addr),
+                                      _mm_andnot_si128(s_wins, b_addr)));
+    }
+    return compose_span(bg + i, spr + i, out + i, len - i) || hits;
+}
+#else
+bool compose_line(const uint8_t *bg, const uint8_t *spr, uint8_t *out,
+                  int len) {
+    return compose_span(bg, spr, out, len);
+}
+#endif
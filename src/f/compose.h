@@ -0,0 +1,24 @@
+#ifndef f_compose_h
+#define f_compose_h
+
+#include "../common.h"
+#include "ppu.h"
+
+// Background pixels of a scanline: the color index, and the palette above it
+#define BG_PIXEL_INDEX(p) ((p) & 0b11)
+#define BG_PIXEL_PALETTE(p) ((p) >> 2)
+
+// Sprite pixels of a scanline: the color index, palette, priority and whether
+// it comes from sprite 0, or 0 when transparent
+#define SPR_PIXEL_INDEX(p) (((p) >> 2) & 0b11)
+#define SPR_PIXEL_ZERO (1 << 4)
+
+// Resolve the priority of both layers into palette addresses (3F00-3F1F),
+// returning whether sprite 0 hit an opaque background pixel
+bool compose_span(const uint8_t *bg, const uint8_t *spr, uint8_t *out,
+                  int len);
+// Same as compose_span, vectorized where the CPU allows it
+bool compose_line(const uint8_t *bg, const uint8_t *spr, uint8_t *out,
+                  int len);
+
+#endif
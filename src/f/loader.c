@@ -5,6 +5,10 @@
 #include "cartridge.h"
 #include "machine.h"
 
+#ifdef RECOMPILED
+extern const CPU65xxRecompiled recompiled_code;
+#endif
+
 int ines_loader(Driver *driver, blob *rom) {
     FCartInfo cart;
     memset(&cart, 0, sizeof(FCartInfo));
@@ -73,13 +77,55 @@ int ines_loader(Driver *driver, blob *rom) {
     driver->screen_w = WIDTH;
     driver->screen_h = HEIGHT_CROPPED;
     Machine *vm = malloc(sizeof(Machine));
-    machine_init(vm, &cart, driver);
+    if (!machine_init(vm, &cart, driver)) {
+        machine_teardown(vm);
+        free(vm);
+        return 1;
+    }
     driver->vm = vm;
     driver->refresh_rate = REFRESH_RATE;
     driver->screens[0] = vm->ppu.screens[0];
     driver->screens[1] = vm->ppu.screens[1];
+    driver->palette = vm->ppu.rgb_palette;
     driver->advance_frame_func = (AdvanceFrameFuncPtr)machine_advance_frame;
     driver->teardown_func = f_teardown;
+    
+    // For games that depend on when accesses happen within an instruction
+    // (f-cpucheck tells which ones)
+    const char *cycle_accurate = getenv("CYCLE_ACCURATE");
+    if (cycle_accurate && cycle_accurate[0] && strcmp(cycle_accurate, "0")) {
+        eprintf("CPU: Cycle accurate\n");
+        vm->is_cycle_accurate = true;
+    }
+    
+#ifdef RECOMPILED
+    // Built in from the output of f-recompile, for that ROM only
+    if (recompiled_code.crc == crc32(&cart.prg_rom)) {
+        eprintf("CPU: Recompiled\n");
+        cpu_65xx_set_recompiled(&vm->cpu, &recompiled_code,
+                                vm->cart.prg_rom.data);
+    }
+#endif
+    
+    const char *trace_path = getenv("TRACE");
+    if (trace_path) {
+        // The trigger is either a label or an hexadecimal address
+        const char *trigger = getenv("TRACE_TRIGGER");
+        int trigger_addr = -1;
+        if (trigger && driver->dbg_map) {
+            trigger_addr = debug_map_find(driver->dbg_map, trigger);
+        }
+        if (trigger && trigger_addr < 0) {
+            trigger_addr = (int)strtol(trigger, NULL, 16);
+        }
+        machine_start_trace(vm, trace_path, trigger_addr);
+        driver->dump_trace_func = (DumpTraceFuncPtr)machine_dump_trace;
+    }
+    
+    const char *profile_path = getenv("PROFILE");
+    if (profile_path) {
+        machine_start_profile(vm, profile_path);
+    }
     return 0;
 }
 
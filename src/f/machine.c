@@ -3,91 +3,366 @@
 #include "../driver.h"
 #include "loader.h"
 
-void machine_init(Machine *vm, FCartInfo *carti, Driver *driver) {
+static const uint8_t *get_code(MemoryMap *mm, uint16_t addr, int *size) {
+    // Only PRG ROM is safe to decode ahead of time
+    if (addr < 0x8000) {
+        return NULL;
+    }
+    *size = SIZE_PRG_BANK - (addr & MASK_PRG_BANK);
+    return mm->vm->cart.prg_banks[(addr >> 13) & (PRG_BANKS - 1)] +
+           (addr & MASK_PRG_BANK);
+}
+
+static int get_prg_bank(Machine *vm, uint16_t addr) {
+    if (addr < 0x8000) {
+        return -1;
+    }
+    return (int)((vm->cart.prg_banks[(addr >> 13) & (PRG_BANKS - 1)] -
+                  vm->cart.prg_rom.data) / SIZE_PRG_BANK);
+}
+
+// EXECUTION //
+
+// The CPU runs ahead, while the PPU and the APU only catch up to it when it
+// does I/O, or before a deadline: the next dot where an interrupt line might
+// rise by itself. The CPU never starts an instruction past that point, so
+// interrupts are seen at the same time as if everything ran in lockstep.
+// Each access still happens at the start of its instruction though, unless
+// the machine is cycle accurate: then the CPU runs one cycle at a time, and
+// everything else catches up before each of them.
+
+static uint64_t get_cpu_time(Machine *vm) {
+    return vm->cpu.cycles * T_CPU_MULTIPLIER;
+}
+
+static ALWAYS_INLINE void step_apu(Machine *vm) {
+    if (!(vm->mclk % T_APU_MULTIPLIER)) {
+        apu_step(&vm->apu);
+    }
+    // Yeah this needs to be done better
+    if (!(vm->mclk % 121)) {
+        apu_sample(&vm->apu);
+    }
+}
+
+static ALWAYS_INLINE void catch_up_as(Machine *vm, uint64_t mclk,
+                                       LoopVariant variant) {
+    while (vm->mclk < mclk) {
+        // Nothing can touch the PPU before mclk, so whole scanlines can be
+        // drawn in one go (the other variants stay on the dot renderer)
+        if (variant == LOOP_RELEASE && !vm->pos.cycle &&
+            vm->pos.scanline >= 0 &&
+            mclk - vm->mclk >= PPU_CYCLES_PER_SCANLINE) {
+            ppu_step_line(&vm->ppu, &vm->pos);
+            for (int i = 0; i < PPU_CYCLES_PER_SCANLINE; i++) {
+                step_apu(vm);
+                ++vm->mclk;
+            }
+            ++vm->pos.scanline;
+            continue;
+        }
+        
+        step_apu(vm);
+        if (variant == LOOP_RELEASE) {
+            ppu_step(&vm->ppu, &vm->pos);
+        } else if (variant == LOOP_LIGHTGUN) {
+            ppu_step_lightgun(&vm->ppu, &vm->pos);
+        } else {
+            ppu_step_debug(&vm->ppu, &vm->pos, vm->verbose);
+        }
+        
+        ++vm->mclk;
+        if (++vm->pos.cycle == PPU_CYCLES_PER_SCANLINE) {
+            vm->pos.cycle = 0;
+            ++vm->pos.scanline;
+        }
+    }
+}
+
+static void catch_up(Machine *vm, uint64_t mclk) {
+    switch (vm->variant) {
+        case LOOP_RELEASE:
+            catch_up_as(vm, mclk, LOOP_RELEASE);
+            break;
+        case LOOP_LIGHTGUN:
+            catch_up_as(vm, mclk, LOOP_LIGHTGUN);
+            break;
+        case LOOP_DEBUG:
+            catch_up_as(vm, mclk, LOOP_DEBUG);
+            break;
+    }
+}
+
+static void catch_up_for_io(Machine *vm) {
+    // The instruction's own fetches come after anything the DMC read
+    uint8_t bus = vm->cpu_mm.last_read;
+    catch_up(vm, get_cpu_time(vm));
+    vm->cpu_mm.last_read = bus;
+    
+    // The access may change when the next interrupt happens
+    cpu_65xx_stop(&vm->cpu);
+}
+
+static uint8_t read_cpu(MemoryMap *mm, uint16_t addr) {
+    if (addr >= 0x2000 && addr < 0x4020) {
+        catch_up_for_io(mm->vm);
+    }
+    return mm_read(mm, addr);
+}
+
+static void write_cpu(MemoryMap *mm, uint16_t addr, uint8_t value) {
+    if (addr >= 0x2000) {
+        catch_up_for_io(mm->vm);
+    }
+    mm_write(mm, addr, value);
+}
+
+static void limit_deadline(Machine *vm, uint64_t *deadline, int dots) {
+    if (dots >= 0 && vm->mclk + dots < *deadline) {
+        *deadline = vm->mclk + dots;
+    }
+}
+
+// Returns the first dot after the next possible interrupt
+static uint64_t get_deadline(Machine *vm, uint64_t frame_end) {
+    uint64_t deadline = frame_end - 1;
+    
+    // Vblank NMI
+    limit_deadline(vm, &deadline,
+                   (241 - vm->pos.scanline) * PPU_CYCLES_PER_SCANLINE +
+                   1 - vm->pos.cycle);
+    
+    // APU frame or DMC IRQ
+    int steps = apu_next_irq(&vm->apu);
+    if (steps > 0) {
+        int first = (T_APU_MULTIPLIER - vm->mclk % T_APU_MULTIPLIER) %
+                    T_APU_MULTIPLIER;
+        limit_deadline(vm, &deadline,
+                       first + (steps - 1) * T_APU_MULTIPLIER);
+    }
+    
+    // Mapper IRQ
+    if (vm->cart.next_irq_func) {
+        limit_deadline(vm, &deadline, (*vm->cart.next_irq_func)(vm));
+    }
+    
+    return deadline + 1;
+}
+
+static void step_cpu_verbose(Machine *vm) {
+    // Check for debug label
+    bool is_endless_loop = false;
+    if (vm->dbg_map && debug_map_is_labeled(vm->dbg_map, vm->cpu.pc)) {
+        const char *label = vm->dbg_map->labels[vm->cpu.pc];
+        if (strcmp(label, "EndlessLoop")) {
+            printf(":%s\n", label);
+        } else {
+            is_endless_loop = true;
+        }
+    }
+    cpu_65xx_step(&vm->cpu, !is_endless_loop);
+}
+
+static void start_frame(Machine *vm, int frame) {
+    vm->ppu.current_screen = frame & 1;
+    if (vm->verbose || vm->trace) {
+        vm->variant = LOOP_DEBUG;
+    } else if (ppu_has_lightgun(&vm->ppu)) {
+        vm->variant = LOOP_LIGHTGUN;
+    } else {
+        vm->variant = LOOP_RELEASE;
+    }
+    
+    // TODO: Skip last cycle of the pre-render line on odd frames
+    vm->pos = (RenderPos) {-1, 0};
+    vm->frame_end = vm->mclk + PPU_CYCLES_PER_SCANLINE *
+                               PPU_SCANLINES_PER_FRAME;
+}
+
+static void check_trace_trigger(Machine *vm) {
+    if (vm->trace && vm->trace->is_triggered) {
+        // Only the first hit gets dumped, or it would be overwritten
+        vm->trace->is_triggered = false;
+        vm->trace->trigger = -1;
+        machine_dump_trace(vm);
+    }
+}
+
+static ALWAYS_INLINE void run_frame(Machine *vm, LoopVariant variant) {
+    while (get_cpu_time(vm) < vm->frame_end) {
+        catch_up_as(vm, get_cpu_time(vm), variant);
+        if (variant == LOOP_DEBUG && vm->verbose) {
+            step_cpu_verbose(vm);
+        } else if (vm->is_cycle_accurate) {
+            cpu_65xx_tick(&vm->cpu);
+        } else {
+            uint64_t deadline = get_deadline(vm, vm->frame_end);
+            cpu_65xx_run(&vm->cpu, (int)((deadline + T_CPU_MULTIPLIER - 1) /
+                                         T_CPU_MULTIPLIER - vm->cpu.cycles));
+        }
+        if (variant == LOOP_DEBUG) {
+            check_trace_trigger(vm);
+        }
+    }
+    catch_up_as(vm, vm->frame_end, variant);
+}
+
+bool machine_init(Machine *vm, FCartInfo *carti, Driver *driver) {
     memset(vm, 0, sizeof(Machine));
     
     vm->input = &driver->input;
+    vm->dbg_map = driver->dbg_map;
     
     vm->cart.prg_rom = carti->prg_rom;
     vm->cart.chr_memory = carti->chr_rom;
     vm->cart.has_battery_backup = carti->has_battery_backup;
-
+    
     memory_map_cpu_init(&vm->cpu_mm, vm);
     memory_map_ppu_init(&vm->ppu_mm, vm);
-    cpu_65xx_init(&vm->cpu, &vm->cpu_mm, (CPU65xxReadFuncPtr)mm_read,
-                                         (CPU65xxWriteFuncPtr)mm_write);
+    cpu_65xx_init(&vm->cpu, &vm->cpu_mm, (CPU65xxReadFuncPtr)read_cpu,
+                                         (CPU65xxWriteFuncPtr)write_cpu);
+    cpu_65xx_set_code_map(&vm->cpu, (CPU65xxCodeFuncPtr)get_code,
+                          &vm->generations[REGION_PRG], &vm->cpu_mm.last_read);
+    cpu_65xx_set_direct_ram(&vm->cpu, vm->wram, MASK_WRAM, 0x2000);
     ppu_init(&vm->ppu, &vm->ppu_mm, &vm->cpu, &driver->input.lightgun_pos);
     apu_init(&vm->apu, &vm->cpu, driver->audio_buffer, &driver->audio_pos);
     
-    if (!vm->cart.chr_memory.size) {
-        vm->cart.chr_memory.size = SIZE_CHR_ROM;
-        vm->cart.chr_is_ram = true;
-        vm->cart.chr_memory.data = malloc(SIZE_CHR_ROM);
-        memset(vm->cart.chr_memory.data, 0, SIZE_CHR_ROM);
-    }
-    
     machine_set_nt_mirroring(vm, carti->default_mirroring);
-    mapper_init(vm, carti->mapper_id);
+    if (!mapper_init(vm, carti->mapper_id)) {
+        return false;
+    }
     
     cpu_65xx_reset(&vm->cpu, false);
+    return true;
 }
 
 void machine_teardown(Machine *vm) {
+    cpu_65xx_teardown(&vm->cpu);
+    memory_map_teardown(&vm->cpu_mm);
+    memory_map_teardown(&vm->ppu_mm);
+    
+    if (vm->trace) {
+        free(vm->trace);
+    }
+    if (vm->profile) {
+        if (profile_save(vm->profile, vm->dbg_map, vm->profile_path)) {
+            eprintf("Saved profile to %s\n", vm->profile_path);
+        }
+        free(vm->profile);
+    }
+    
     // TODO: Save SRAM
     if (vm->cart.sram.data) {
         free(vm->cart.sram.data);
     }
     
-    if (vm->cart.chr_is_ram) {
-        free(vm->cart.chr_memory.data);
-    }
+    mapper_teardown(vm);
 }
 
 void machine_advance_frame(Machine *vm, int frame, bool verbose) {
-    vm->ppu.current_screen = frame & 1;
+    vm->verbose = verbose;
+    start_frame(vm, frame);
+    switch (vm->variant) {
+        case LOOP_RELEASE:
+            run_frame(vm, LOOP_RELEASE);
+            break;
+        case LOOP_LIGHTGUN:
+            run_frame(vm, LOOP_LIGHTGUN);
+            break;
+        case LOOP_DEBUG:
+            run_frame(vm, LOOP_DEBUG);
+            break;
+    }
+}
+
+bool machine_batch_init(MachineBatch *mb, Machine **vms, int count) {
+    CPU65xx *cpus[CPU65XX_BATCH_MAX_LANES];
+    for (int i = 0; i < count && i < CPU65XX_BATCH_MAX_LANES; i++) {
+        cpus[i] = &vms[i]->cpu;
+    }
+    mb->cpus = cpu_65xx_batch_create(cpus, count);
+    if (!mb->cpus) {
+        return false;
+    }
+    mb->vms = vms;
+    mb->count = count;
+    mb->budgets = calloc(count, sizeof(int));
+    return true;
+}
+
+void machine_batch_teardown(MachineBatch *mb) {
+    cpu_65xx_batch_free(mb->cpus);
+    free(mb->budgets);
+}
+
+void machine_batch_advance_frame(MachineBatch *mb, int frame) {
+    for (int i = 0; i < mb->count; i++) {
+        mb->vms[i]->verbose = false;
+        start_frame(mb->vms[i], frame);
+    }
     
-    // TODO: Skip last cycle of the pre-render line on odd frames
-    RenderPos pos = {-1, 0};
-    do {
-        do {
-            if (!vm->cpu_wait) {
-                // Check for debug label
-                bool is_endless_loop = false;
-                if (verbose && vm->dbg_map) {
-                    int i = 0;
-                    while (vm->dbg_map[i].label[0]) {
-                        if (vm->dbg_map[i].addr == vm->cpu.pc) {
-                            const char *label = vm->dbg_map[i].label;
-                            if (strcmp(label, "EndlessLoop")) {
-                                printf(":%s\n", vm->dbg_map[i].label);
-                            } else {
-                                is_endless_loop = true;
-                            }
-                            break;
-                        }
-                        i++;
-                    }
-                }
-                vm->cpu_wait = cpu_65xx_step(&vm->cpu,
-                                             verbose && !is_endless_loop) *
-                               T_CPU_MULTIPLIER;
-            }
-            
-            if (!(vm->mclk % T_APU_MULTIPLIER)) {
-                apu_step(&vm->apu);
-            }
-            // Yeah this needs to be done better
-            if (!(vm->mclk % 121)) {
-                apu_sample(&vm->apu);
+    // Same loop as a single machine, with all the runs done at once
+    bool is_running = true;
+    while (is_running) {
+        is_running = false;
+        for (int i = 0; i < mb->count; i++) {
+            Machine *vm = mb->vms[i];
+            mb->budgets[i] = 0;
+            if (get_cpu_time(vm) >= vm->frame_end) {
+                continue;
             }
+            catch_up(vm, get_cpu_time(vm));
+            uint64_t deadline = get_deadline(vm, vm->frame_end);
+            mb->budgets[i] = (int)((deadline + T_CPU_MULTIPLIER - 1) /
+                                   T_CPU_MULTIPLIER - vm->cpu.cycles);
+            is_running = true;
+        }
+        cpu_65xx_batch_run(mb->cpus, mb->budgets);
+        for (int i = 0; i < mb->count; i++) {
+            check_trace_trigger(mb->vms[i]);
+        }
+    }
+    for (int i = 0; i < mb->count; i++) {
+        catch_up(mb->vms[i], mb->vms[i]->frame_end);
+    }
+}
+
+void machine_start_trace(Machine *vm, const char *path, int trigger) {
+    vm->trace = malloc(sizeof(Trace));
+    trace_init(vm->trace, trigger);
+    vm->trace_path = path;
+    cpu_65xx_set_trace(&vm->cpu, vm->trace);
+}
 
-            ppu_step(&vm->ppu, &pos, verbose);
-            
-            ++vm->mclk;
-            --vm->cpu_wait;
-        } while (++pos.cycle < PPU_CYCLES_PER_SCANLINE);
-        pos.cycle = 0;
-    } while (++pos.scanline < (PPU_SCANLINES_PER_FRAME - 1));
+void machine_dump_trace(Machine *vm) {
+    if (!vm->trace) {
+        return;
+    }
+    
+    // Frames always start at cycle 0 of the pre-render line, and the PPU has
+    // caught up to the dot before the instruction starts
+    const int frame_length = PPU_CYCLES_PER_SCANLINE * PPU_SCANLINES_PER_FRAME;
+    int length = trace_get_length(vm->trace);
+    for (int i = 0; i < length; i++) {
+        TraceEntry *entry = trace_get_entry(vm->trace, i);
+        uint64_t dot = entry->cycle * T_CPU_MULTIPLIER + frame_length - 1;
+        entry->scanline = (dot % frame_length) / PPU_CYCLES_PER_SCANLINE - 1;
+    }
+    if (trace_save(vm->trace, vm->trace_path)) {
+        eprintf("Saved %d trace entries to %s\n", length, vm->trace_path);
+    }
+}
+
+void machine_start_profile(Machine *vm, const char *path) {
+    vm->profile = malloc(sizeof(Profile));
+    profile_init(vm->profile, (ProfileBankFuncPtr)get_prg_bank, vm,
+                 &vm->generations[REGION_PRG]);
+    vm->profile_path = path;
+    cpu_65xx_set_profile(&vm->cpu, vm->profile);
+}
+
+void machine_invalidate(Machine *vm, BusRegion region) {
+    vm->generations[region]++;
 }
 
 void machine_set_nt_mirroring(Machine *vm, NametableMirroring nm) {
@@ -99,12 +374,30 @@ void machine_set_nt_mirroring(Machine *vm, NametableMirroring nm) {
         0, 1, 2, 3, // FOUR
     };
     const int *layout = layouts + nm * 4;
+    uint8_t *nt_layout[4];
+    for (int i = 0; i < 4; i++) {
+        nt_layout[i] = vm->nametables[layout[i]];
+    }
+    machine_set_nt_layout(vm, nt_layout, true);
+}
+
+void machine_set_nt_layout(Machine *vm, uint8_t *const layout[4],
+                           bool is_writable) {
+    // PPU 2000-3EFF: Nametables (3000-3EFF mirrors 2000-2EFF)
     for (int i = 0; i < 4; i++) {
-        vm->nt_layout[i] = vm->nametables[layout[i]];
+        vm->nt_layout[i] = layout[i];
+        for (int addr = 0x2000 + i * SIZE_NAMETABLE; addr < 0x3F00;
+             addr += 0x1000) {
+            int size = (addr + SIZE_NAMETABLE > 0x3F00 ? 0x3F00 - addr
+                                                        : SIZE_NAMETABLE);
+            mm_map_memory(&vm->ppu_mm, addr, size, layout[i],
+                          (is_writable ? layout[i] : NULL));
+        }
     }
+    machine_invalidate(vm, REGION_NAMETABLES);
 }
 
 void machine_stall_cpu(Machine *vm, int cycles) {
     // TODO: +1 if on a odd CPU cycle
-    vm->cpu_wait += cycles * T_CPU_MULTIPLIER;
+    vm->cpu.cycles += cycles;
 }
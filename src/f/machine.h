@@ -4,6 +4,7 @@
 #include "../common.h"
 
 #include "../cpu/65xx.h"
+#include "../debug_map.h"
 #include "apu.h"
 #include "cartridge.h"
 #include "memory_maps.h"
@@ -35,10 +36,22 @@ typedef enum {
     IRQ_MAPPER,
 } IRQFlag;
 
-typedef struct {
-    uint16_t addr;
-    char label[256];
-} DebugMap;
+// Specializations of the frame loop, picked at the start of each frame so that
+// the release one has no debug checks at all
+typedef enum {
+    LOOP_RELEASE = 0,
+    LOOP_LIGHTGUN, // With the lightgun sensor
+    LOOP_DEBUG, // Also verbose output and trace triggers
+} LoopVariant;
+
+// Parts of the buses that caches may be built on. Their generation changes
+// whenever an address in them gets remapped, or the memory behind it written.
+typedef enum {
+    REGION_PRG = 0, // CPU 8000-FFFF: PRG banks
+    REGION_CHR, // PPU 0000-1FFF: CHR banks and CHR RAM
+    REGION_NAMETABLES, // PPU 2000-3EFF: Nametable layout and contents
+    REGIONS_LEN,
+} BusRegion;
 
 typedef struct Machine {
     CPU65xx cpu;
@@ -50,20 +63,44 @@ typedef struct Machine {
     
     const DebugMap *dbg_map;
     
+    // Instruction trace and profile (optional)
+    Trace *trace;
+    const char *trace_path;
+    Profile *profile;
+    const char *profile_path;
+    
     // System RAM
     uint8_t wram[SIZE_WRAM];
     uint8_t nametables[4][SIZE_NAMETABLE];
     uint8_t *nt_layout[4];
     
+    // Cache invalidation
+    unsigned generations[REGIONS_LEN];
+    
     // Controller I/O
     uint8_t ctrl_latch[2];
     InputState *input;
     
     // Time tracking
-    uint64_t mclk; // "Master" clock (actually PPU clock)
-    int cpu_wait;
+    uint64_t mclk; // "Master" clock (actually PPU clock), the CPU runs ahead
+    uint64_t frame_end;
+    RenderPos pos;
+    bool verbose;
+    LoopVariant variant;
+    
+    // Runs the CPU cycle by cycle, in lockstep with the PPU and the APU
+    bool is_cycle_accurate;
 } Machine;
 
+// Machines running the same ROM data through frames together, with their CPUs
+// batched (see cpu_65xx_batch_run). Never verbose nor cycle accurate.
+typedef struct MachineBatch {
+    Machine **vms;
+    int count;
+    CPU65xxBatch *cpus;
+    int *budgets;
+} MachineBatch;
+
 typedef enum {
     NT_SINGLE_A = 0,
     NT_SINGLE_B = 1,
@@ -72,12 +109,30 @@ typedef enum {
     NT_FOUR = 4,
 } NametableMirroring;
 
-void machine_init(Machine *vm, FCartInfo *carti, Driver *driver);
+bool machine_init(Machine *vm, FCartInfo *carti, Driver *driver);
 void machine_teardown(Machine *vm);
 
 void machine_advance_frame(Machine *vm, int frame, bool verbose);
 
+// Returns false when there are too many machines
+bool machine_batch_init(MachineBatch *mb, Machine **vms, int count);
+void machine_batch_teardown(MachineBatch *mb);
+// Same as machine_advance_frame on each machine
+void machine_batch_advance_frame(MachineBatch *mb, int frame);
+
+// The trace gets dumped to path on request, or when trigger gets executed
+void machine_start_trace(Machine *vm, const char *path, int trigger);
+void machine_dump_trace(Machine *vm);
+// The profile gets saved to path on teardown
+void machine_start_profile(Machine *vm, const char *path);
+
+// Bumps the generation of region, for the caches built on it to check
+void machine_invalidate(Machine *vm, BusRegion region);
+
 void machine_set_nt_mirroring(Machine *vm, NametableMirroring m);
+// Maps any memory as the four nametables, read-only unless is_writable
+void machine_set_nt_layout(Machine *vm, uint8_t *const layout[4],
+                           bool is_writable);
 
 void machine_stall_cpu(Machine *vm, int cycles);
 
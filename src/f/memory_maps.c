@@ -9,22 +9,60 @@ static void init_common(MemoryMap *mm, Machine *vm) {
     mm->vm = vm;
 }
 
-static void write_open_bus(Machine *vm, uint16_t addr, uint8_t value) {
-    // Does nothing, obviously
-}
+// PAGES //
+
+static void update_page(MemoryMap *mm, int index) {
+    const MemoryPage *page = &mm->pages[index];
+    mm->direct_read[index] = (page->read || page->reads ? NULL
+                                                        : page->read_mem);
+    mm->direct_write[index] = (page->write || page->writes ? NULL
+                                                           : page->write_mem);
+}
+
+// Sets the handler of the addresses from first to last that match on mask,
+// splitting the page only if they don't cover it, and merging it back once
+// all of its addresses have the same handler
+#define DEFINE_MAP_PAGE(name, type, func, funcs) \
+    static void name(MemoryPage *page, int first, int last, int match, \
+                     int mask, type value) { \
+        mask &= MASK_MM_PAGE; \
+        if (!first && last == MASK_MM_PAGE && !mask) { \
+            free(page->funcs); \
+            page->funcs = NULL; \
+            page->func = value; \
+            return; \
+        } \
+        if (!page->funcs) { \
+            if (page->func == value) { \
+                return; \
+            } \
+            page->funcs = malloc(MM_PAGE_SIZE * sizeof(type)); \
+            for (int i = 0; i < MM_PAGE_SIZE; i++) { \
+                page->funcs[i] = page->func; \
+            } \
+            page->func = NULL; \
+        } \
+        for (int i = first; i <= last; i++) { \
+            if (!((i ^ match) & mask)) { \
+                page->funcs[i] = value; \
+            } \
+        } \
+        for (int i = 1; i < MM_PAGE_SIZE; i++) { \
+            if (page->funcs[i] != page->funcs[0]) { \
+                return; \
+            } \
+        } \
+        page->func = page->funcs[0]; \
+        free(page->funcs); \
+        page->funcs = NULL; \
+    }
 
-// CPU MEMORY MAP ACCESSES //
+DEFINE_MAP_PAGE(map_page_read, ReadFuncPtr, read, reads)
+DEFINE_MAP_PAGE(map_page_write, WriteFuncPtr, write, writes)
 
-static uint8_t read_cpu_open_bus(Machine *vm, uint16_t addr) {
-    return vm->cpu_mm.last_read;
-}
+#undef DEFINE_MAP_PAGE
 
-static uint8_t read_wram(Machine *vm, uint16_t addr) {
-    return vm->wram[addr & MASK_WRAM];
-}
-static void write_wram(Machine *vm, uint16_t addr, uint8_t value) {
-    vm->wram[addr & MASK_WRAM] = value;
-}
+// CPU MEMORY MAP ACCESSES //
 
 static uint8_t read_controllers(Machine *vm, uint16_t addr) {
     int port = addr & 1;
@@ -45,40 +83,21 @@ static void write_controller_latch(Machine *vm, uint16_t addr, uint8_t value) {
     }
 }
 
-// PPU MEMORY MAP ACCESSES //
-
-static uint8_t read_ppu_open_bus(Machine *vm, uint16_t addr) {
-    return vm->ppu_mm.last_read;
-}
-
-static uint8_t read_nametables(Machine *vm, uint16_t addr) {
-    return vm->nt_layout[(addr >> 10) & 3][addr & MASK_NAMETABLE];
-}
-static void write_nametables(Machine *vm, uint16_t addr, uint8_t value) {
-    vm->nt_layout[(addr >> 10) & 3][addr & MASK_NAMETABLE] = value;
-}
-
 // PUBLIC FUNCTIONS //
 
 void memory_map_cpu_init(MemoryMap *mm, Machine *vm) {
     init_common(mm, vm);
     mm->addr_mask = 0xFFFF;
     
-    for (int i = 0; i < 0x10000; i++) {
-        mm->read[i] = read_cpu_open_bus;
-        mm->write[i] = write_open_bus;
-    }
-    
-    // Populate the address map
+    // Populate the address map, everything else is open bus
     // 0000-1FFF: WRAM (2kB, repeated)
-    for (int i = 0; i < 0x2000; i++) {
-        mm->read[i] = read_wram;
-        mm->write[i] = write_wram;
+    for (int i = 0; i < 0x2000; i += SIZE_WRAM) {
+        mm_map_memory(mm, i, SIZE_WRAM, vm->wram, vm->wram);
     }
     // 2000-4015: PPU and APU registers, defined by their respective inits
     // 4016-4017: Controller I/O
-    mm->read[0x4016] = mm->read[0x4017] = read_controllers;
-    mm->write[0x4016] = write_controller_latch;
+    mm_map_range(mm, 0x4016, 0x4017, read_controllers, NULL, 0);
+    mm_map_range(mm, 0x4016, 0x4016, NULL, write_controller_latch, 0);
     // 4018-401F: Test mode registers, not implemented
     // 4020-FFFF: Cartridge I/O, defined by the mapper's init
 }
@@ -87,34 +106,82 @@ void memory_map_ppu_init(MemoryMap *mm, Machine *vm) {
     init_common(mm, vm);
     mm->addr_mask = 0x3FFF;
     
-    for (int i = 0; i < 0x10000; i++) {
-        mm->read[i] = read_ppu_open_bus;
-        mm->write[i] = write_open_bus;
-    }
-    
-    // Populate the address map
+    // Populate the address map, everything else is open bus
     // 0000-1FFF: Cartridge I/O, defined by the mapper's init
-    // 2000-3EFF: Nametables
-    for (int i = 0x2000; i < 0x3F00; i++) {
-        mm->read[i] = read_nametables;
-        mm->write[i] = write_nametables;
-    }
+    // 2000-3EFF: Nametables, mapped by machine_set_nt_mirroring()
     // 3F00-3FFF: Palettes, defined by ppu_init()
     // 4000-FFFF: Over the 14 bit range
 }
 
-uint8_t mm_read(MemoryMap *mm, uint16_t addr) {
-    addr &= mm->addr_mask;
-    mm->last_read = (mm->read[addr])(mm->vm, addr);
+void memory_map_teardown(MemoryMap *mm) {
+    for (int i = 0; i < MM_PAGES; i++) {
+        free(mm->pages[i].reads);
+        free(mm->pages[i].writes);
+    }
+}
+
+void mm_map_memory(MemoryMap *mm, uint16_t addr, int size, uint8_t *read_mem,
+                   uint8_t *write_mem) {
+    for (int i = 0; i < size; i += MM_PAGE_SIZE) {
+        int index = (addr + i) >> MM_PAGE_BITS;
+        mm->pages[index].read_mem = (read_mem ? read_mem + i : NULL);
+        mm->pages[index].write_mem = (write_mem ? write_mem + i : NULL);
+        update_page(mm, index);
+    }
+}
+
+void mm_map_range(MemoryMap *mm, uint16_t start, uint16_t end,
+                  ReadFuncPtr read, WriteFuncPtr write, uint16_t mirror_mask) {
+    for (int index = start >> MM_PAGE_BITS; index <= end >> MM_PAGE_BITS;
+         index++) {
+        // Whole pages may be out of the mirrors
+        int base = index << MM_PAGE_BITS;
+        if ((base ^ start) & mirror_mask & ~MASK_MM_PAGE) {
+            continue;
+        }
+        int first = (base < start ? start - base : 0);
+        int last = (base + MASK_MM_PAGE > end ? end - base : MASK_MM_PAGE);
+        MemoryPage *page = &mm->pages[index];
+        if (read) {
+            map_page_read(page, first, last, start, mirror_mask, read);
+        }
+        if (write) {
+            map_page_write(page, first, last, start, mirror_mask, write);
+        }
+        update_page(mm, index);
+    }
+}
+
+WriteFuncPtr mm_get_write(MemoryMap *mm, uint16_t addr) {
+    const MemoryPage *page = &mm->pages[addr >> MM_PAGE_BITS];
+    return (page->writes ? page->writes[addr & MASK_MM_PAGE] : page->write);
+}
+
+uint8_t mm_read_handler(MemoryMap *mm, uint16_t addr) {
+    const MemoryPage *page = &mm->pages[addr >> MM_PAGE_BITS];
+    ReadFuncPtr func = (page->reads ? page->reads[addr & MASK_MM_PAGE]
+                                    : page->read);
+    if (func) {
+        return (*func)(mm->vm, addr);
+    }
+    if (page->read_mem) {
+        return page->read_mem[addr & MASK_MM_PAGE];
+    }
     return mm->last_read;
 }
 uint16_t mm_read_word(MemoryMap *mm, uint16_t addr) {
     return (uint16_t)mm_read(mm, addr) | ((uint16_t)mm_read(mm, addr + 1) << 8);
 }
 
-void mm_write(MemoryMap *mm, uint16_t addr, uint8_t value) {
-    addr &= mm->addr_mask;
-    (mm->write[addr])(mm->vm, addr, value);
+void mm_write_handler(MemoryMap *mm, uint16_t addr, uint8_t value) {
+    const MemoryPage *page = &mm->pages[addr >> MM_PAGE_BITS];
+    WriteFuncPtr func = (page->writes ? page->writes[addr & MASK_MM_PAGE]
+                                      : page->write);
+    if (func) {
+        (*func)(mm->vm, addr, value);
+    } else if (page->write_mem) {
+        page->write_mem[addr & MASK_MM_PAGE] = value;
+    }
 }
 void mm_write_word(MemoryMap *mm, uint16_t addr, uint16_t value) {
     mm_write(mm, addr, value & 0xff);
@@ -5,27 +5,82 @@
 
 #define MASK_COLOR 0b111111
 
+// Page granularity of the maps
+#define MM_PAGE_BITS 8
+#define MM_PAGE_SIZE (1 << MM_PAGE_BITS)
+#define MASK_MM_PAGE (MM_PAGE_SIZE - 1)
+#define MM_PAGES (0x10000 >> MM_PAGE_BITS)
+
 // Forward declarations
 typedef struct Machine Machine;
 
 typedef uint8_t (*ReadFuncPtr)(Machine *, uint16_t);
 typedef void (*WriteFuncPtr)(Machine *, uint16_t, uint8_t);
 
+// Handlers take precedence over the memory behind a page, and pages without
+// either are open bus. A page with different handlers per address gets a
+// table of them (where NULL means the memory) instead of a single one.
+typedef struct MemoryPage {
+    uint8_t *read_mem;
+    uint8_t *write_mem;
+    ReadFuncPtr read;
+    WriteFuncPtr write;
+    ReadFuncPtr *reads;
+    WriteFuncPtr *writes;
+} MemoryPage;
+
 typedef struct MemoryMap {
     Machine *vm;
     uint8_t last_read;
     uint16_t addr_mask;
-    ReadFuncPtr read[0x10000];
-    WriteFuncPtr write[0x10000];
+    
+    // Host memory of the pages that are accessed directly, else NULL
+    uint8_t *direct_read[MM_PAGES];
+    uint8_t *direct_write[MM_PAGES];
+    MemoryPage pages[MM_PAGES];
 } MemoryMap;
 
 void memory_map_cpu_init(MemoryMap *mm, Machine *vm);
 void memory_map_ppu_init(MemoryMap *mm, Machine *vm);
+void memory_map_teardown(MemoryMap *mm);
+
+// Points size bytes from addr (whole pages) to host memory, which may be NULL
+// for either side (open bus), without changing the handlers
+void mm_map_memory(MemoryMap *mm, uint16_t addr, int size, uint8_t *read_mem,
+                   uint8_t *write_mem);
+
+// Sets the handlers from start to end (inclusive), leaving the side that is
+// NULL alone. Only the addresses that match start on the bits of mirror_mask
+// get them: 0 maps the whole range, 0xE001 every other address of each 8kB.
+void mm_map_range(MemoryMap *mm, uint16_t start, uint16_t end,
+                  ReadFuncPtr read, WriteFuncPtr write, uint16_t mirror_mask);
+WriteFuncPtr mm_get_write(MemoryMap *mm, uint16_t addr);
+
+// Only for the pages that aren't accessed directly
+uint8_t mm_read_handler(MemoryMap *mm, uint16_t addr);
+void mm_write_handler(MemoryMap *mm, uint16_t addr, uint8_t value);
 
-uint8_t mm_read(MemoryMap *mm, uint16_t addr);
+static inline uint8_t mm_read(MemoryMap *mm, uint16_t addr) {
+    addr &= mm->addr_mask;
+    const uint8_t *mem = mm->direct_read[addr >> MM_PAGE_BITS];
+    if (mem) {
+        mm->last_read = mem[addr & MASK_MM_PAGE];
+    } else {
+        mm->last_read = mm_read_handler(mm, addr);
+    }
+    return mm->last_read;
+}
 uint16_t mm_read_word(MemoryMap *mm, uint16_t addr);
 
-void mm_write(MemoryMap *mm, uint16_t addr, uint8_t value);
+static inline void mm_write(MemoryMap *mm, uint16_t addr, uint8_t value) {
+    addr &= mm->addr_mask;
+    uint8_t *mem = mm->direct_write[addr >> MM_PAGE_BITS];
+    if (mem) {
+        mem[addr & MASK_MM_PAGE] = value;
+    } else {
+        mm_write_handler(mm, addr, value);
+    }
+}
 void mm_write_word(MemoryMap *mm, uint16_t addr, uint16_t value);
 
 #endif /* f_memory_maps_h */
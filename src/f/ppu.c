@@ -1,6 +1,7 @@
 #include "ppu.h"
 
 #include "../cpu/65xx.h"
+#include "compose.h"
 #include "machine.h"
 #include "memory_maps.h"
 
@@ -60,6 +61,35 @@ static const uint8_t bit_reverse[] =
     R6(0), R6(2), R6(1), R6(3)
 };
 
+// Other channels get dimmed by each emphasized one, to about 75%
+#define EMPHASIS_FACTOR 191
+
+static void build_rgb_palette(uint32_t *rgb_palette, const uint32_t *colors) {
+    for (int i = 0; i < PIXEL_VALUES; i++) {
+        int emphasis = i >> PIXEL_EMPHASIS_SHIFT;
+        uint32_t rgb = colors[i & MASK_COLOR];
+        rgb_palette[i] = 0;
+        // Emphasis bits are red, green and blue, channels are the other way
+        for (int c = 0; c < 3; c++) {
+            uint32_t value = (rgb >> ((2 - c) * 8)) & 0xFF;
+            for (int e = 0; e < 3; e++) {
+                if (e != c && emphasis & (1 << e)) {
+                    value = value * EMPHASIS_FACTOR / 256;
+                }
+            }
+            rgb_palette[i] |= value << ((2 - c) * 8);
+        }
+    }
+}
+
+// Greyscale keeps only the brightness column of the palette
+static inline uint16_t get_pixel(const PPU *ppu, int color) {
+    if (ppu->mask & MASK_GREYSCALE) {
+        color &= 0x30;
+    }
+    return color | ((ppu->mask >> 5) << PIXEL_EMPHASIS_SHIFT);
+}
+
 static inline void increment_mm_addr(PPU *ppu) {
     ppu->v += (ppu->ctrl & CTRL_ADDR_INC_32 ? 32 : 1);
 }
@@ -70,7 +100,9 @@ static inline bool is_rendering(PPU *ppu) {
 
 // CYCLE TASKS //
 
-static void task_render_pixel(PPU *ppu, const RenderPos *pos) {
+// Inlined into each step variant, so the lightgun check is only in one
+static ALWAYS_INLINE void task_render_pixel(PPU *ppu, const RenderPos *pos,
+                                            bool has_lightgun) {
     int s_index = 0;
     uint8_t s_attrs = 0;
     bool s_is_zero = false;
@@ -123,45 +155,39 @@ static void task_render_pixel(PPU *ppu, const RenderPos *pos) {
         }
         
         int pixel = (pos->scanline - HEIGHT_CROPPED_BEGIN) * WIDTH + pos->cycle;
-        ppu->screens[ppu->current_screen][pixel] = colors_ntsc[color];
-        if (pixel == *ppu->lightgun_pos && (color == 0x20 || color == 0x30)) {
+        ppu->screens[ppu->current_screen][pixel] = get_pixel(ppu, color);
+        if (has_lightgun && pixel == *ppu->lightgun_pos &&
+            (color == 0x20 || color == 0x30)) {
             ppu->lightgun_sensor = LIGHTGUN_COOLDOWN;
         }
     }
-
+    
     ppu->bg_at0 <<= 1;
     ppu->bg_at1 <<= 1;
     ppu->bg_pt0 <<= 1;
     ppu->bg_pt1 <<= 1;
 }
 
-static void task_sprite_clear(PPU *ppu, const RenderPos *pos) {
-    if (pos->scanline < 0) {
-        return;
-    }
-    memset(ppu->oam2, 0xFF, sizeof(ppu->oam2));
-    ppu->s_total = 0;
-}
-
+// The index already knows the sprites in range, the first 8 in OAM get copied
 static void task_sprite_eval(PPU *ppu, const RenderPos *pos) {
     if (pos->scanline < 0) {
         return;
     }
-    const uint8_t *spr = ppu->oam + ((pos->cycle - 65) / 3 * 4);
-    const int sprite_height = (ppu->ctrl & CTRL_8x16_SPRITES ? 16 : 8);
-    if (spr[OAM_Y] <= pos->scanline &&
-        (spr[OAM_Y] + sprite_height - 1) >= pos->scanline) {
-        if (ppu->s_total >= 8) {
-            // Not accurate behaviour, but very rarely used
-            ppu->status |= STATUS_SPRITE_OVERFLOW;
-        } else {
-            memcpy(ppu->oam2 + (ppu->s_total * 4), spr, 4);
-            ppu->s_total++;
-        }
-    }
-    if (spr == ppu->oam) {
-        ppu->s_has_zero_next = ppu->s_total;
-    }
+    uint64_t sprites = ppu->sprite_lines[pos->scanline];
+    ppu->s_has_zero_next = sprites & 1;
+    ppu->s_total = 0;
+    while (sprites && ppu->s_total < 8) {
+        int i = __builtin_ctzll(sprites);
+        memcpy(ppu->oam2 + (ppu->s_total * 4), ppu->oam + (i * 4), 4);
+        ppu->s_total++;
+        sprites &= sprites - 1;
+    }
+    if (sprites) {
+        // Not accurate behaviour, but very rarely used
+        ppu->status |= STATUS_SPRITE_OVERFLOW;
+    }
+    memset(ppu->oam2 + (ppu->s_total * 4), 0xFF,
+           sizeof(ppu->oam2) - (ppu->s_total * 4));
 }
 
 static void task_fetch_nt(PPU *ppu, const RenderPos *pos) {
@@ -174,12 +200,27 @@ static void task_fetch_at(PPU *ppu, const RenderPos *pos) {
                                           ((ppu->v >> 2) & 0x07));
 }
 
-static uint8_t fetch_bg_pt(PPU *ppu, int offset) {
-    uint16_t pt_addr = (ppu->f_nt << 4) | ((ppu->v & 0x7000) >> 12) | offset;
+static uint16_t get_bg_pt_addr(PPU *ppu) {
+    uint16_t pt_addr = (ppu->f_nt << 4) | ((ppu->v & 0x7000) >> 12);
     if (ppu->ctrl & CTRL_PT_BACKGROUND) {
         pt_addr |= (1 << 12);
     }
-    return mm_read(ppu->mm, pt_addr);
+    return pt_addr;
+}
+
+static uint8_t fetch_bg_pt(PPU *ppu, int offset) {
+    return mm_read(ppu->mm, get_bg_pt_addr(ppu) | offset);
+}
+
+// Picks the palette of the fetched tile out of its attribute byte
+static int get_bg_palette(PPU *ppu) {
+    int offset;
+    if (((ppu->v >> 5) & 0b11) > 1) {
+        offset = ((ppu->v & 0b11) > 1 ? 6 : 4);
+    } else {
+        offset = ((ppu->v & 0b11) > 1 ? 2 : 0);
+    }
+    return (ppu->f_at >> offset) & 0b11;
 }
 
 static void task_fetch_bg_pt0(PPU *ppu, const RenderPos *pos) {
@@ -188,7 +229,7 @@ static void task_fetch_bg_pt0(PPU *ppu, const RenderPos *pos) {
 
 static void task_fetch_bg_pt1(PPU *ppu, const RenderPos *pos) {
     ppu->f_pt1 = fetch_bg_pt(ppu, 8);
-
+    
     // Fill the stacks
     if (pos->cycle > 256) {
         ppu->bg_pt0 <<= 8;
@@ -200,13 +241,7 @@ static void task_fetch_bg_pt1(PPU *ppu, const RenderPos *pos) {
     ppu->bg_pt0 |= ppu->f_pt0;
     ppu->bg_pt1 |= ppu->f_pt1;
     
-    int offset;
-    if (((ppu->v >> 5) & 0b11) > 1) {
-        offset = ((ppu->v & 0b11) > 1 ? 6 : 4);
-    } else {
-        offset = ((ppu->v & 0b11) > 1 ? 2 : 0);
-    }
-    int at = (ppu->f_at >> offset) & 0b11;
+    int at = get_bg_palette(ppu);
     if (at & 1) {
         ppu->bg_at0 |= 0xFF;
     }
@@ -300,6 +335,82 @@ static void task_update_vert_v_vert_t(PPU *ppu,
     }
 }
 
+// CHR TILE CACHE //
+
+// Spreads the two planes of a pattern row to a color index per pixel
+static void decode_row(uint8_t pt0, uint8_t pt1, uint8_t *pixels) {
+    for (int i = 0; i < 8; i++) {
+        pixels[i] = ((pt0 >> (7 - i)) & 1) | (((pt1 >> (7 - i)) & 1) << 1);
+    }
+}
+
+// Returns the row of the pattern at addr decoded, or NULL when its page has a
+// handler, as then reading it may have side effects (ie. mapper latches)
+static const uint8_t *get_chr_row(PPU *ppu, uint16_t addr) {
+    const uint8_t *data = ppu->mm->direct_read[addr >> MM_PAGE_BITS];
+    if (!data) {
+        return NULL;
+    }
+    ChrCachePage *page = &ppu->chr_cache[addr >> MM_PAGE_BITS];
+    if (page->data != data) {
+        // Another bank got selected
+        page->data = data;
+        page->valid = 0;
+    }
+    int tile = (addr >> 4) & (CHR_CACHE_TILES - 1);
+    if (!(page->valid & (1 << tile))) {
+        const uint8_t *pt = data + tile * 16;
+        for (int row = 0; row < 8; row++) {
+            decode_row(pt[row], pt[row + 8], page->rows[tile][row]);
+        }
+        page->valid |= 1 << tile;
+    }
+    return page->rows[tile][addr & 7];
+}
+
+// Drops the tile at addr from every page that maps the same memory
+static void invalidate_chr_tile(PPU *ppu, uint16_t addr) {
+    const uint8_t *data = ppu->mm->pages[addr >> MM_PAGE_BITS].write_mem;
+    int tile = (addr >> 4) & (CHR_CACHE_TILES - 1);
+    for (int i = 0; i < CHR_CACHE_PAGES; i++) {
+        if (ppu->chr_cache[i].data == data) {
+            ppu->chr_cache[i].valid &= ~(1 << tile);
+        }
+    }
+}
+
+// SPRITE INDEX //
+
+// Adds or removes sprite i on the scanlines that it covers from y
+static void index_sprite(PPU *ppu, int i, uint8_t y, bool add) {
+    const int sprite_height = (ppu->ctrl & CTRL_8x16_SPRITES ? 16 : 8);
+    const uint64_t bit = (uint64_t)1 << i;
+    for (int line = y; line < y + sprite_height && line < HEIGHT_REAL;
+         line++) {
+        if (add) {
+            ppu->sprite_lines[line] |= bit;
+        } else {
+            ppu->sprite_lines[line] &= ~bit;
+        }
+    }
+}
+
+// To be called before the Y of sprite i changes in OAM
+static void move_sprite(PPU *ppu, int i, uint8_t y) {
+    uint8_t old_y = ppu->oam[i * 4 + OAM_Y];
+    if (y != old_y) {
+        index_sprite(ppu, i, old_y, false);
+        index_sprite(ppu, i, y, true);
+    }
+}
+
+static void rebuild_sprite_index(PPU *ppu) {
+    memset(ppu->sprite_lines, 0, sizeof(ppu->sprite_lines));
+    for (int i = 0; i < 64; i++) {
+        index_sprite(ppu, i, ppu->oam[i * 4 + OAM_Y], true);
+    }
+}
+
 // MEMORY I/O //
 
 static uint8_t read_register(Machine *vm, uint16_t addr) {
@@ -326,6 +437,19 @@ static uint8_t read_register(Machine *vm, uint16_t addr) {
     return ppu->reg_latch;
 }
 
+// Palettes are left out, they aren't worth caching
+static void invalidate_written(Machine *vm, uint16_t addr) {
+    if (addr >= 0x3F00) {
+        return;
+    }
+    if (addr >= 0x2000) {
+        machine_invalidate(vm, REGION_NAMETABLES);
+    } else if (vm->cart.chr_is_ram) {
+        invalidate_chr_tile(&vm->ppu, addr);
+        machine_invalidate(vm, REGION_CHR);
+    }
+}
+
 static void write_register(Machine *vm, uint16_t addr, uint8_t value) {
     PPU *ppu = &vm->ppu;
     ppu->reg_latch = value;
@@ -337,6 +461,9 @@ static void write_register(Machine *vm, uint16_t addr, uint8_t value) {
             ppu->ctrl = value;
             ppu->t = (ppu->t & ~(0b11 << 10)) |
                      (((uint16_t)value & 0b11) << 10);
+            if ((old_ctrl ^ value) & CTRL_8x16_SPRITES) {
+                rebuild_sprite_index(ppu);
+            }
             if (!(old_ctrl & CTRL_NMI_ON_VBLANK) &&
                 value & CTRL_NMI_ON_VBLANK &&
                 ppu->status & STATUS_VBLANK) {
@@ -350,6 +477,9 @@ static void write_register(Machine *vm, uint16_t addr, uint8_t value) {
             ppu->oam_addr = value;
             break;
         case OAMDATA:
+            if ((ppu->oam_addr & 3) == OAM_Y) {
+                move_sprite(ppu, ppu->oam_addr / 4, value);
+            }
             ppu->oam[ppu->oam_addr++] = value;
             break;
         case PPUSCROLL:
@@ -374,6 +504,7 @@ static void write_register(Machine *vm, uint16_t addr, uint8_t value) {
             break;
         case PPUDATA:
             mm_write(ppu->mm, ppu->v, value);
+            invalidate_written(vm, ppu->v & ppu->mm->addr_mask);
             increment_mm_addr(ppu);
             break;
     }
@@ -388,6 +519,9 @@ static void write_oam_dma(Machine *vm, uint16_t addr, uint8_t value) {
     for (int i = 0; i < 0x100; i++) {
         page[i] = mm_read(&vm->cpu_mm, page_addr + i);
     }
+    for (int i = 0; i < 64; i++) {
+        move_sprite(&vm->ppu, i, page[i * 4 + OAM_Y]);
+    }
     memcpy(vm->ppu.oam, page, 0x100);
     machine_stall_cpu(vm, 0x200);
 }
@@ -407,6 +541,214 @@ static void write_palettes(Machine *vm, uint16_t addr, uint8_t value) {
                                                                MASK_COLOR;
 }
 
+// STEP VARIANTS //
+
+static ALWAYS_INLINE void step(PPU *ppu, const RenderPos *pos, bool verbose,
+                               bool has_lightgun) {
+    if (verbose && !pos->cycle) {
+        printf("-- Scanline %d --\n", pos->scanline);
+    }
+    
+    if (pos->scanline >= 0 && pos->scanline < HEIGHT_REAL &&
+        pos->cycle < WIDTH) {
+        task_render_pixel(ppu, pos, has_lightgun);
+    }
+    
+    // Execute all tasks for that cycle
+    if (pos->scanline < 240 && is_rendering(ppu)) {
+        for (int i = 0; i < 3; i++) {
+            if (ppu->tasks[pos->cycle][i]) {
+                (*ppu->tasks[pos->cycle][i])(ppu, pos);
+            }
+        }
+    }
+    
+    // Check for flag operations
+    if (pos->cycle == 1) {
+        switch (pos->scanline) {
+            case -1:
+                ppu->status &= ~(STATUS_VBLANK |
+                                 STATUS_SPRITE0_HIT | STATUS_SPRITE_OVERFLOW);
+                break;
+            case 241:
+                ppu->status |= STATUS_VBLANK;
+                if (ppu->ctrl & CTRL_NMI_ON_VBLANK) {
+                    ppu->cpu->nmi = true;
+                }
+                break;
+        }
+    }
+    
+    if (has_lightgun && !pos->cycle && (ppu->lightgun_sensor > 0)) {
+        ppu->lightgun_sensor--;
+    }
+}
+
+// WHOLE SCANLINES //
+
+// The sprites only come out of their shifters while the pixels get rendered,
+// so they can all be drawn ahead, the first one in OAM on top
+static void draw_sprite_pixels(const PPU *ppu, uint8_t *pixels) {
+    memset(pixels, 0, WIDTH);
+    if (!(ppu->mask & MASK_RENDER_SPRITES)) {
+        return;
+    }
+    for (int s = 7; s >= 0; s--) {
+        uint8_t attrs = ppu->s_attrs[s] & (0b11 | OAM_ATTR_UNDER_BG);
+        if (ppu->s_has_zero && !s) {
+            attrs |= SPR_PIXEL_ZERO;
+        }
+        uint8_t row[8];
+        decode_row(ppu->s_pt0[s], ppu->s_pt1[s], row);
+        for (int i = 0; i < 8 && ppu->s_x[s] + i < WIDTH; i++) {
+            if (row[i]) {
+                pixels[ppu->s_x[s] + i] = attrs | (row[i] << 2);
+            }
+        }
+    }
+    if (!(ppu->mask & MASK_NOCLIP_SPRITES)) {
+        memset(pixels, 0, 8);
+    }
+}
+
+// Same as the background fetch tasks of a tile, except that its pattern comes
+// decoded from the cache whenever that is the same as reading it
+static void fetch_tile(PPU *ppu, RenderPos *at, uint8_t *pixels) {
+    task_fetch_nt(ppu, at);
+    task_fetch_at(ppu, at);
+    uint16_t pt_addr = get_bg_pt_addr(ppu);
+    const uint8_t *row = get_chr_row(ppu, pt_addr);
+    if (row) {
+        memcpy(pixels, row, 8);
+        ppu->mm->last_read = ppu->mm->direct_read[pt_addr >> MM_PAGE_BITS]
+                                                 [(pt_addr | 8) & MASK_MM_PAGE];
+    } else {
+        uint8_t pt0 = mm_read(ppu->mm, pt_addr);
+        decode_row(pt0, mm_read(ppu->mm, pt_addr | 8), pixels);
+    }
+    int palette = get_bg_palette(ppu) << 2;
+    for (int i = 0; i < 8; i++) {
+        pixels[i] |= palette;
+    }
+}
+
+// Same as task_render_pixel on the whole scanline, with both layers drawn
+static void render_pixels(PPU *ppu, int scanline, const uint8_t *bg_pixels,
+                          const uint8_t *spr_pixels) {
+    uint8_t bg[WIDTH];
+    if (ppu->mask & MASK_RENDER_BACKGROUND) {
+        memcpy(bg, bg_pixels + ppu->x, WIDTH);
+        if (!(ppu->mask & MASK_NOCLIP_BACKGROUND)) {
+            memset(bg, 0, 8);
+        }
+    } else {
+        memset(bg, 0, WIDTH);
+    }
+    
+    uint8_t addrs[WIDTH];
+    if (compose_line(bg, spr_pixels, addrs, WIDTH)) {
+        ppu->status |= STATUS_SPRITE0_HIT;
+    }
+    
+    if (scanline < HEIGHT_CROPPED_BEGIN || scanline > HEIGHT_CROPPED_END) {
+        return;
+    }
+    // Transparent pixels show the backdrop whatever their palette
+    uint16_t colors[32];
+    for (int p = 0; p < 8; p++) {
+        colors[p * 4] = get_pixel(ppu, ppu->background_colors[0]);
+        for (int i = 1; i < 4; i++) {
+            colors[p * 4 + i] = get_pixel(ppu,
+                                          ppu->palettes[p * 3 + i - 1]);
+        }
+    }
+    uint16_t *screen = ppu->screens[ppu->current_screen] +
+                       (scanline - HEIGHT_CROPPED_BEGIN) * WIDTH;
+    // Left scalar: SSE2 has neither a gather nor a byte shuffle to vectorize
+    // the lookup with
+    for (int i = 0; i < WIDTH; i++) {
+        screen[i] = colors[addrs[i]];
+    }
+}
+
+// Same as the tasks of the dots from 257 on: the sprites of the next scanline
+// and its first two tiles get fetched
+static void fetch_next_line(PPU *ppu, RenderPos *at) {
+    for (int i = 0; i < 8; i++) {
+        at->cycle = 257 + i * 8;
+        task_fetch_nt(ppu, at);
+        if (!i) {
+            task_update_hori_v_hori_t(ppu, at);
+        }
+        task_fetch_at(ppu, at);
+        at->cycle += 4;
+        task_fetch_spr_pt0(ppu, at);
+        at->cycle += 2;
+        task_fetch_spr_pt1(ppu, at);
+    }
+    for (int i = 0; i < 2; i++) {
+        at->cycle = 321 + i * 8;
+        task_fetch_nt(ppu, at);
+        task_fetch_at(ppu, at);
+        task_fetch_bg_pt0(ppu, at);
+        at->cycle += 6;
+        task_fetch_bg_pt1(ppu, at);
+        task_update_inc_hori_v(ppu, at);
+    }
+    task_fetch_nt(ppu, at);
+    task_fetch_at(ppu, at);
+}
+
+static void render_line(PPU *ppu, const RenderPos *pos) {
+    const bool is_visible = (pos->scanline >= HEIGHT_CROPPED_BEGIN &&
+                             pos->scanline <= HEIGHT_CROPPED_END);
+    if (!is_rendering(ppu)) {
+        if (is_visible) {
+            uint16_t *screen = ppu->screens[ppu->current_screen] +
+                               (pos->scanline - HEIGHT_CROPPED_BEGIN) * WIDTH;
+            uint16_t color = get_pixel(ppu, ppu->background_colors[0]);
+            for (int i = 0; i < WIDTH; i++) {
+                screen[i] = color;
+            }
+        }
+        ppu->bg_at0 = ppu->bg_at1 = ppu->bg_pt0 = ppu->bg_pt1 = 0;
+        return;
+    }
+    
+    // The evaluation only fills the secondary OAM, for the next scanline
+    RenderPos at = *pos;
+    at.cycle = 65;
+    task_sprite_eval(ppu, &at);
+    
+    // The first two tiles are already in the shifters, the 32 others get
+    // fetched along. The 33rd shows partly with a fine X scroll, and while
+    // the 34th never shows, its fetches are still needed (mappers see them,
+    // and they move v along).
+    uint8_t bg_pixels[34 * 8];
+    for (int i = 0; i < 16; i++) {
+        int bit = 15 - i;
+        bg_pixels[i] = ((ppu->bg_pt0 >> bit) & 1) |
+                       (((ppu->bg_pt1 >> bit) & 1) << 1) |
+                       (((ppu->bg_at0 >> bit) & 1) << 2) |
+                       (((ppu->bg_at1 >> bit) & 1) << 3);
+    }
+    for (int tile = 0; tile < 32; tile++) {
+        at.cycle = tile * 8 + 7;
+        fetch_tile(ppu, &at, bg_pixels + (tile + 2) * 8);
+        if (tile < 31) {
+            task_update_inc_hori_v(ppu, &at);
+        } else {
+            task_update_inc_vert_v(ppu, &at);
+        }
+    }
+    uint8_t spr_pixels[WIDTH];
+    draw_sprite_pixels(ppu, spr_pixels);
+    render_pixels(ppu, pos->scanline, bg_pixels, spr_pixels);
+    
+    // Both sets of shifters are done by now, until the fetches reload them
+    fetch_next_line(ppu, &at);
+}
+
 // PUBLIC FUNCTIONS //
 
 void ppu_init(PPU *ppu, MemoryMap *mm, CPU65xx *cpu, int *lightgun_pos) {
@@ -414,13 +756,12 @@ void ppu_init(PPU *ppu, MemoryMap *mm, CPU65xx *cpu, int *lightgun_pos) {
     ppu->mm = mm;
     ppu->cpu = cpu;
     ppu->lightgun_pos = lightgun_pos;
+    build_rgb_palette(ppu->rgb_palette, colors_ntsc);
+    rebuild_sprite_index(ppu);
     
     // Fill the tasks array
     // sprite
-    ppu->tasks[1][TASK_SPRITE] = task_sprite_clear;
-    for (int i = 0; i < 64; i++) {
-        ppu->tasks[65 + i * 3][TASK_SPRITE] = task_sprite_eval;
-    }
+    ppu->tasks[65][TASK_SPRITE] = task_sprite_eval;
     // fetch
     for (int i = 1; i < PPU_CYCLES_PER_SCANLINE; i += 8) {
         ppu->tasks[i][TASK_FETCH] = task_fetch_nt;
@@ -448,60 +789,39 @@ void ppu_init(PPU *ppu, MemoryMap *mm, CPU65xx *cpu, int *lightgun_pos) {
     
     // CPU 2000-3FFF: PPU registers (8, repeated)
     MemoryMap *cpu_mm = cpu->mm;
-    for (int i = 0x2000; i < 0x4000; i++) {
-        cpu_mm->read[i] = read_register;
-        cpu_mm->write[i] = write_register;
-    }
+    mm_map_range(cpu_mm, 0x2000, 0x3FFF, read_register, write_register, 0);
     // CPU 4014: OAM DMA register
-    cpu_mm->write[0x4014] = write_oam_dma;
+    mm_map_range(cpu_mm, 0x4014, 0x4014, NULL, write_oam_dma, 0);
     
-    // PPU 3F00-3FFF: Palettes
-    for (int i = 0x3F00; i < 0x4000; i++) {
-        mm->read[i] = read_palettes;
-        mm->write[i] = write_palettes;
-    }
-    for (int i = 0x3F00; i < 0x4000; i += 4) {
-        mm->read[i] = read_background_colors;
-        mm->write[i] = write_background_colors;
-    }
+    // PPU 3F00-3FFF: Palettes, with the background colors every 4 bytes
+    mm_map_range(mm, 0x3F00, 0x3FFF, read_palettes, write_palettes, 0);
+    mm_map_range(mm, 0x3F00, 0x3FFF, read_background_colors,
+                 write_background_colors, 3);
 }
 
-void ppu_step(PPU *ppu, const RenderPos *pos, bool verbose) {
-    if (verbose && !pos->cycle) {
-        printf("-- Scanline %d --\n", pos->scanline);
-    }
-    
-    if (pos->scanline >= 0 && pos->scanline < HEIGHT_REAL &&
-        pos->cycle < WIDTH) {
-        task_render_pixel(ppu, pos);
-    }
-    
-    // Execute all tasks for that cycle
-    if (pos->scanline < 240 && is_rendering(ppu)) {
-        for (int i = 0; i < 3; i++) {
-            if (ppu->tasks[pos->cycle][i]) {
-                (*ppu->tasks[pos->cycle][i])(ppu, pos);
-            }
-        }
-    }
-    
-    // Check for flag operations
-    if (pos->cycle == 1) {
-        switch (pos->scanline) {
-            case -1:
-                ppu->status &= ~(STATUS_VBLANK |
-                                 STATUS_SPRITE0_HIT | STATUS_SPRITE_OVERFLOW);
-                break;
-            case 241:
-                ppu->status |= STATUS_VBLANK;
-                if (ppu->ctrl & CTRL_NMI_ON_VBLANK) {
-                    ppu->cpu->nmi = true;
-                }
-                break;
+bool ppu_has_lightgun(const PPU *ppu) {
+    return *ppu->lightgun_pos >= 0 || ppu->lightgun_sensor > 0;
+}
+
+void ppu_step(PPU *ppu, const RenderPos *pos) {
+    step(ppu, pos, false, false);
+}
+
+void ppu_step_line(PPU *ppu, const RenderPos *pos) {
+    if (pos->scanline < HEIGHT_REAL) {
+        render_line(ppu, pos);
+    } else if (pos->scanline == 241) {
+        ppu->status |= STATUS_VBLANK;
+        if (ppu->ctrl & CTRL_NMI_ON_VBLANK) {
+            ppu->cpu->nmi = true;
         }
     }
-    
-    if (!pos->cycle && (ppu->lightgun_sensor > 0)) {
-        ppu->lightgun_sensor--;
-    }
+}
+
+void ppu_step_lightgun(PPU *ppu, const RenderPos *pos) {
+    step(ppu, pos, false, true);
+}
+
+void ppu_step_debug(PPU *ppu, const RenderPos *pos, bool verbose) {
+    step(ppu, pos, verbose, true);
 }
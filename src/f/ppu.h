@@ -51,6 +51,10 @@
 #define TASK_FETCH 1
 #define TASK_UPDATE 2
 
+// Screen pixels: the color, with the emphasis bits of PPUMASK above it
+#define PIXEL_EMPHASIS_SHIFT 6
+#define PIXEL_VALUES (1 << (PIXEL_EMPHASIS_SHIFT + 3))
+
 // Screen dimensions
 #define WIDTH 256
 #define HEIGHT_REAL 240
@@ -63,6 +67,10 @@
 
 #define LIGHTGUN_COOLDOWN 26
 
+// One per memory map page of the pattern tables (PPU 0000-1FFF)
+#define CHR_CACHE_PAGES 32
+#define CHR_CACHE_TILES 16
+
 // Forward declarations
 typedef struct CPU65xx CPU65xx;
 typedef struct PPU PPU;
@@ -75,6 +83,14 @@ typedef struct RenderPos {
 
 typedef void (*TaskFunc)(PPU *, const RenderPos *);
 
+// Pattern rows decoded to a color index per pixel, from the memory that the
+// page maps (it starts over when another bank is selected there)
+typedef struct ChrCachePage {
+    const uint8_t *data;
+    uint16_t valid; // One bit per tile
+    uint8_t rows[CHR_CACHE_TILES][8][8];
+} ChrCachePage;
+
 struct PPU {
     CPU65xx *cpu;
     MemoryMap *mm;
@@ -83,11 +99,12 @@ struct PPU {
     uint8_t oam[0x100];
     uint8_t oam_addr;
     uint8_t oam2[32];
+    uint64_t sprite_lines[HEIGHT_REAL]; // One bit per sprite on each scanline
     
     // Colors
     uint8_t background_colors[4];
     uint8_t palettes[8 * 3];
-
+    
     // External registers
     uint8_t ctrl; // Write-only
     uint8_t mask; // Write-only
@@ -114,10 +131,12 @@ struct PPU {
     uint8_t s_x[8];
     int s_total;
     bool s_has_zero, s_has_zero_next;
+    ChrCachePage chr_cache[CHR_CACHE_PAGES];
     
-    // Raw screen data, in ARGB8888 format
-    uint32_t screens[2][WIDTH * HEIGHT_CROPPED];
+    // Raw screen data, converted by the frontend through the ARGB8888 palette
+    uint16_t screens[2][WIDTH * HEIGHT_CROPPED];
     bool current_screen;
+    uint32_t rgb_palette[PIXEL_VALUES];
     
     // Lightgun sensor handling
     int *lightgun_pos;
@@ -125,6 +144,15 @@ struct PPU {
 };
 
 void ppu_init(PPU *ppu, MemoryMap *mm, CPU65xx *cpu, int *lightgun_pos);
-void ppu_step(PPU *ppu, const RenderPos *pos, bool verbose);
+// Whether the lightgun can see (or still sees) the screen, which only
+// ppu_step_lightgun and ppu_step_debug check for
+bool ppu_has_lightgun(const PPU *ppu);
+void ppu_step(PPU *ppu, const RenderPos *pos);
+// Same as ppu_step on every dot of a scanline from 0 to 260, when nothing
+// else gets to touch the PPU in between (pos is at its first dot)
+void ppu_step_line(PPU *ppu, const RenderPos *pos);
+void ppu_step_lightgun(PPU *ppu, const RenderPos *pos);
+// Same as ppu_step_lightgun, printing scanlines out when verbose
+void ppu_step_debug(PPU *ppu, const RenderPos *pos, bool verbose);
 
 #endif /* f_ppu_h */
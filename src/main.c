@@ -1,49 +1,115 @@
 #include "common.h"
 #include <libgen.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "f/loader.h"
 #include "s/loader.h"
 #include "driver.h"
 #include "window.h"
 
-int main(int argc, char *argv[]) {
-    eprintf("%s build %s (%s)\n", APP_NAME, BUILD_ID, APP_HOMEPAGE);
-    if (argc < 2) {
-        eprintf("Usage: %s rom_file [debug.map]\n", argv[0]);
-        return 1;
-    }
-    
-    // Load the entire file in memory
-    FILE *rom_file = fopen(argv[1], "rb");
+#ifdef _WIN32
+
+// Loads the entire file in memory
+static bool map_rom(const char *path, blob *rom) {
+    FILE *rom_file = fopen(path, "rb");
     if (!rom_file) {
-        eprintf("%s: Error opening file\n", argv[1]);
-        return 1;
+        eprintf("%s: Error opening file\n", path);
+        return false;
     }
     if (fseeko(rom_file, 0, SEEK_END)) {
-        eprintf("%s: Error determining file size\n", argv[1]);
-        return 1;
+        eprintf("%s: Error determining file size\n", path);
+        return false;
     }
-    blob rom;
-    rom.size = ftello(rom_file);
-    if (rom.size < 1024) {
-        eprintf("%s: File is too small\n", argv[1]);
-        return 1;
+    rom->size = ftello(rom_file);
+    if (rom->size < 1024) {
+        eprintf("%s: File is too small\n", path);
+        return false;
     }
     if (fseeko(rom_file, 0, SEEK_SET)) {
-        eprintf("%s: Error seeking file\n", argv[1]);
-        return 1;
+        eprintf("%s: Error seeking file\n", path);
+        return false;
     }
-    rom.data = malloc(rom.size);
-    if (fread(rom.data, rom.size, 1, rom_file) < 1) {
-        eprintf("%s: Error reading file\n", argv[1]);
-        return 1;
+    rom->data = malloc(rom->size);
+    if (fread(rom->data, rom->size, 1, rom_file) < 1) {
+        eprintf("%s: Error reading file\n", path);
+        return false;
     }
     fclose(rom_file);
+    return true;
+}
+
+static void unmap_rom(blob *rom) {
+    free(rom->data);
+}
 
+#else
+
+// Maps the entire file read-only, so that every instance running the same ROM
+// shares the same physical pages (nothing ever writes to it)
+static bool map_rom(const char *path, blob *rom) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        eprintf("%s: Error opening file\n", path);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st)) {
+        eprintf("%s: Error determining file size\n", path);
+        close(fd);
+        return false;
+    }
+    rom->size = st.st_size;
+    if (rom->size < 1024) {
+        eprintf("%s: File is too small\n", path);
+        close(fd);
+        return false;
+    }
+    rom->data = mmap(NULL, rom->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (rom->data == MAP_FAILED) {
+        eprintf("%s: Error mapping file\n", path);
+        return false;
+    }
+    return true;
+}
+
+static void unmap_rom(blob *rom) {
+    munmap(rom->data, rom->size);
+}
+
+#endif
+
+int main(int argc, char *argv[]) {
+    eprintf("%s build %s (%s)\n", APP_NAME, BUILD_ID, APP_HOMEPAGE);
+    if (argc < 2) {
+        eprintf("Usage: %s rom_file [debug.map]\n", argv[0]);
+        return 1;
+    }
+    
+    blob rom;
+    if (!map_rom(argv[1], &rom)) {
+        return 1;
+    }
+    
     Driver driver;
     memset(&driver, 0, sizeof(Driver));
     driver.input.lightgun_pos = -1;
     
+    DebugMap *dbg_map = NULL;
+    if (argc >= 3) {
+        dbg_map = debug_map_load(argv[2]);
+        if (!dbg_map) {
+            return 1;
+        }
+        eprintf("Read %d labels from %s\n", dbg_map->count, argv[2]);
+        driver.dbg_map = dbg_map;
+    }
+    
     // Identify file type and pass to the appropriate loader
     int error_code = 1;
     eprintf("%s: ", argv[1]);
@@ -59,20 +125,6 @@ int main(int argc, char *argv[]) {
         return error_code;
     }
     
-    /*DebugMap *dbg_map = NULL;
-    if (argc >= 3) {
-        dbg_map = malloc(sizeof(DebugMap) * 2000); // TODO: figure out size
-        FILE *map_file = fopen(argv[2], "r");
-        int i = 0;
-        while (fscanf(map_file, "%255s @ %4hx", dbg_map[i].label,
-                      &(dbg_map[i].addr)) == 2) {
-            i++;
-        }
-        dbg_map[i + 1].label[0] = 0;
-        eprintf("Read %d entries from %s\n", i, argv[2]);
-        fclose(map_file);
-    }*/
-        
     Window wnd;
 #ifdef _WIN32
     char *fn = strdup(argv[1]);
@@ -88,14 +140,14 @@ int main(int argc, char *argv[]) {
     window_cleanup(&wnd);
     
     free(fn);
-    /*if (dbg_map) {
-        free(dbg_map);
-    }*/
     
     if (driver.teardown_func) {
         (*driver.teardown_func)(&driver);
     }
-    free(rom.data);
+    if (dbg_map) {
+        debug_map_free(dbg_map);
+    }
+    unmap_rom(&rom);
     
     return 0;
 }
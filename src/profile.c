@@ -0,0 +1,236 @@
+#include "profile.h"
+
+#include <inttypes.h>
+
+// How many entries are listed in each section of the summary
+#define PROFILE_TOP_LENGTH 50
+
+// Node keys
+#define KEY_TYPE_SHIFT 28
+#define KEY_BANK_SHIFT 16
+
+// CALL TREE //
+
+static uint32_t get_bucket(uint32_t parent, uint32_t key) {
+    uint32_t hash = parent * 0x9E3779B1 ^ key * 0x85EBCA6B;
+    return (hash >> 16) & (PROFILE_MAX_NODES - 1);
+}
+
+static uint32_t get_child(Profile *profile, uint32_t key) {
+    uint32_t parent = profile->current;
+    uint32_t *bucket = &profile->buckets[get_bucket(parent, key)];
+    for (uint32_t i = *bucket; i; i = profile->nodes[i].next) {
+        if (profile->nodes[i].parent == parent &&
+            profile->nodes[i].key == key) {
+            return i;
+        }
+    }
+    
+    // Once out of room, callees are counted in their caller
+    if (profile->node_count == PROFILE_MAX_NODES) {
+        return parent;
+    }
+    uint32_t i = profile->node_count++;
+    ProfileNode *node = &profile->nodes[i];
+    node->parent = parent;
+    node->key = key;
+    node->next = *bucket;
+    node->cycles = 0;
+    *bucket = i;
+    return i;
+}
+
+// OUTPUT //
+
+static int get_node_name(const ProfileNode *node, const DebugMap *dbg_map,
+                         char *str, int size) {
+    const char *const types[] = {"", "NMI:", "IRQ:"};
+    uint16_t addr = node->key & 0xFFFF;
+    int bank = (node->key >> KEY_BANK_SHIFT) & 0x1FF;
+    
+    int len = snprintf(str, size, "%s", types[node->key >> KEY_TYPE_SHIFT]);
+    const char *label = dbg_map ? debug_map_get_label(dbg_map, addr) : NULL;
+    if (label) {
+        len += snprintf(str + len, size - len, "%s", label);
+    } else {
+        len += snprintf(str + len, size - len, "$%04x", addr);
+    }
+    if (bank != PROFILE_NO_BANK) {
+        len += snprintf(str + len, size - len, "@%d", bank);
+    }
+    return len;
+}
+
+static void write_collapsed(Profile *profile, const DebugMap *dbg_map,
+                            FILE *file) {
+    uint32_t path[PROFILE_MAX_DEPTH + 1];
+    char name[300];
+    for (uint32_t i = 0; i < profile->node_count; i++) {
+        if (!profile->nodes[i].cycles) {
+            continue;
+        }
+        int depth = 0;
+        for (uint32_t n = i; n && depth < PROFILE_MAX_DEPTH; ) {
+            path[depth++] = n;
+            n = profile->nodes[n].parent;
+        }
+        
+        fprintf(file, "RESET");
+        while (depth--) {
+            get_node_name(&profile->nodes[path[depth]], dbg_map, name,
+                          sizeof(name));
+            fprintf(file, ";%s", name);
+        }
+        fprintf(file, " %" PRIu64 "\n", profile->nodes[i].cycles);
+    }
+}
+
+static const uint64_t *sort_values;
+
+static int compare_values(const void *a, const void *b) {
+    uint64_t va = sort_values[*(const uint32_t *)a];
+    uint64_t vb = sort_values[*(const uint32_t *)b];
+    return (va < vb) - (va > vb);
+}
+
+// Fills top with the indices of the highest values, returns how many
+static int get_top(const uint64_t *values, int count, uint32_t *top) {
+    uint32_t *indices = malloc(sizeof(uint32_t) * count);
+    for (int i = 0; i < count; i++) {
+        indices[i] = i;
+    }
+    sort_values = values;
+    qsort(indices, count, sizeof(uint32_t), compare_values);
+    
+    int length = 0;
+    while (length < PROFILE_TOP_LENGTH && length < count &&
+           values[indices[length]]) {
+        top[length] = indices[length];
+        length++;
+    }
+    free(indices);
+    return length;
+}
+
+static void write_summary(Profile *profile, const DebugMap *dbg_map,
+                          FILE *file) {
+    uint64_t total = 0, instructions = 0;
+    for (int i = 0; i < 0x10000; i++) {
+        total += profile->cycles[i];
+        instructions += profile->instructions[i];
+    }
+    fprintf(file, "%" PRIu64 " instructions, %" PRIu64 " cycles\n",
+            instructions, total);
+    double percent = total ? 100.0 / total : 0.0;
+    uint32_t top[PROFILE_TOP_LENGTH];
+    
+    fprintf(file, "\nCycles by bank:\n");
+    int length = get_top(profile->bank_cycles, PROFILE_BANKS + 1, top);
+    for (int i = 0; i < length; i++) {
+        uint64_t cycles = profile->bank_cycles[top[i]];
+        if (top[i] == PROFILE_NO_BANK) {
+            fprintf(file, "%6.2f%% %12" PRIu64 "  (not ROM)\n",
+                    cycles * percent, cycles);
+        } else {
+            fprintf(file, "%6.2f%% %12" PRIu64 "  %d\n",
+                    cycles * percent, cycles, top[i]);
+        }
+    }
+    
+    if (dbg_map) {
+        // Each address counts towards the closest label before it
+        uint64_t *label_cycles = calloc(0x10000, sizeof(uint64_t));
+        int label = 0;
+        for (int i = 0; i < 0x10000; i++) {
+            if (debug_map_is_labeled(dbg_map, i)) {
+                label = i;
+            }
+            label_cycles[label] += profile->cycles[i];
+        }
+        fprintf(file, "\nCycles by label:\n");
+        length = get_top(label_cycles, 0x10000, top);
+        for (int i = 0; i < length; i++) {
+            uint64_t cycles = label_cycles[top[i]];
+            const char *name = debug_map_get_label(dbg_map, top[i]);
+            fprintf(file, "%6.2f%% %12" PRIu64 "  %s\n",
+                    cycles * percent, cycles, name ? name : "(none)");
+        }
+        free(label_cycles);
+    }
+    
+    fprintf(file, "\nCycles by address:\n");
+    length = get_top(profile->cycles, 0x10000, top);
+    for (int i = 0; i < length; i++) {
+        uint64_t cycles = profile->cycles[top[i]];
+        fprintf(file, "%6.2f%% %12" PRIu64 "  $%04x (%" PRIu64 " times)\n",
+                cycles * percent, cycles, top[i],
+                profile->instructions[top[i]]);
+    }
+}
+
+// PUBLIC FUNCTIONS //
+
+void profile_init(Profile *profile, ProfileBankFuncPtr bank_func,
+                  void *bank_ctx, const unsigned *bank_gen) {
+    memset(profile, 0, sizeof(Profile));
+    profile->bank_func = bank_func;
+    profile->bank_ctx = bank_ctx;
+    profile->bank_gen = bank_gen;
+    profile->node_count = 1;
+    profile_update_banks(profile);
+}
+
+void profile_update_banks(Profile *profile) {
+    for (int i = 0; i < 8; i++) {
+        int bank = (*profile->bank_func)(profile->bank_ctx, i << 13);
+        profile->page_bank[i] = (bank >= 0 && bank < PROFILE_BANKS ?
+                                 bank : PROFILE_NO_BANK);
+    }
+    profile->last_gen = *profile->bank_gen;
+}
+
+void profile_call(Profile *profile, ProfileCallType type, uint16_t addr,
+                  uint8_t s) {
+    if (profile->depth == PROFILE_MAX_DEPTH) {
+        return;
+    }
+    if (*profile->bank_gen != profile->last_gen) {
+        profile_update_banks(profile);
+    }
+    uint32_t key = ((uint32_t)type << KEY_TYPE_SHIFT) |
+                   (profile->page_bank[addr >> 13] << KEY_BANK_SHIFT) | addr;
+    profile->stack[profile->depth++] = (ProfileFrame) {profile->current, s};
+    profile->current = get_child(profile, key);
+}
+
+void profile_return(Profile *profile, uint8_t s) {
+    // Returns may skip frames (or not match any, like RTS jump tables), so
+    // they unwind every call made from at or below where the stack is now
+    while (profile->depth && profile->stack[profile->depth - 1].s <= s) {
+        profile->current = profile->stack[--profile->depth].node;
+    }
+}
+
+bool profile_save(Profile *profile, const DebugMap *dbg_map,
+                  const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        eprintf("%s: Error opening file\n", path);
+        return false;
+    }
+    write_collapsed(profile, dbg_map, file);
+    fclose(file);
+    
+    char *summary_path = malloc(strlen(path) + 5);
+    sprintf(summary_path, "%s.txt", path);
+    file = fopen(summary_path, "w");
+    if (!file) {
+        eprintf("%s: Error opening file\n", summary_path);
+        free(summary_path);
+        return false;
+    }
+    write_summary(profile, dbg_map, file);
+    fclose(file);
+    free(summary_path);
+    return true;
+}
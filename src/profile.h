@@ -0,0 +1,86 @@
+#ifndef profile_h
+#define profile_h
+
+#include "common.h"
+
+#include "debug_map.h"
+
+// Limits of the shadow call tree
+#define PROFILE_MAX_NODES 0x10000 // Must be a power of 2
+#define PROFILE_MAX_DEPTH 0x100
+
+// Banks are counted in 8KB units, the last one is for code outside of ROM
+#define PROFILE_BANKS 0x100
+#define PROFILE_NO_BANK PROFILE_BANKS
+
+// Returns which bank is mapped at an address, or -1 if it isn't ROM
+typedef int (*ProfileBankFuncPtr)(void *, uint16_t);
+
+typedef enum {
+    PROFILE_CALL = 0,
+    PROFILE_NMI,
+    PROFILE_IRQ,
+} ProfileCallType;
+
+typedef struct ProfileNode {
+    uint32_t parent;
+    uint32_t key;   // Call type, bank and address of the entry point
+    uint32_t next;  // Next node in the same hash bucket (0 for none)
+    uint64_t cycles; // Spent in this node itself, not its callees
+} ProfileNode;
+
+typedef struct ProfileFrame {
+    uint32_t node;
+    uint8_t s; // Stack register before the call, returns pull back above it
+} ProfileFrame;
+
+typedef struct Profile {
+    // Flat counts per address
+    uint64_t instructions[0x10000];
+    uint64_t cycles[0x10000];
+    uint64_t bank_cycles[PROFILE_BANKS + 1];
+    
+    // Bank mapped in each 8KB page, refreshed whenever bank_gen changes
+    uint16_t page_bank[8];
+    ProfileBankFuncPtr bank_func;
+    void *bank_ctx;
+    const unsigned *bank_gen;
+    unsigned last_gen;
+    
+    // Shadow call tree, node 0 is the root
+    ProfileNode nodes[PROFILE_MAX_NODES];
+    uint32_t buckets[PROFILE_MAX_NODES];
+    uint32_t node_count;
+    ProfileFrame stack[PROFILE_MAX_DEPTH];
+    int depth;
+    uint32_t current;
+} Profile;
+
+void profile_init(Profile *profile, ProfileBankFuncPtr bank_func,
+                  void *bank_ctx, const unsigned *bank_gen);
+
+void profile_update_banks(Profile *profile);
+
+// Counts an instruction that started at pc
+static inline void profile_count(Profile *profile, uint16_t pc, int cycles) {
+    if (*profile->bank_gen != profile->last_gen) {
+        profile_update_banks(profile);
+    }
+    profile->instructions[pc]++;
+    profile->cycles[pc] += cycles;
+    profile->bank_cycles[profile->page_bank[pc >> 13]] += cycles;
+    profile->nodes[profile->current].cycles += cycles;
+}
+
+// s is the stack register from before the call
+void profile_call(Profile *profile, ProfileCallType type, uint16_t addr,
+                  uint8_t s);
+// s is the stack register after the return
+void profile_return(Profile *profile, uint8_t s);
+
+// Writes collapsed stacks to path (for flamegraph tools), and a summary per
+// address, label and bank to path.txt
+bool profile_save(Profile *profile, const DebugMap *dbg_map,
+                  const char *path);
+
+#endif /* profile_h */
@@ -0,0 +1,584 @@
+#include "common.h"
+#include <ctype.h>
+#include <stdarg.h>
+
+#include "crc32.h"
+#include "driver.h"
+#include "f/loader.h"
+#include "f/machine.h"
+
+// Translates all the code reachable in a ROM into C, for the runtime in
+// cpu/65xx_recompiled.h. Discovery starts from the interrupt vectors and
+// follows branches, jumps and calls, which only stay in the same bank within
+// its own 8KB window: targets in other windows are taken from the bank layout
+// right after reset. Whatever isn't found that way (code in RAM, computed
+// jumps, banks only reached through a switch) is left to the interpreter.
+
+#define WINDOWS (0x8000 / SIZE_PRG_BANK)
+
+typedef struct {
+    bool *is_code; // Per byte of the bank, where a found instruction starts
+    int count;
+} Region;
+
+typedef struct {
+    int region;
+    uint16_t addr;
+} WorkItem;
+
+typedef struct {
+    const uint8_t *prg;
+    int bank_count;
+    int initial_banks[WINDOWS];
+    Region *regions; // Per bank, then per window
+    WorkItem *work;
+    int work_count;
+    int work_size;
+    FILE *out;
+} Recompiler;
+
+static bool load_rom(const char *path, blob *rom) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        eprintf("%s: Error opening file\n", path);
+        return false;
+    }
+    fseeko(file, 0, SEEK_END);
+    rom->size = ftello(file);
+    fseeko(file, 0, SEEK_SET);
+    rom->data = malloc(rom->size);
+    bool is_read = (rom->size > HEADER_SIZE &&
+                    fread(rom->data, rom->size, 1, file) == 1);
+    fclose(file);
+    if (!is_read || strncmp((const char *)rom->data, "NES\x1a", 4)) {
+        eprintf("%s: Not an iNES file\n", path);
+        return false;
+    }
+    return true;
+}
+
+// DISCOVERY //
+
+static int get_window(uint16_t addr) {
+    return (addr - 0x8000) / SIZE_PRG_BANK;
+}
+
+static int get_region(int bank, uint16_t addr) {
+    return bank * WINDOWS + get_window(addr);
+}
+
+static int get_bank(int region) {
+    return region / WINDOWS;
+}
+
+static uint16_t get_region_addr(int region) {
+    return 0x8000 + (region % WINDOWS) * SIZE_PRG_BANK;
+}
+
+static const uint8_t *get_host(Recompiler *rc, int region, uint16_t addr) {
+    return rc->prg + get_bank(region) * SIZE_PRG_BANK +
+           (addr & MASK_PRG_BANK);
+}
+
+static int get_fetch_size(const Opcode *op) {
+    // Same as the block cache, with the implied dummy read
+    switch (op->am) {
+        case AM_IMPLIED:
+        case AM_IMMEDIATE:
+        case AM_ZP:
+        case AM_INDIRECT_X:
+        case AM_INDIRECT_Y:
+        case AM_RELATIVE:
+            return 2;
+        default:
+            return 3;
+    }
+}
+
+static int get_size(const Opcode *op) {
+    return op->am == AM_IMPLIED ? 1 : get_fetch_size(op);
+}
+
+static bool is_name(const Opcode *op, const char *name) {
+    return !strcmp(op->name, name);
+}
+
+// Whether the instruction can be translated at all
+static bool is_supported(Recompiler *rc, int region, uint16_t addr) {
+    const Opcode *op = cpu_65xx_get_opcode(*get_host(rc, region, addr));
+    if (is_name(op, "KIL") || is_name(op, "BRK")) {
+        return false;
+    }
+    // Every byte fetched must be within the same bank
+    return (addr & MASK_PRG_BANK) + get_fetch_size(op) <= SIZE_PRG_BANK;
+}
+
+// Region of the code at addr, when coming from region
+static int follow(Recompiler *rc, int region, uint16_t addr) {
+    if (addr < 0x8000) {
+        return -1;
+    }
+    if (get_window(addr) == get_window(get_region_addr(region))) {
+        return region;
+    }
+    return get_region(rc->initial_banks[get_window(addr)], addr);
+}
+
+static void add_work(Recompiler *rc, int region, uint16_t addr) {
+    if (region < 0) {
+        return;
+    }
+    Region *r = &rc->regions[region];
+    if (!r->is_code) {
+        r->is_code = calloc(SIZE_PRG_BANK, sizeof(bool));
+    }
+    if (r->is_code[addr & MASK_PRG_BANK] || !is_supported(rc, region, addr)) {
+        return;
+    }
+    r->is_code[addr & MASK_PRG_BANK] = true;
+    r->count++;
+    if (rc->work_count == rc->work_size) {
+        rc->work_size = rc->work_size ? rc->work_size * 2 : 1024;
+        rc->work = realloc(rc->work, rc->work_size * sizeof(WorkItem));
+    }
+    rc->work[rc->work_count++] = (WorkItem) {region, addr};
+}
+
+static uint16_t get_operand(const uint8_t *code, const Opcode *op) {
+    if (get_size(op) == 3) {
+        return code[1] | (code[2] << 8);
+    }
+    return code[1];
+}
+
+static uint16_t get_branch_target(uint16_t addr, const uint8_t *code) {
+    return addr + 2 + (int8_t)code[1];
+}
+
+static bool has_fall_through(const Opcode *op) {
+    return !is_name(op, "JMP") && !is_name(op, "RTS") && !is_name(op, "RTI");
+}
+
+static void discover(Recompiler *rc) {
+    while (rc->work_count) {
+        WorkItem item = rc->work[--rc->work_count];
+        const uint8_t *code = get_host(rc, item.region, item.addr);
+        const Opcode *op = cpu_65xx_get_opcode(code[0]);
+        
+        if (op->am == AM_RELATIVE) {
+            uint16_t target = get_branch_target(item.addr, code);
+            add_work(rc, follow(rc, item.region, target), target);
+        } else if (op->am == AM_ABSOLUTE &&
+                   (is_name(op, "JMP") || is_name(op, "JSR"))) {
+            uint16_t target = get_operand(code, op);
+            add_work(rc, follow(rc, item.region, target), target);
+        }
+        if (has_fall_through(op)) {
+            uint16_t next = item.addr + get_size(op);
+            if (next > item.addr) {
+                add_work(rc, follow(rc, item.region, next), next);
+            }
+        }
+    }
+}
+
+// CODE GENERATION //
+
+static void emit(Recompiler *rc, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vfprintf(rc->out, format, args);
+    va_end(args);
+}
+
+static void emit_function_name(Recompiler *rc, int region) {
+    emit(rc, "bank_%03x_%04x", get_bank(region), get_region_addr(region));
+}
+
+static bool is_code(Recompiler *rc, int region, uint16_t addr) {
+    return follow(rc, region, addr) == region &&
+           rc->regions[region].is_code[addr & MASK_PRG_BANK];
+}
+
+static void emit_goto(Recompiler *rc, int region, uint16_t addr) {
+    if (is_code(rc, region, addr)) {
+        emit(rc, "goto L%04x;", addr);
+    } else {
+        emit(rc, "RC_EXIT(0x%04x);", addr);
+    }
+}
+
+// Leaves the effective address in addr, and the penalty for crossing a page
+// in t (when the opcode has one)
+static void emit_address(Recompiler *rc, const Opcode *op, uint16_t operand) {
+    const char *reg = (op->reg2 == REG_X ? "cpu->x" : "cpu->y");
+    bool has_index = (op->reg2 == REG_X || op->reg2 == REG_Y);
+    switch (op->am) {
+        case AM_ZP:
+            if (has_index) {
+                emit(rc, "        uint16_t addr = (uint8_t)(0x%02x + %s);\n",
+                     operand, reg);
+            } else {
+                emit(rc, "        uint16_t addr = 0x%02x;\n", operand);
+            }
+            break;
+        case AM_ABSOLUTE:
+            if (has_index) {
+                emit(rc, "        uint16_t addr = 0x%04x + %s;\n", operand,
+                     reg);
+            } else {
+                emit(rc, "        uint16_t addr = 0x%04x;\n", operand);
+            }
+            if (op->cycles < 0) {
+                emit(rc, "        int t = (addr >> 8) != 0x%02x;\n",
+                     operand >> 8);
+            }
+            break;
+        case AM_INDIRECT_X:
+            emit(rc, "        uint16_t addr = rc_read_word(cpu, "
+                     "(uint8_t)(0x%02x + cpu->x));\n", operand);
+            break;
+        case AM_INDIRECT_Y:
+            emit(rc, "        uint16_t base = rc_read_word(cpu, 0x%02x);\n",
+                 operand);
+            emit(rc, "        uint16_t addr = base + cpu->y;\n");
+            if (op->cycles < 0) {
+                emit(rc, "        int t = (addr >> 8) != (base >> 8);\n");
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static const char *get_reg_name(Register reg) {
+    switch (reg) {
+        case REG_A:
+            return "cpu->a";
+        case REG_X:
+            return "cpu->x";
+        case REG_Y:
+            return "cpu->y";
+        case REG_S:
+            return "cpu->s";
+        default:
+            return NULL;
+    }
+}
+
+static const char *get_condition(const Opcode *op) {
+    static const char *const conditions[][2] = {
+        {"BPL", "!(cpu->n_result & P_N)"},
+        {"BMI", "cpu->n_result & P_N"},
+        {"BVC", "!(cpu->p & P_V)"},
+        {"BVS", "cpu->p & P_V"},
+        {"BCC", "!(cpu->p & P_C)"},
+        {"BCS", "cpu->p & P_C"},
+        {"BNE", "cpu->z_result"},
+        {"BEQ", "!cpu->z_result"},
+    };
+    for (int i = 0; i < sizeof(conditions) / sizeof(conditions[0]); i++) {
+        if (is_name(op, conditions[i][0])) {
+            return conditions[i][1];
+        }
+    }
+    return NULL;
+}
+
+// Emits the body of an instruction that doesn't change the flow, returns
+// whether it has to return afterwards for interrupts to be checked
+static bool emit_operation(Recompiler *rc, const Opcode *op,
+                           uint16_t operand) {
+    const char *reg1 = get_reg_name(op->reg1);
+    const char *value = "rc_read(cpu, addr)";
+    char immediate[8];
+    if (op->am == AM_IMMEDIATE) {
+        snprintf(immediate, sizeof(immediate), "0x%02x", operand);
+        value = immediate;
+    }
+    
+    if (is_name(op, "LDA") || is_name(op, "LDX") || is_name(op, "LDY")) {
+        emit(rc, "        rc_nz(cpu, %s = %s);\n", reg1, value);
+    } else if (is_name(op, "STA") || is_name(op, "STX") ||
+               is_name(op, "STY")) {
+        emit(rc, "        rc_write(cpu, addr, %s);\n", reg1);
+    } else if (op->am == AM_IMPLIED && op->reg2) {
+        // Transfers
+        emit(rc, "        %s = %s;\n", get_reg_name(op->reg2), reg1);
+        if (op->reg2 != REG_S) {
+            emit(rc, "        rc_nz(cpu, %s);\n", get_reg_name(op->reg2));
+        }
+    } else if (is_name(op, "ADC") || is_name(op, "SBC")) {
+        emit(rc, "        rc_%s(cpu, %s);\n",
+             is_name(op, "ADC") ? "adc" : "sbc", value);
+    } else if (is_name(op, "AND") || is_name(op, "EOR") ||
+               is_name(op, "ORA")) {
+        const char *c_op = (is_name(op, "AND") ? "&" :
+                            is_name(op, "EOR") ? "^" : "|");
+        emit(rc, "        rc_nz(cpu, cpu->a %s= %s);\n", c_op, value);
+    } else if (is_name(op, "CMP") || is_name(op, "CPX") ||
+               is_name(op, "CPY")) {
+        emit(rc, "        rc_cmp(cpu, %s, %s);\n", reg1, value);
+    } else if (is_name(op, "BIT")) {
+        emit(rc, "        rc_bit(cpu, %s);\n", value);
+    } else if (is_name(op, "INC") || is_name(op, "DEC")) {
+        emit(rc, "        uint8_t value = rc_read(cpu, addr) %s 1;\n",
+             is_name(op, "INC") ? "+" : "-");
+        emit(rc, "        rc_write(cpu, addr, value);\n");
+        emit(rc, "        rc_nz(cpu, value);\n");
+    } else if (is_name(op, "INX") || is_name(op, "INY")) {
+        emit(rc, "        rc_nz(cpu, ++%s);\n", reg1);
+    } else if (is_name(op, "DEX") || is_name(op, "DEY")) {
+        emit(rc, "        rc_nz(cpu, --%s);\n", reg1);
+    } else if (is_name(op, "ASL") || is_name(op, "LSR") ||
+               is_name(op, "ROL") || is_name(op, "ROR")) {
+        char func[8];
+        snprintf(func, sizeof(func), "rc_%s", op->name);
+        for (char *c = func; *c; c++) {
+            *c = tolower(*c);
+        }
+        if (reg1) {
+            emit(rc, "        %s = %s(cpu, %s);\n", reg1, func, reg1);
+        } else {
+            emit(rc, "        rc_write(cpu, addr, %s(cpu, "
+                     "rc_read(cpu, addr)));\n", func);
+        }
+    } else if (is_name(op, "PHA")) {
+        emit(rc, "        rc_push(cpu, cpu->a);\n");
+    } else if (is_name(op, "PHP")) {
+        emit(rc, "        rc_push(cpu, rc_get_p(cpu) | P_B | P__);\n");
+    } else if (is_name(op, "PLA")) {
+        emit(rc, "        rc_nz(cpu, cpu->a = rc_pull(cpu));\n");
+    } else if (is_name(op, "PLP")) {
+        emit(rc, "        rc_set_p(cpu, rc_pull(cpu) & ~(P_B | P__));\n");
+        return true;
+    } else if (op->am == AM_IMPLIED &&
+               (op->name[0] == 'C' || op->name[0] == 'S')) {
+        // Flags, the last letter is the same as in PFlag
+        emit(rc, "        rc_set_flag(cpu, P_%c, %s);\n", op->name[2],
+             op->name[0] == 'S' ? "true" : "false");
+        return is_name(op, "CLI");
+    }
+    return false;
+}
+
+// Falls through to the next instruction if it comes right after
+static void emit_instruction(Recompiler *rc, int region, uint16_t addr,
+                             bool is_followed) {
+    const uint8_t *code = get_host(rc, region, addr);
+    const Opcode *op = cpu_65xx_get_opcode(code[0]);
+    uint16_t operand = get_operand(code, op);
+    uint16_t next = addr + get_size(op);
+    int cycles = abs(op->cycles);
+    
+    char str[32];
+    cpu_65xx_format_instruction(code[0], code + 1, str, sizeof(str));
+    emit(rc, "L%04x: // %s\n", addr, str);
+    emit(rc, "    RC_CHECK(0x%04x);\n", addr);
+    emit(rc, "    {\n");
+    emit(rc, "        *cpu->bus_latch = 0x%02x;\n",
+         code[get_fetch_size(op) - 1]);
+    
+    if (op->am == AM_RELATIVE) {
+        uint16_t target = get_branch_target(addr, code);
+        emit(rc, "        if (%s) {\n", get_condition(op));
+        emit(rc, "            cpu->cycles += %d;\n",
+             cycles + 1 + ((next >> 8) != (target >> 8)));
+        emit(rc, "            ");
+        emit_goto(rc, region, target);
+        emit(rc, "\n        }\n");
+        emit(rc, "        cpu->cycles += %d;\n", cycles);
+        if (!is_followed) {
+            emit(rc, "        ");
+            emit_goto(rc, region, next);
+            emit(rc, "\n");
+        }
+    } else if (is_name(op, "JMP") && op->am == AM_ABSOLUTE) {
+        emit(rc, "        cpu->cycles += %d;\n", cycles);
+        emit(rc, "        ");
+        emit_goto(rc, region, operand);
+        emit(rc, "\n");
+    } else if (is_name(op, "JMP")) {
+        emit(rc, "        cpu->pc = rc_read_word(cpu, 0x%04x);\n", operand);
+        emit(rc, "        cpu->cycles += %d;\n", cycles);
+        emit(rc, "        goto dispatch;\n");
+    } else if (is_name(op, "JSR")) {
+        emit(rc, "        rc_push(cpu, 0x%02x);\n", (uint16_t)(next - 1) >> 8);
+        emit(rc, "        rc_push(cpu, 0x%02x);\n", (next - 1) & 0xFF);
+        emit(rc, "        cpu->cycles += %d;\n", cycles);
+        emit(rc, "        ");
+        emit_goto(rc, region, operand);
+        emit(rc, "\n");
+    } else if (is_name(op, "RTS")) {
+        emit(rc, "        uint16_t lower = rc_pull(cpu);\n");
+        emit(rc, "        cpu->pc = lower + (rc_pull(cpu) << 8) + 1;\n");
+        emit(rc, "        cpu->cycles += %d;\n", cycles);
+        emit(rc, "        goto dispatch;\n");
+    } else if (is_name(op, "RTI")) {
+        emit(rc, "        rc_set_p(cpu, rc_pull(cpu) & ~(P_B | P__));\n");
+        emit(rc, "        uint16_t lower = rc_pull(cpu);\n");
+        emit(rc, "        cpu->pc = lower + (rc_pull(cpu) << 8);\n");
+        emit(rc, "        cpu->cycles += %d;\n", cycles);
+        emit(rc, "        return true;\n");
+    } else {
+        emit_address(rc, op, operand);
+        bool must_return = emit_operation(rc, op, operand);
+        if (op->cycles < 0) {
+            emit(rc, "        cpu->cycles += %d + t;\n", cycles);
+        } else {
+            emit(rc, "        cpu->cycles += %d;\n", cycles);
+        }
+        if (must_return) {
+            emit(rc, "        RC_EXIT(0x%04x);\n", next);
+        } else if (!is_followed) {
+            emit(rc, "        ");
+            emit_goto(rc, region, next);
+            emit(rc, "\n");
+        }
+    }
+    emit(rc, "    }\n");
+}
+
+static bool has_dynamic_target(const Opcode *op) {
+    return is_name(op, "RTS") || (is_name(op, "JMP") && op->am != AM_ABSOLUTE);
+}
+
+static void emit_region(Recompiler *rc, int region) {
+    uint16_t start = get_region_addr(region);
+    const bool *is_code = rc->regions[region].is_code;
+    bool needs_dispatch = false;
+    for (int i = 0; i < SIZE_PRG_BANK; i++) {
+        if (is_code[i]) {
+            const Opcode *op = cpu_65xx_get_opcode(*get_host(rc, region,
+                                                             start + i));
+            needs_dispatch |= has_dynamic_target(op);
+        }
+    }
+    
+    // Returns and computed jumps go back through the switch, which leaves
+    // for the interpreter when they land outside of the found code
+    emit(rc, "\nstatic bool ");
+    emit_function_name(rc, region);
+    emit(rc, "(CPU65xx *cpu) {\n");
+    emit(rc, "    uint64_t start = cpu->cycles;\n");
+    if (needs_dispatch) {
+        emit(rc, "dispatch:\n");
+    }
+    emit(rc, "    switch (cpu->pc) {\n");
+    for (int i = 0; i < SIZE_PRG_BANK; i++) {
+        if (is_code[i]) {
+            emit(rc, "        case 0x%04x: goto L%04x;\n", start + i,
+                 start + i);
+        }
+    }
+    emit(rc, "        default: return cpu->cycles != start;\n");
+    emit(rc, "    }\n");
+    
+    for (int i = 0; i < SIZE_PRG_BANK; i++) {
+        if (!is_code[i]) {
+            continue;
+        }
+        uint16_t addr = start + i;
+        const Opcode *op = cpu_65xx_get_opcode(*get_host(rc, region, addr));
+        int next = i + get_size(op), following = i + 1;
+        while (following < SIZE_PRG_BANK && !is_code[following]) {
+            following++;
+        }
+        emit_instruction(rc, region, addr, next == following &&
+                                           following < SIZE_PRG_BANK);
+    }
+    emit(rc, "}\n");
+}
+
+static void emit_file(Recompiler *rc, const char *rom_path, uint32_t crc,
+                      size_t prg_size) {
+    emit(rc, "// Generated by f-recompile from %s, do not edit\n\n",
+         rom_path);
+    emit(rc, "#include \"cpu/65xx_recompiled.h\"\n");
+    
+    int count = 0;
+    for (int i = 0; i < rc->bank_count * WINDOWS; i++) {
+        if (rc->regions[i].count) {
+            emit_region(rc, i);
+            count++;
+        }
+    }
+    
+    emit(rc, "\nstatic const CPU65xxRecompiledBank banks[] = {\n");
+    for (int i = 0; i < rc->bank_count * WINDOWS; i++) {
+        if (rc->regions[i].count) {
+            emit(rc, "    {0x%06x, 0x%04x, ", get_bank(i) * SIZE_PRG_BANK,
+                 get_region_addr(i));
+            emit_function_name(rc, i);
+            emit(rc, "},\n");
+        }
+    }
+    emit(rc, "};\n\n");
+    emit(rc, "const CPU65xxRecompiled recompiled_code = {\n");
+    emit(rc, "    0x%08X, 0x%zx, 0x%x, %d, banks\n", crc, prg_size,
+         SIZE_PRG_BANK, count);
+    emit(rc, "};\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        eprintf("Usage: %s rom_file output.c\n", argv[0]);
+        return 1;
+    }
+    
+    blob rom;
+    if (!load_rom(argv[1], &rom)) {
+        return 1;
+    }
+    Driver driver;
+    memset(&driver, 0, sizeof(Driver));
+    driver.input.lightgun_pos = -1;
+    if (ines_loader(&driver, &rom)) {
+        return 1;
+    }
+    Machine *vm = driver.vm;
+    
+    Recompiler rc;
+    memset(&rc, 0, sizeof(Recompiler));
+    rc.prg = vm->cart.prg_rom.data;
+    rc.bank_count = vm->cart.prg_rom.size / SIZE_PRG_BANK;
+    rc.regions = calloc(rc.bank_count * WINDOWS, sizeof(Region));
+    for (int i = 0; i < WINDOWS; i++) {
+        rc.initial_banks[i] = (vm->cart.prg_banks[i] - rc.prg) /
+                              SIZE_PRG_BANK;
+    }
+    
+    // The vectors are all in the last window
+    const uint16_t vectors[] = {IVT_NMI, IVT_RESET, IVT_IRQ};
+    int last = get_region(rc.initial_banks[WINDOWS - 1], IVT_RESET);
+    for (int i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        const uint8_t *vector = get_host(&rc, last, vectors[i]);
+        uint16_t addr = vector[0] | (vector[1] << 8);
+        add_work(&rc, follow(&rc, last, addr), addr);
+    }
+    discover(&rc);
+    
+    rc.out = fopen(argv[2], "w");
+    if (!rc.out) {
+        eprintf("%s: Error opening file\n", argv[2]);
+        return 1;
+    }
+    emit_file(&rc, argv[1], crc32(&vm->cart.prg_rom),
+              vm->cart.prg_rom.size);
+    fclose(rc.out);
+    
+    int instructions = 0, regions = 0;
+    for (int i = 0; i < rc.bank_count * WINDOWS; i++) {
+        instructions += rc.regions[i].count;
+        regions += !!rc.regions[i].count;
+        free(rc.regions[i].is_code);
+    }
+    eprintf("Recompiled %d instructions in %d banks\n", instructions,
+            regions);
+    
+    free(rc.regions);
+    free(rc.work);
+    (*driver.teardown_func)(&driver);
+    free(rom.data);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#include "trace.h"
+
+#define TRACE_MAGIC "FTRC"
+#define TRACE_VERSION 1
+
+typedef struct TraceHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t length;
+} TraceHeader;
+
+void trace_init(Trace *trace, int trigger) {
+    memset(trace, 0, sizeof(Trace));
+    trace->trigger = trigger;
+}
+
+int trace_get_length(const Trace *trace) {
+    return trace->count < TRACE_LENGTH ? trace->count : TRACE_LENGTH;
+}
+
+TraceEntry *trace_get_entry(Trace *trace, int index) {
+    unsigned first = trace->count - trace_get_length(trace);
+    return &trace->entries[(first + index) & (TRACE_LENGTH - 1)];
+}
+
+bool trace_save(Trace *trace, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        eprintf("%s: Error opening file\n", path);
+        return false;
+    }
+    
+    TraceHeader header = {TRACE_MAGIC, TRACE_VERSION, sizeof(TraceEntry),
+                          trace_get_length(trace)};
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (int i = 0; ok && i < header.length; i++) {
+        ok = fwrite(trace_get_entry(trace, i), sizeof(TraceEntry), 1,
+                    file) == 1;
+    }
+    if (!ok) {
+        eprintf("%s: Error writing file\n", path);
+    }
+    fclose(file);
+    return ok;
+}
+
+TraceEntry *trace_load(const char *path, int *length) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        eprintf("%s: Error opening file\n", path);
+        return NULL;
+    }
+    
+    TraceHeader header;
+    if (fread(&header, sizeof(header), 1, file) < 1 ||
+        memcmp(header.magic, TRACE_MAGIC, 4) ||
+        header.version != TRACE_VERSION ||
+        header.entry_size != sizeof(TraceEntry) ||
+        header.length > TRACE_LENGTH) {
+        eprintf("%s: Not a valid trace file\n", path);
+        fclose(file);
+        return NULL;
+    }
+    
+    TraceEntry *entries = malloc(sizeof(TraceEntry) * (header.length + 1));
+    if (fread(entries, sizeof(TraceEntry), header.length, file) <
+        header.length) {
+        eprintf("%s: Error reading file\n", path);
+        free(entries);
+        entries = NULL;
+    }
+    *length = header.length;
+    fclose(file);
+    return entries;
+}
@@ -0,0 +1,48 @@
+#ifndef trace_h
+#define trace_h
+
+#include "common.h"
+
+// How many entries are kept (must be a power of 2)
+#define TRACE_LENGTH 0x10000
+
+typedef enum {
+    TRACE_INSTRUCTION = 0,
+    TRACE_NMI,
+    TRACE_IRQ,
+} TraceType;
+
+typedef struct TraceEntry {
+    uint64_t cycle;     // When it started
+    uint16_t pc;
+    int16_t scanline;   // Only filled in when saved
+    uint8_t type;
+    uint8_t opcode;
+    uint8_t operands[2];
+    // Registers before execution
+    uint8_t a, x, y, p, s;
+} TraceEntry;
+
+typedef struct Trace {
+    TraceEntry entries[TRACE_LENGTH];
+    unsigned count; // Total recorded, the ring keeps the last TRACE_LENGTH
+    
+    // Set once the trigger address (or -1 for none) gets executed
+    int trigger;
+    bool is_triggered;
+} Trace;
+
+void trace_init(Trace *trace, int trigger);
+
+static inline TraceEntry *trace_add(Trace *trace) {
+    return &trace->entries[trace->count++ & (TRACE_LENGTH - 1)];
+}
+
+// Entries are saved and loaded from oldest to newest
+int trace_get_length(const Trace *trace);
+TraceEntry *trace_get_entry(Trace *trace, int index);
+
+bool trace_save(Trace *trace, const char *path);
+TraceEntry *trace_load(const char *path, int *length);
+
+#endif /* trace_h */
@@ -0,0 +1,87 @@
+#include "common.h"
+#include <inttypes.h>
+#include <unistd.h>
+
+#include "cpu/65xx.h"
+#include "debug_map.h"
+#include "trace.h"
+
+// Decodes a binary trace saved by f-type into the same text as VERBOSE=1
+
+static void print_scanlines(int *current, int scanline) {
+    while (*current != scanline) {
+        *current = (*current >= 260 ? -1 : *current + 1);
+        printf("-- Scanline %d --\n", *current);
+    }
+}
+
+static void print_registers(const TraceEntry *entry) {
+    printf("\t\tA:%02x X:%02x Y:%02x P:%02x S:%02x CYC:%" PRIu64,
+           entry->a, entry->x, entry->y, entry->p, entry->s, entry->cycle);
+}
+
+int main(int argc, char *argv[]) {
+    bool show_registers = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r")) != -1) {
+        if (opt == 'r') {
+            show_registers = true;
+        } else {
+            argc = 0;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2) {
+        eprintf("Usage: %s [-r] trace_file [debug.map]\n", argv[0]);
+        eprintf("  -r  Show registers and cycle before each instruction\n");
+        return 1;
+    }
+    
+    int length;
+    TraceEntry *entries = trace_load(argv[optind], &length);
+    if (!entries) {
+        return 1;
+    }
+    DebugMap *dbg_map = NULL;
+    if (argc - optind > 1) {
+        dbg_map = debug_map_load(argv[optind + 1]);
+        if (!dbg_map) {
+            return 1;
+        }
+    }
+    
+    int scanline = length ? entries[0].scanline - 1 : 0;
+    for (int i = 0; i < length; i++) {
+        const TraceEntry *entry = &entries[i];
+        print_scanlines(&scanline, entry->scanline);
+        
+        const char *label = dbg_map ? debug_map_get_label(dbg_map, entry->pc)
+                                    : NULL;
+        if (label) {
+            // The VERBOSE output hides idle loops
+            if (!strcmp(label, "EndlessLoop")) {
+                continue;
+            }
+            printf(":%s\n", label);
+        }
+        
+        if (entry->type != TRACE_INSTRUCTION) {
+            printf("$%04x /%s\n", entry->pc,
+                   entry->type == TRACE_NMI ? "NMI" : "IRQ");
+            continue;
+        }
+        char str[32];
+        cpu_65xx_format_instruction(entry->opcode, entry->operands, str,
+                                    sizeof(str));
+        printf("$%04x %s", entry->pc, str);
+        if (show_registers) {
+            print_registers(entry);
+        }
+        printf("\n");
+    }
+    
+    if (dbg_map) {
+        debug_map_free(dbg_map);
+    }
+    free(entries);
+    return 0;
+}
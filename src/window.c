@@ -101,6 +101,24 @@ static bool window_update_area(Window *wnd) {
     return true;
 }
 
+// Converts the screen to the texture format once per presented frame
+static void update_texture(Window *wnd, const uint16_t *screen) {
+    void *pixels;
+    int pitch;
+    if (SDL_LockTexture(wnd->texture, NULL, &pixels, &pitch)) {
+        eprintf("%s\n", SDL_GetError());
+        return;
+    }
+    const uint32_t *palette = wnd->driver->palette;
+    for (int y = 0; y < wnd->driver->screen_h; y++) {
+        uint32_t *row = (uint32_t *)((uint8_t *)pixels + y * pitch);
+        for (int x = 0; x < wnd->driver->screen_w; x++) {
+            row[x] = palette[*screen++];
+        }
+    }
+    SDL_UnlockTexture(wnd->texture);
+}
+
 int window_toggle_fullscreen(Window *wnd) {
     SDL_PauseAudioDevice(wnd->audio_id, 1);
     SDL_RenderClear(wnd->renderer);
@@ -131,6 +149,16 @@ int thread_vm(Driver *driver) {
     while (driver->message != MSG_TERMINATE) {
         (*driver->advance_frame_func)(driver->vm, driver->frame, verbose);
         
+        SDL_AtomicLock(&sl_screen);
+        bool dump_trace = (driver->message == MSG_DUMP_TRACE);
+        if (dump_trace) {
+            driver->message = MSG_NONE;
+        }
+        SDL_AtomicUnlock(&sl_screen);
+        if (dump_trace && driver->dump_trace_func) {
+            (*driver->dump_trace_func)(driver->vm);
+        }
+        
         t_next += frame_length;
         int64_t t_left = t_next - SDL_GetPerformanceCounter();
         if (t_left > 0) {
@@ -209,7 +237,7 @@ int window_init(Window *wnd, Driver *driver, const char *filename) {
         eprintf("%s\n", SDL_GetError());
         return 1;
     }
-
+    
     // Compare physical resolution to display bounds to see
     // if we can rezise to pixel-perfect (2048x1568) mode
     int w, h;
@@ -239,7 +267,7 @@ int window_init(Window *wnd, Driver *driver, const char *filename) {
         eprintf("%s\n", SDL_GetError());
         return 1;
     }
-
+    
     // Use the system crosshair cursor, if available
     wnd->cursor = SDL_CreateSystemCursor(SDL_SYSTEM_CURSOR_CROSSHAIR);
     if (wnd->cursor) {
@@ -265,7 +293,7 @@ void window_cleanup(Window *wnd) {
             SDL_GameControllerClose(wnd->js[i]);
         }
     }
-
+    
     SDL_Quit();
 }
 
@@ -390,6 +418,16 @@ void window_loop(Window *wnd) {
                                 window_toggle_fullscreen(wnd);
                             }
                             break;
+                        case SDL_SCANCODE_T:
+                            if (event.key.state == SDL_PRESSED &&
+                                !event.key.repeat) {
+                                SDL_AtomicLock(&sl_screen);
+                                if (wnd->driver->message == MSG_NONE) {
+                                    wnd->driver->message = MSG_DUMP_TRACE;
+                                }
+                                SDL_AtomicUnlock(&sl_screen);
+                            }
+                            break;
                         default:
                             if (wnd->kb_assign < 0) {
                                 break;
@@ -419,7 +457,9 @@ void window_loop(Window *wnd) {
             }
         }
         if (quitting) {
+            SDL_AtomicLock(&sl_screen);
             wnd->driver->message = MSG_TERMINATE;
+            SDL_AtomicUnlock(&sl_screen);
             break;
         }
         
@@ -427,9 +467,8 @@ void window_loop(Window *wnd) {
         SDL_AtomicLock(&sl_screen);
         bool refresh = (last_frame != wnd->driver->frame);
         if (refresh) {
-            SDL_UpdateTexture(wnd->texture, NULL,
-                              wnd->driver->screens[!(wnd->driver->frame & 1)],
-                              wnd->driver->screen_w * sizeof(uint32_t));
+            update_texture(wnd,
+                           wnd->driver->screens[!(wnd->driver->frame & 1)]);
         }
         last_frame = wnd->driver->frame;
         SDL_AtomicUnlock(&sl_screen);